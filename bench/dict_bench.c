@@ -0,0 +1,146 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "codebook.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef CORPUS_PATH
+#define CORPUS_PATH "bench/chat_corpus.txt"
+#endif
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+//Splits the file into one message per line. The blocks point into *data.
+static struct block* read_lines(const char* path, char** data, size_t* count)
+{
+    FILE* f=fopen(path, "rb");
+    if(f==NULL)
+    {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long size=ftell(f);
+    fseek(f, 0, SEEK_SET);
+    *data=(char*)malloc(size+1);
+    size=fread(*data, 1, size, f);
+    fclose(f);
+    struct block* lines=NULL;
+    *count=0;
+    for(char* line=*data;line<*data+size;)
+    {
+        char* end=memchr(line, '\n', *data+size-line);
+        end=end==NULL?*data+size:end;
+        if(end!=line)
+        {
+            lines=(struct block*)realloc(lines, sizeof(struct block)*(*count+1));
+            lines[*count].data=(uint8_t*)line;
+            lines[*count].size=end-line;
+            (*count)++;
+        }
+        line=end+1;
+    }
+    return lines;
+}
+//Prints the pad spent per message when compressing with cb, or none at all
+//if cb is NULL. Messages that don't shrink are sent as they are, like in
+//chat.c.
+static void measure(
+    const char* name,
+    const struct codebook* cb,
+    const struct block* messages,
+    size_t count
+){
+    uint8_t buf[1<<16];
+    size_t plain=0, pad=0;
+    double begin=now_s();
+    for(size_t i=0;i<count;++i)
+    {
+        size_t size=messages[i].size;
+        if(cb!=NULL&&size>1&&size<=sizeof(buf))
+        {
+            size_t compressed=codebook_compress(
+                cb,
+                buf,
+                size-1,
+                messages[i].data,
+                size,
+                NULL
+            );
+            size=compressed!=0?compressed:size;
+        }
+        plain+=messages[i].size;
+        pad+=size;
+    }
+    double seconds=now_s()-begin;
+    printf(
+        "%-12s %10.2f %9.1f%% %10.0f\n",
+        name,
+        pad/(double)count,
+        pad*100.0/plain,
+        seconds*1e9/count
+    );
+}
+int main(int argc, char** argv)
+{
+    const char* path=argc>1?argv[1]:CORPUS_PATH;
+    char* data=NULL;
+    size_t count=0;
+    struct block* lines=read_lines(path, &data, &count);
+    if(lines==NULL||count<2)
+    {
+        fprintf(stderr, "Unable to read a corpus from \"%s\"\n", path);
+        return 1;
+    }
+    //Train on the first half and measure on the second, so the dictionary
+    //never sees the messages it is measured on.
+    size_t train_count=count/2;
+    struct codebook trained, builtin;
+    codebook_init_default(&builtin);
+    double begin=now_s();
+    if(codebook_train(&trained, lines, train_count))
+    {
+        return 1;
+    }
+    double train_seconds=now_s()-begin;
+    printf(
+        "%zu messages, trained on %zu in %.2f s, %u entries\n",
+        count,
+        train_count,
+        train_seconds,
+        trained.count
+    );
+    printf("%-12s %10s %10s %10s\n", "codebook", "pad/msg", "of plain", "ns/msg");
+    measure("none", NULL, lines+train_count, count-train_count);
+    measure("built-in", &builtin, lines+train_count, count-train_count);
+    measure("trained", &trained, lines+train_count, count-train_count);
+    free(lines);
+    free(data);
+    return 0;
+}
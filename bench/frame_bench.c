@@ -0,0 +1,166 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "frame.h"
+#include "node.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+//Every measurement streams roughly this many bytes of frames.
+#define BYTES_PER_RUN (256<<20)
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+//Writes frames of body_size bytes into socket until count have been sent.
+static void write_frames(int socket, size_t body_size, size_t count)
+{
+    //Send many frames per write(), the way a burst leaves the send queue.
+    size_t frame_size=FRAME_HEADER_SIZE+body_size;
+    size_t batch=(1<<20)/frame_size+1;
+    uint8_t* buf=(uint8_t*)calloc(batch, frame_size);
+    for(size_t i=0;i<batch;++i)
+    {
+        frame_write_header(buf+i*frame_size, body_size, i*body_size, 0);
+    }
+    while(count>0)
+    {
+        size_t frames=count<batch?count:batch;
+        size_t size=frames*frame_size;
+        for(size_t done=0;done<size;)
+        {
+            ssize_t w=write(socket, buf+done, size-done);
+            if(w<=0)
+            {
+                _exit(1);
+            }
+            done+=w;
+        }
+        count-=frames;
+    }
+    free(buf);
+}
+//The old way, a recv() for each header and another for each body.
+static size_t read_frames_naive(int socket, size_t count)
+{
+    size_t bytes=0;
+    uint8_t header[FRAME_HEADER_SIZE];
+    uint8_t* body=NULL;
+    for(size_t i=0;i<count;++i)
+    {
+        if(recv(socket, header, sizeof(header), MSG_WAITALL)!=sizeof(header))
+        {
+            break;
+        }
+        uint32_t size=0;
+        memcpy(&size, header+FRAME_SIZE_OFFSET, sizeof(size));
+        size=be32toh(size)&FRAME_SIZE_MASK;
+        body=(uint8_t*)realloc(body, size);
+        if(size!=0&&recv(socket, body, size, MSG_WAITALL)!=(ssize_t)size)
+        {
+            break;
+        }
+        bytes+=size;
+    }
+    free(body);
+    return bytes;
+}
+static size_t read_frames(int socket, size_t count)
+{
+    struct node n;
+    n.info=NULL;
+    n.socket=socket;
+    struct frame_reader r;
+    frame_reader_init(&r, FRAME_READER_DEFAULT_SIZE);
+    size_t bytes=0;
+    while(count>0&&frame_reader_fill(&r, &n)!=0)
+    {
+        struct frame_event e;
+        while(frame_reader_next(&r, &e))
+        {
+            if(e.type==FRAME_DATA)
+            {
+                bytes+=e.data_size;
+            }
+            else if(e.type==FRAME_END)
+            {
+                count--;
+            }
+        }
+    }
+    frame_reader_free(&r);
+    return bytes;
+}
+static double run(unsigned naive, size_t body_size, size_t count)
+{
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets)==-1)
+    {
+        return 0;
+    }
+    fflush(stdout);
+    pid_t pid=fork();
+    if(pid==0)
+    {
+        close(sockets[1]);
+        write_frames(sockets[0], body_size, count);
+        close(sockets[0]);
+        _exit(0);
+    }
+    close(sockets[0]);
+    double start=now_s();
+    size_t bytes=naive?
+        read_frames_naive(sockets[1], count):
+        read_frames(sockets[1], count);
+    double seconds=now_s()-start;
+    close(sockets[1]);
+    waitpid(pid, NULL, 0);
+    return bytes==body_size*count?count/seconds:0;
+}
+int main(void)
+{
+    printf("%10s %14s %14s %10s\n", "body", "naive fr/s", "ring fr/s", "ring MB/s");
+    for(size_t body_size=16;body_size<=(64<<10);body_size*=4)
+    {
+        size_t count=BYTES_PER_RUN/(FRAME_HEADER_SIZE+body_size);
+        double naive=run(1, body_size, count);
+        double ring=run(0, body_size, count);
+        printf(
+            "%10zu %14.0f %14.0f %10.1f\n",
+            body_size,
+            naive,
+            ring,
+            ring*body_size/1e6
+        );
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "key.h"
+#include "user.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#define KEY_COUNT 100000
+#define LOOKUP_ROUNDS 10
+#define HANDSHAKES 2000
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+static void synthetic_key(struct key* k)
+{
+    memset(k, 0, sizeof(struct key));
+    k->fd=-1;
+    k->journal_fd=-1;
+    keygen_random(k->id, sizeof(k->id));
+}
+static unsigned run_handshakes(
+    struct key_store* store,
+    int socket,
+    const uint8_t* local_id
+){
+    memcpy(store->local.id, local_id, sizeof(store->local.id));
+    struct user u;
+    user_init(&u, ID_REMOTE);
+    u.node.socket=socket;
+    for(unsigned i=0;i<HANDSHAKES;++i)
+    {
+        if(user_finish_connect(&u, store))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+int main(void)
+{
+    struct key_store store;
+    key_store_init(&store);
+    struct key* keys=(struct key*)malloc(sizeof(struct key)*KEY_COUNT);
+
+    double begin=now_s();
+    for(size_t i=0;i<KEY_COUNT;++i)
+    {
+        synthetic_key(&keys[i]);
+        if(key_store_add_remote(&store, &keys[i]))
+        {
+            fprintf(stderr, "Duplicate key id\n");
+            return 1;
+        }
+    }
+    double insert_s=now_s()-begin;
+    printf("insert  %d keys: %8.2f ms\n", KEY_COUNT, insert_s*1e3);
+
+    size_t found=0;
+    begin=now_s();
+    for(unsigned round=0;round<LOOKUP_ROUNDS;++round)
+    {
+        for(size_t i=0;i<KEY_COUNT;++i)
+        {
+            found+=key_store_find(&store, keys[(i*7919)%KEY_COUNT].id)!=NULL;
+        }
+    }
+    double hit_s=now_s()-begin;
+    struct key missing;
+    synthetic_key(&missing);
+    begin=now_s();
+    for(unsigned round=0;round<LOOKUP_ROUNDS*KEY_COUNT;++round)
+    {
+        missing.id[round%sizeof(missing.id)]++;
+        found+=key_store_find(&store, missing.id)!=NULL;
+    }
+    double miss_s=now_s()-begin;
+    printf(
+        "lookup hit:  %8.1f ns\nlookup miss: %8.1f ns\n",
+        hit_s*1e9/(LOOKUP_ROUNDS*KEY_COUNT),
+        miss_s*1e9/(LOOKUP_ROUNDS*KEY_COUNT)
+    );
+    if(found!=LOOKUP_ROUNDS*KEY_COUNT)
+    {
+        fprintf(stderr, "Lookups found %zu keys\n", found);
+        return 1;
+    }
+
+    //Handshakes between two processes that both know all the keys.
+    int sockets[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets)==-1)
+    {
+        perror("socketpair");
+        return 1;
+    }
+    pid_t child=fork();
+    if(child==0)
+    {
+        close(sockets[0]);
+        _exit(run_handshakes(&store, sockets[1], keys[1].id));
+    }
+    close(sockets[1]);
+    begin=now_s();
+    unsigned failed=run_handshakes(&store, sockets[0], keys[0].id);
+    double handshake_s=now_s()-begin;
+    int status=0;
+    waitpid(child, &status, 0);
+    if(failed||status!=0)
+    {
+        fprintf(stderr, "Handshake failed\n");
+        return 1;
+    }
+    printf("handshake:   %8.1f us\n", handshake_s*1e6/HANDSHAKES);
+    close(sockets[0]);
+    free(keys);
+    key_store_close(&store);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+//Pipes this many bytes from one otpchat --pipe to another over loopback.
+#define DEFAULT_BYTES (256<<20)
+#define PORT "24137"
+#define PATTERN_SIZE (1<<20)
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+//Runs otpchat with the given arguments, stdin and stdout redirected to the
+//given descriptors. Returns the pid.
+static pid_t spawn(int in, int out, char** argv)
+{
+    pid_t pid=fork();
+    if(pid==0)
+    {
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        int null=open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(1);
+    }
+    return pid;
+}
+static unsigned copy_file(const char* from, const char* to)
+{
+    int in=open(from, O_RDONLY);
+    int out=open(to, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    static uint8_t buf[1<<20];
+    ssize_t r=0;
+    while(in!=-1&&out!=-1&&(r=read(in, buf, sizeof(buf)))>0)
+    {
+        if(write(out, buf, r)!=r)
+        {
+            r=-1;
+            break;
+        }
+    }
+    if(in!=-1) close(in);
+    if(out!=-1) close(out);
+    return in==-1||out==-1||r!=0;
+}
+static void remove_key(const char* dir, const char* name)
+{
+    static const char* suffixes[]={"", ".used", ".journal"};
+    char path[256];
+    for(unsigned i=0;i<sizeof(suffixes)/sizeof(suffixes[0]);++i)
+    {
+        snprintf(path, sizeof(path), "%s/%s%s", dir, name, suffixes[i]);
+        unlink(path);
+    }
+}
+int main(int argc, char** argv)
+{
+    const char* otpchat=argc>1?argv[1]:OTPCHAT_PATH;
+    size_t bytes=argc>2?strtoull(argv[2], NULL, 0):DEFAULT_BYTES;
+
+    char dir[]="/tmp/otpchat-pipe-bench-XXXXXX";
+    if(mkdtemp(dir)==NULL)
+    {
+        return 1;
+    }
+    //Each end gets its own copy of the keys, like on two separate hosts.
+    char a[64], b[64], la[64], lb[64], size[32];
+    snprintf(a, sizeof(a), "%s/a", dir);
+    snprintf(b, sizeof(b), "%s/b", dir);
+    snprintf(la, sizeof(la), "%s/la", dir);
+    snprintf(lb, sizeof(lb), "%s/lb", dir);
+    snprintf(size, sizeof(size), "%zu", bytes+(1<<20));
+    char* gen_a[]={(char*)otpchat, "--generate", size, a, NULL};
+    char* gen_b[]={(char*)otpchat, "--generate", size, b, NULL};
+    int status=0;
+    waitpid(spawn(STDIN_FILENO, STDOUT_FILENO, gen_a), &status, 0);
+    waitpid(spawn(STDIN_FILENO, STDOUT_FILENO, gen_b), &status, 0);
+    if(status!=0||copy_file(a, la)||copy_file(b, lb))
+    {
+        fprintf(stderr, "Unable to create keys with %s\n", otpchat);
+        return 1;
+    }
+
+    int null=open("/dev/null", O_RDWR);
+    int to_sender[2], from_receiver[2];
+    if(pipe(to_sender)||pipe(from_receiver))
+    {
+        return 1;
+    }
+    //Otherwise the sender would hold its own stdin open.
+    int fds[]={to_sender[0], to_sender[1], from_receiver[0], from_receiver[1]};
+    for(unsigned i=0;i<sizeof(fds)/sizeof(fds[0]);++i)
+    {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    char* receiver_argv[]={(char*)otpchat, "--pipe", la, lb, PORT, NULL};
+    pid_t receiver=spawn(null, from_receiver[1], receiver_argv);
+    close(from_receiver[1]);
+    //Give it a moment to start listening.
+    usleep(200000);
+    char* sender_argv[]={
+        (char*)otpchat, "--pipe", b, a, "127.0.0.1:" PORT, NULL
+    };
+    pid_t sender=spawn(to_sender[0], null, sender_argv);
+    close(to_sender[0]);
+
+    uint8_t* pattern=(uint8_t*)malloc(PATTERN_SIZE);
+    for(size_t i=0;i<PATTERN_SIZE;++i)
+    {
+        pattern[i]=(uint8_t)(i*2654435761u>>13);
+    }
+    double start=now_s();
+    pid_t writer=fork();
+    if(writer==0)
+    {
+        close(from_receiver[0]);
+        for(size_t done=0;done<bytes;)
+        {
+            size_t n=bytes-done<PATTERN_SIZE?bytes-done:PATTERN_SIZE;
+            ssize_t w=write(to_sender[1], pattern, n);
+            if(w<=0)
+            {
+                _exit(1);
+            }
+            done+=w;
+        }
+        _exit(0);
+    }
+    close(to_sender[1]);
+
+    static uint8_t buf[PATTERN_SIZE];
+    size_t received=0, mismatches=0;
+    double first_byte=0;
+    ssize_t r=0;
+    while((r=read(from_receiver[0], buf, sizeof(buf)))>0)
+    {
+        if(received==0)
+        {
+            first_byte=now_s()-start;
+        }
+        for(ssize_t i=0;i<r;)
+        {
+            size_t at=(received+i)%PATTERN_SIZE;
+            size_t n=PATTERN_SIZE-at;
+            n=n<(size_t)(r-i)?n:(size_t)(r-i);
+            mismatches+=memcmp(buf+i, pattern+at, n)!=0;
+            i+=n;
+        }
+        received+=r;
+    }
+    double seconds=now_s()-start;
+    waitpid(writer, NULL, 0);
+    waitpid(sender, NULL, 0);
+    waitpid(receiver, NULL, 0);
+    remove_key(dir, "a");
+    remove_key(dir, "b");
+    remove_key(dir, "la");
+    remove_key(dir, "lb");
+    rmdir(dir);
+    free(pattern);
+
+    if(received!=bytes||mismatches!=0)
+    {
+        fprintf(
+            stderr,
+            "Received %zu of %zu bytes, %zu corrupted blocks\n",
+            received,
+            bytes,
+            mismatches
+        );
+        return 1;
+    }
+    printf(
+        "%zu MiB in %.2f s: %.1f MiB/s, first byte after %.1f ms\n",
+        bytes>>20,
+        seconds,
+        bytes/seconds/(1<<20),
+        first_byte*1e3
+    );
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "frame.h"
+#include "sendqueue.h"
+#include "uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+//Every measurement streams roughly this many bytes of frames.
+#define BYTES_PER_RUN (128<<20)
+#define SEND_QUEUE_LIMIT (1<<20)
+
+struct result
+{
+    double seconds;
+    uint64_t syscalls;
+};
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+//Connects a pair of TCP sockets over loopback.
+static unsigned connect_pair(int sockets[2])
+{
+    struct sockaddr_in addr;
+    socklen_t addr_size=sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family=AF_INET;
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    int listener=socket(AF_INET, SOCK_STREAM, 0);
+    if( listener==-1||
+        bind(listener, (struct sockaddr*)&addr, sizeof(addr))==-1||
+        listen(listener, 1)==-1||
+        getsockname(listener, (struct sockaddr*)&addr, &addr_size)==-1
+    ){
+        return 1;
+    }
+    sockets[0]=socket(AF_INET, SOCK_STREAM, 0);
+    if(connect(sockets[0], (struct sockaddr*)&addr, sizeof(addr))==-1)
+    {
+        close(listener);
+        return 1;
+    }
+    sockets[1]=accept(listener, NULL, NULL);
+    close(listener);
+    //Like otpchat, small messages go out right away.
+    int one=1;
+    setsockopt(sockets[0], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sockets[1]==-1;
+}
+//Tops the send queue up with frames of body_size bytes, as long as there
+//are some left to send.
+static void queue_frames(
+    struct send_queue* q,
+    size_t body_size,
+    size_t* left,
+    uint64_t* head
+){
+    uint8_t header[FRAME_HEADER_SIZE];
+    while(*left>0&&!send_queue_reserve(q, FRAME_HEADER_SIZE, body_size))
+    {
+        frame_write_header(header, body_size, *head, 0);
+        uint8_t* body=send_queue_push(q, header, FRAME_HEADER_SIZE, body_size);
+        memset(body, 0x5a, body_size);
+        *head+=body_size;
+        (*left)--;
+    }
+}
+//Returns how many frames the reader finished.
+static size_t read_frames(struct frame_reader* r)
+{
+    size_t frames=0;
+    struct frame_event e;
+    while(frame_reader_next(r, &e))
+    {
+        frames+=e.type==FRAME_END;
+    }
+    return frames;
+}
+//The existing path: non-blocking sockets, an epoll_wait() whenever both
+//ends would block, and a readv() or writev() for everything else.
+static struct result run_epoll(int sockets[2], size_t body_size, size_t count)
+{
+    struct result res={0, 0};
+    fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+    fcntl(sockets[1], F_SETFL, O_NONBLOCK);
+    int epoll=epoll_create1(0);
+    struct epoll_event ev;
+    ev.events=EPOLLIN|EPOLLOUT|EPOLLET;
+    ev.data.fd=sockets[0];
+    epoll_ctl(epoll, EPOLL_CTL_ADD, sockets[0], &ev);
+    ev.data.fd=sockets[1];
+    epoll_ctl(epoll, EPOLL_CTL_ADD, sockets[1], &ev);
+
+    struct send_queue q;
+    send_queue_init(&q, SEND_QUEUE_LIMIT);
+    struct frame_reader r;
+    frame_reader_init(&r, FRAME_READER_DEFAULT_SIZE);
+    size_t left=count, received=0;
+    uint64_t head=0;
+    double start=now_s();
+    while(received<count)
+    {
+        unsigned progress=0;
+        queue_frames(&q, body_size, &left, &head);
+        if(!send_queue_empty(&q))
+        {
+            struct iovec iov[SEND_QUEUE_MAX_IOV];
+            size_t iov_count=send_queue_iov(&q, iov, SEND_QUEUE_MAX_IOV);
+            ssize_t sent=writev(sockets[0], iov, iov_count);
+            res.syscalls++;
+            if(sent>0)
+            {
+                send_queue_advance(&q, sent);
+                progress=1;
+            }
+        }
+        struct iovec iov[2];
+        size_t iov_count=frame_reader_space(&r, iov);
+        if(iov_count!=0)
+        {
+            ssize_t got=readv(sockets[1], iov, iov_count);
+            res.syscalls++;
+            if(got==0)
+            {
+                break;
+            }
+            if(got>0)
+            {
+                frame_reader_commit(&r, got);
+                received+=read_frames(&r);
+                progress=1;
+            }
+        }
+        if(!progress)
+        {
+            struct epoll_event events[2];
+            epoll_wait(epoll, events, 2, -1);
+            res.syscalls++;
+        }
+    }
+    res.seconds=now_s()-start;
+    if(received<count)
+    {
+        res.seconds=0;
+    }
+    frame_reader_free(&r);
+    send_queue_free(&q);
+    close(epoll);
+    return res;
+}
+static void request_done(struct uring_request* req)
+{
+    (void)req;
+}
+//The io_uring path: a readv and a writev are kept in the ring, and every
+//round submits the new ones and waits for a completion in one call.
+static struct result run_uring(int sockets[2], size_t body_size, size_t count)
+{
+    struct result res={0, 0};
+    struct uring u;
+    if(uring_init(&u, 8))
+    {
+        return res;
+    }
+    struct send_queue q;
+    send_queue_init(&q, SEND_QUEUE_LIMIT);
+    struct frame_reader r;
+    frame_reader_init(&r, FRAME_READER_DEFAULT_SIZE);
+    struct uring_request recv_req={request_done, NULL, 0, 0, 0};
+    struct uring_request send_req={request_done, NULL, 0, 0, 0};
+    struct iovec recv_iov[2];
+    struct iovec send_iov[SEND_QUEUE_MAX_IOV];
+    size_t left=count, received=0;
+    uint64_t head=0;
+    double start=now_s();
+    while(received<count)
+    {
+        queue_frames(&q, body_size, &left, &head);
+        if(!send_req.busy&&!send_queue_empty(&q))
+        {
+            size_t iov_count=send_queue_iov(&q, send_iov, SEND_QUEUE_MAX_IOV);
+            uring_writev(&u, &send_req, sockets[0], send_iov, iov_count);
+        }
+        size_t iov_count=frame_reader_space(&r, recv_iov);
+        if(!recv_req.busy&&iov_count!=0)
+        {
+            uring_readv(&u, &recv_req, sockets[1], recv_iov, iov_count);
+        }
+        if(uring_submit(&u, 1))
+        {
+            break;
+        }
+        //The callbacks only mark the requests done, the results are used
+        //here so that both paths share the same bookkeeping.
+        unsigned send_busy=send_req.busy, recv_busy=recv_req.busy;
+        uring_reap(&u);
+        if(send_busy&&!send_req.busy&&send_req.result>0)
+        {
+            send_queue_advance(&q, send_req.result);
+        }
+        if(recv_busy&&!recv_req.busy)
+        {
+            if(recv_req.result<=0)
+            {
+                break;
+            }
+            frame_reader_commit(&r, recv_req.result);
+            received+=read_frames(&r);
+        }
+    }
+    res.seconds=now_s()-start;
+    res.syscalls=u.syscalls;
+    if(received<count)
+    {
+        res.seconds=0;
+    }
+    //Ends the requests still waiting for data.
+    shutdown(sockets[0], SHUT_RDWR);
+    shutdown(sockets[1], SHUT_RDWR);
+    uring_free(&u);
+    frame_reader_free(&r);
+    send_queue_free(&q);
+    return res;
+}
+static struct result run(unsigned use_uring, size_t body_size, size_t count)
+{
+    struct result res={0, 0};
+    int sockets[2];
+    if(connect_pair(sockets))
+    {
+        return res;
+    }
+    res=use_uring?
+        run_uring(sockets, body_size, count):
+        run_epoll(sockets, body_size, count);
+    close(sockets[0]);
+    close(sockets[1]);
+    return res;
+}
+int main(void)
+{
+    printf(
+        "%8s %12s %12s %16s %16s\n",
+        "body",
+        "epoll MiB/s",
+        "uring MiB/s",
+        "epoll calls/MiB",
+        "uring calls/MiB"
+    );
+    for(size_t body_size=64;body_size<=(64<<10);body_size*=4)
+    {
+        size_t count=BYTES_PER_RUN/(FRAME_HEADER_SIZE+body_size);
+        double mib=count*(double)(FRAME_HEADER_SIZE+body_size)/(1<<20);
+        struct result e=run(0, body_size, count);
+        struct result u=run(1, body_size, count);
+        if(e.seconds==0||u.seconds==0)
+        {
+            fprintf(stderr, "Transfer of %zu byte frames failed\n", body_size);
+            return 1;
+        }
+        printf(
+            "%8zu %12.1f %12.1f %16.1f %16.1f\n",
+            body_size,
+            mib/e.seconds,
+            mib/u.seconds,
+            e.syscalls/mib,
+            u.syscalls/mib
+        );
+    }
+    return 0;
+}
@@ -0,0 +1,88 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "xor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define MIN_SIZE 16
+#define MAX_SIZE (64<<20)
+//Every measurement XORs roughly this many bytes in total.
+#define BYTES_PER_RUN (1ull<<30)
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+int main(void)
+{
+    static const char* kernels[]={"scalar", "sse2", "avx2", "avx512"};
+    uint8_t* pad=(uint8_t*)malloc(MAX_SIZE);
+    uint8_t* data=(uint8_t*)malloc(MAX_SIZE);
+    for(size_t i=0;i<MAX_SIZE;++i)
+    {
+        pad[i]=(uint8_t)(i*2654435761u>>24);
+        data[i]=(uint8_t)i;
+    }
+    printf("%-8s %10s %10s\n", "kernel", "size", "GB/s");
+    for(size_t k=0;k<sizeof(kernels)/sizeof(kernels[0]);++k)
+    {
+        if(xor_use_kernel(kernels[k]))
+        {
+            printf("%-8s %10s %10s\n", kernels[k], "-", "unsupported");
+            continue;
+        }
+        for(size_t size=MIN_SIZE;size<=MAX_SIZE;size*=4)
+        {
+            size_t iterations=BYTES_PER_RUN/size;
+            //Warm up caches and page tables
+            xor_blocks(data, data, pad, size);
+            double begin=now_s();
+            for(size_t i=0;i<iterations;++i)
+            {
+                xor_blocks(data, data, pad, size);
+            }
+            double elapsed=now_s()-begin;
+            printf(
+                "%-8s %10zu %10.2f\n",
+                kernels[k],
+                size,
+                iterations*(double)size/elapsed/1e9
+            );
+        }
+    }
+    //Keep the result observable so the loops aren't optimized out.
+    unsigned sum=0;
+    for(size_t i=0;i<MAX_SIZE;i+=4096)
+    {
+        sum+=data[i];
+    }
+    fprintf(stderr, "checksum %u\n", sum);
+    free(pad);
+    free(data);
+    return 0;
+}
@@ -22,6 +22,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "args.h"
+#include "prefetch.h"
+#include "sendqueue.h"
+#include "frame.h"
+#include "reclaim.h"
+#include "key.h"
+#include "resolver.h"
 #include <string.h>
 #include <stdlib.h>
 
@@ -34,6 +40,21 @@ void free_generate_args(struct generate_args* a)
         a->key_path=NULL;
     }
 }
+void free_train_args(struct train_args* a)
+{
+    for(size_t i=0;i<a->history_count;++i)
+    {
+        free(a->history_paths[i]);
+    }
+    free(a->history_paths);
+    a->history_paths=NULL;
+    a->history_count=0;
+    if(a->dict_path!=NULL)
+    {
+        free(a->dict_path);
+        a->dict_path=NULL;
+    }
+}
 void free_chat_args(struct chat_args* a)
 {
     if(a->local_key_path!=NULL)
@@ -46,6 +67,21 @@ void free_chat_args(struct chat_args* a)
         free(a->remote_key_path);
         a->remote_key_path=NULL;
     }
+    if(a->key_dir!=NULL)
+    {
+        free(a->key_dir);
+        a->key_dir=NULL;
+    }
+    if(a->dict_path!=NULL)
+    {
+        free(a->dict_path);
+        a->dict_path=NULL;
+    }
+    if(a->hosts_path!=NULL)
+    {
+        free(a->hosts_path);
+        a->hosts_path=NULL;
+    }
     free_address(&a->addr);
 }
 
@@ -60,6 +96,33 @@ static unsigned parse_generate_args(
     char** argv,
     struct generate_args* a
 ){
+    a->key_path=NULL;
+    a->threads=0;
+    a->benchmark=0;
+    while(argc>0&&strncmp(argv[0], "--", 2)==0)
+    {
+        if(strcmp(argv[0], "--benchmark")==0)
+        {
+            a->benchmark=1;
+        }
+        else if(strcmp(argv[0], "--threads")==0&&argc>=2)
+        {
+            char* endptr=NULL;
+            a->threads=strtol(argv[1], &endptr, 0);
+            if(*argv[1]==0||*endptr!=0)
+            {
+                return 1;
+            }
+            argc--;
+            argv++;
+        }
+        else
+        {
+            return 1;
+        }
+        argc--;
+        argv++;
+    }
     if(argc!=2)
     {
         return 1;
@@ -73,24 +136,197 @@ static unsigned parse_generate_args(
     a->key_path=copy_string(argv[1]);
     return 0;
 }
+static unsigned parse_train_args(
+    int argc,
+    char** argv,
+    struct train_args* a
+){
+    a->history_paths=NULL;
+    a->history_count=0;
+    a->dict_path=NULL;
+    if(argc<2)
+    {
+        return 1;
+    }
+    a->history_count=argc-1;
+    a->history_paths=(char**)malloc(sizeof(char*)*a->history_count);
+    for(size_t i=0;i<a->history_count;++i)
+    {
+        a->history_paths[i]=copy_string(argv[i]);
+    }
+    a->dict_path=copy_string(argv[argc-1]);
+    return 0;
+}
+static unsigned parse_size(const char* str, size_t* size)
+{
+    char* endptr=NULL;
+    *size=strtoll(str, &endptr, 0);
+    return *str==0||*endptr!=0;
+}
+static unsigned parse_chat_options(
+    int* argc,
+    char*** argv,
+    struct chat_args* a
+){
+    a->prefetch_window=PREFETCH_DEFAULT_WINDOW;
+    a->reclaim_batch=RECLAIM_DEFAULT_BATCH;
+    a->sync_messages=KEY_DEFAULT_SYNC_MESSAGES;
+    a->sync_ms=KEY_DEFAULT_SYNC_MS;
+    a->key_cache_size=KEY_STORE_DEFAULT_CACHE_SIZE;
+    a->send_queue_limit=SEND_QUEUE_DEFAULT_LIMIT;
+    a->max_frame=FRAME_DEFAULT_MAX_SIZE;
+    a->compress=1;
+    a->pipe=0;
+    a->io_uring=0;
+    a->crypto_thread=1;
+    a->dns_ttl=RESOLVER_DEFAULT_TTL;
+    while(*argc>0&&strncmp((*argv)[0], "--", 2)==0)
+    {
+        const char* option=(*argv)[0];
+        //The only option without a value
+        if(strcmp(option, "--pipe")==0)
+        {
+            a->pipe=1;
+            *argc-=1;
+            *argv+=1;
+            continue;
+        }
+        if(*argc<2)
+        {
+            return 1;
+        }
+        const char* value=(*argv)[1];
+        if(strcmp(option, "--prefetch")==0)
+        {
+            if(parse_size(value, &a->prefetch_window))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--reclaim-batch")==0)
+        {
+            if(parse_size(value, &a->reclaim_batch))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--sync-messages")==0)
+        {
+            if(parse_size(value, &a->sync_messages))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--key-dir")==0)
+        {
+            free(a->key_dir);
+            a->key_dir=copy_string(value);
+        }
+        else if(strcmp(option, "--dict")==0)
+        {
+            free(a->dict_path);
+            a->dict_path=copy_string(value);
+        }
+        else if(strcmp(option, "--key-cache")==0)
+        {
+            if(parse_size(value, &a->key_cache_size))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--sync-ms")==0)
+        {
+            if(parse_size(value, &a->sync_ms))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--compress")==0)
+        {
+            if(parse_size(value, &a->compress))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--crypto-thread")==0)
+        {
+            if(parse_size(value, &a->crypto_thread))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--dns-ttl")==0)
+        {
+            if(parse_size(value, &a->dns_ttl))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--hosts")==0)
+        {
+            free(a->hosts_path);
+            a->hosts_path=copy_string(value);
+        }
+        else if(strcmp(option, "--io-uring")==0)
+        {
+            if(parse_size(value, &a->io_uring))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--max-frame")==0)
+        {
+            if(parse_size(value, &a->max_frame))
+            {
+                return 1;
+            }
+        }
+        else if(strcmp(option, "--send-queue")==0)
+        {
+            if(parse_size(value, &a->send_queue_limit))
+            {
+                return 1;
+            }
+        }
+        else
+        {
+            return 1;
+        }
+        *argc-=2;
+        *argv+=2;
+    }
+    return 0;
+}
 static unsigned parse_chat_args(
     int argc,
     char** argv,
     struct chat_args* a
 ){
-    if(argc<2||argc>3)
+    a->local_key_path=NULL;
+    a->remote_key_path=NULL;
+    a->key_dir=NULL;
+    a->dict_path=NULL;
+    a->hosts_path=NULL;
+    a->addr.node=NULL;
+    if(parse_chat_options(&argc, &argv, a))
     {
         return 1;
     }
-    if(argc==3)
+    //Remote keys come from the key directory when one is given.
+    int keys=a->key_dir!=NULL?1:2;
+    if(argc<keys||argc>keys+1)
+    {
+        return 1;
+    }
+    if(argc==keys+1)
     {
         //It is possible that only a port was given.
         char* endptr=NULL;
-        a->addr.port=strtol(argv[2], &endptr, 0);
+        a->addr.port=strtol(argv[keys], &endptr, 0);
         if(*endptr!='\0')
         {
             //Not a port, is it an address?
-            if(parse_address(&a->addr, argv[2]))
+            if(parse_address(&a->addr, argv[keys]))
             {
                 return 1;
             }
@@ -109,7 +345,10 @@ static unsigned parse_chat_args(
         a->addr.port=DEFAULT_PORT;
     }
     a->local_key_path=copy_string(argv[0]);
-    a->remote_key_path=copy_string(argv[1]);
+    if(keys==2)
+    {
+        a->remote_key_path=copy_string(argv[1]);
+    }
     return 0;
 }
 unsigned parse_args(struct args* a, int argc, char** argv)
@@ -122,6 +361,14 @@ unsigned parse_args(struct args* a, int argc, char** argv)
             return 1;
         }
     }
+    else if(argc>=2&&strcmp(argv[1], "--train-dict")==0)
+    {
+        a->mode=MODE_TRAIN;
+        if(parse_train_args(argc-2, argv+2, &a->mode_args.train))
+        {
+            return 1;
+        }
+    }
     else
     {
         a->mode=MODE_CHAT;
@@ -142,6 +389,9 @@ void free_args(struct args* a)
     case MODE_GENERATE:
         free_generate_args(&a->mode_args.generate);
         break;
+    case MODE_TRAIN:
+        free_train_args(&a->mode_args.train);
+        break;
     default:
         break;
     }
@@ -31,15 +31,58 @@ SOFTWARE.
     {
         size_t key_size;
         char* key_path;
+        //0 picks one thread per CPU.
+        unsigned threads;
+        //Measure generation speed with different thread counts instead of
+        //leaving a key behind.
+        unsigned benchmark;
     };
     void free_generate_args(struct generate_args* a);
+    struct train_args
+    {
+        //Histories written by /export, one message per line.
+        char** history_paths;
+        size_t history_count;
+        char* dict_path;
+    };
+    void free_train_args(struct train_args* a);
     struct chat_args
     {
         char* local_key_path;
+        //NULL when only key_dir is used.
         char* remote_key_path;
+        //Directory of remote keys opened on demand, or NULL.
+        char* key_dir;
+        size_t key_cache_size;
 
         unsigned wait_for_remote;
         struct address addr;
+
+        //Bytes of pad kept resident ahead of each head, 0 disables.
+        size_t prefetch_window;
+        //Consumed pad is wiped in batches of this size, 0 disables.
+        size_t reclaim_batch;
+        //Group commit policy of the key head journals
+        size_t sync_messages;
+        size_t sync_ms;
+        //Most bytes of unsent messages kept in memory.
+        size_t send_queue_limit;
+        //Longest message accepted from the remote.
+        size_t max_frame;
+        //Relay stdin to the remote and the remote to stdout, without a UI.
+        unsigned pipe;
+        //Do socket and pad I/O through an io_uring.
+        size_t io_uring;
+        //Decrypt received messages on a helper thread.
+        size_t crypto_thread;
+        //Seconds resolved addresses are remembered for.
+        size_t dns_ttl;
+        //Names looked up here before DNS, or NULL.
+        char* hosts_path;
+        //Offer compression to the remote.
+        size_t compress;
+        //Codebook trained with --train-dict, or NULL for the built-in one.
+        char* dict_path;
     };
     void free_chat_args(struct chat_args* a);
     struct args
@@ -48,12 +91,14 @@ SOFTWARE.
         {
             MODE_INVALID=0,
             MODE_CHAT,
-            MODE_GENERATE
+            MODE_GENERATE,
+            MODE_TRAIN
         } mode;
         union
         {
             struct chat_args chat;
             struct generate_args generate;
+            struct train_args train;
         } mode_args;
     };
     unsigned parse_args(struct args* a, int argc, char** argv);
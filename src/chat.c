@@ -28,21 +28,23 @@ SOFTWARE.
 #include "node.h"
 #include "user.h"
 #include "ui.h"
+#include "frame.h"
+#include "xor.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <math.h>
 #include <stdlib.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
 #include <endian.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <locale.h>
-#define MESSAGE_HEADER_SIZE 12
-#define MESSAGE_SIZE_OFFSET 0
-#define MESSAGE_HEAD_OFFSET 4
 
 const char* chat_id_name(struct chat_state* state, uint32_t id)
 {
@@ -53,40 +55,93 @@ const char* chat_id_name(struct chat_state* state, uint32_t id)
     case ID_LOCAL:
         return state->local.name;
     case ID_REMOTE:
-        return state->remote.name;
+        return state->current->remote.name;
     default:
         return "Unknown";
     }
 }
+//Writes all of data to stdout in --pipe mode. Stops the program if stdout
+//is gone.
+static void chat_pipe_write(
+    struct chat_state* state,
+    const uint8_t* data,
+    size_t size
+){
+    while(size>0)
+    {
+        ssize_t w=write(STDOUT_FILENO, data, size);
+        if(w==-1)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            if(errno==EAGAIN||errno==EWOULDBLOCK)
+            {//stdout shares stdin's O_NONBLOCK, as on a tty or a socket.
+                struct pollfd out={STDOUT_FILENO, POLLOUT, 0};
+                if(poll(&out, 1, -1)!=-1||errno==EINTR)
+                {
+                    continue;
+                }
+            }
+            state->running=0;
+            return;
+        }
+        data+=w;
+        size-=w;
+    }
+}
 void chat_push_message(
     struct chat_state* state,
+    struct chat_peer* peer,
     const struct message* msg
 ){
-    state->history=(struct message*)realloc(
-        state->history,
-        (++state->history_size)*sizeof(struct message)
+    if(state->pipe)
+    {//No history is kept, the remote's messages go straight to stdout.
+        if(msg->id==ID_STATUS)
+        {
+            fprintf(
+                stderr,
+                "%.*s\n",
+                (int)msg->text.size,
+                (const char*)msg->text.data
+            );
+        }
+        else if(msg->id==ID_REMOTE)
+        {
+            chat_pipe_write(state, msg->text.data, msg->text.size);
+        }
+        return;
+    }
+    peer->history=(struct message*)realloc(
+        peer->history,
+        (++peer->history_size)*sizeof(struct message)
     );
-    struct message* new_msg=&state->history[state->history_size-1];
+    struct message* new_msg=&peer->history[peer->history_size-1];
     new_msg->id=msg->id;
     new_msg->timestamp=msg->timestamp;
     new_msg->text.size=msg->text.size;
     new_msg->text.data=(uint8_t*)malloc(msg->text.size);
     memcpy(new_msg->text.data, msg->text.data, msg->text.size);
 
-    if(state->history_line!=0)
+    if(peer->history_line!=0)
+    {
+        peer->history_line+=ui_message_lines(new_msg, state->history_width);
+    }
+    if(peer!=state->current)
     {
-        state->history_line+=ui_message_lines(new_msg, state->history_width);
+        peer->unread++;
     }
 
     ui_update(state);
 }
-void chat_push_status(
+static void chat_push_status_va(
     struct chat_state* state,
+    struct chat_peer* peer,
     const char* format,
-    ...
+    va_list args
 ){
-    va_list args, args_copy;
-    va_start(args, format);
+    va_list args_copy;
     va_copy(args_copy, args);
 
     struct message status;
@@ -95,34 +150,277 @@ void chat_push_status(
     status.text.size=vsnprintf(NULL, 0, format, args_copy);
     status.text.data=(uint8_t*)malloc(status.text.size+1);
     vsprintf((char*)status.text.data, format, args);
-    chat_push_message(state, &status);
+    chat_push_message(state, peer, &status);
     free_message(&status);
-    va_end(args);
     va_end(args_copy);
 }
-unsigned chat_begin_connect(struct chat_state* state, struct address* addr)
+void chat_push_status(
+    struct chat_state* state,
+    const char* format,
+    ...
+){
+    va_list args;
+    va_start(args, format);
+    chat_push_status_va(state, state->current, format, args);
+    va_end(args);
+}
+//Adds a status message to the history of peer.
+static void chat_peer_status(
+    struct chat_peer* peer,
+    const char* format,
+    ...
+){
+    va_list args;
+    va_start(args, format);
+    chat_push_status_va(peer->state, peer, format, args);
+    va_end(args);
+}
+static void chat_peer_ready(struct loop_watch* w);
+static void chat_listen_ready(struct loop_watch* w);
+static void chat_input_ready(struct loop_watch* w);
+static void chat_resize_ready(struct loop_watch* w);
+static void chat_uring_ready(struct loop_watch* w);
+static void chat_crypto_ready(struct loop_watch* w);
+static void chat_resolver_ready(struct loop_watch* w);
+static void chat_wait_decrypts(struct chat_peer* peer);
+static void chat_recv_done(struct uring_request* req);
+static void chat_send_done(struct uring_request* req);
+static void chat_readahead_done(struct uring_request* req);
+//Returns a new peer, or NULL if there's no room for one.
+static struct chat_peer* chat_add_peer(struct chat_state* state)
 {
-    if(user_begin_connect(&state->remote, addr))
+    if(state->peers_size==CHAT_MAX_PEERS)
     {
-        chat_push_status(
-            state,
-            "Connecting to %s:%d failed",
-            addr->node,
-            addr->port
+        return NULL;
+    }
+    struct chat_peer* peer=(struct chat_peer*)malloc(sizeof(struct chat_peer));
+    peer->state=state;
+    peer->index=state->peers_size;
+    user_init(&peer->remote, ID_REMOTE);
+    peer->remote.offered_features=state->offered_features;
+    if(state->offered_features&USER_FEATURE_DICT)
+    {
+        peer->remote.dict_id=state->dict.id;
+    }
+    if(peer->index==0)
+    {
+        user_set_name(&peer->remote, "Remote");
+    }
+    else
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "Remote %zu", peer->index+1);
+        user_set_name(&peer->remote, name);
+    }
+    peer->history=NULL;
+    peer->history_size=0;
+    peer->history_line=0;
+    peer->unread=0;
+
+    frame_reader_init(&peer->reader, FRAME_READER_DEFAULT_SIZE);
+    frame_reader_set_max_size(&peer->reader, state->max_frame);
+    peer->receiving.data=NULL;
+    peer->receiving.size=0;
+    peer->receiving_capacity=0;
+    peer->receiving_flags=0;
+    peer->receiving_pad=NULL;
+    peer->receiving_offset=0;
+    peer->receiving_pinned=RECLAIM_UNPINNED;
+    peer->receiving_streamed=0;
+    peer->receiving_job=NULL;
+    peer->decrypting=0;
+    peer->decrypting_pinned=RECLAIM_UNPINNED;
+    peer->incoming=0;
+    peer->resolving=NULL;
+    peer->session_codebook=&state->codebook;
+    peer->plain_bytes=0;
+    peer->pad_bytes=0;
+    transfer_init(&peer->file_out);
+    transfer_init(&peer->file_in);
+    peer->file_out_shown=-1;
+    peer->file_in_shown=-1;
+    send_queue_init(&peer->sending, state->send_queue_limit);
+    frame_format_init(&peer->send_format, 0);
+    peer->connection=0;
+    peer->recv_request.callback=chat_recv_done;
+    peer->recv_request.userdata=peer;
+    peer->recv_request.busy=0;
+    peer->send_request.callback=chat_send_done;
+    peer->send_request.userdata=peer;
+    peer->send_request.busy=0;
+    peer->readahead_request.callback=chat_readahead_done;
+    peer->readahead_request.userdata=peer;
+    peer->readahead_request.busy=0;
+    peer->readahead_head=UINT64_MAX;
+    peer->paired_readahead_request.callback=chat_readahead_done;
+    peer->paired_readahead_request.userdata=peer;
+    peer->paired_readahead_request.busy=0;
+    peer->paired_readahead_head=UINT64_MAX;
+
+    state->peers[state->peers_size++]=peer;
+    return peer;
+}
+static void chat_free_job(struct crypto_job* job)
+{
+    free_message(&job->msg);
+    free(job);
+}
+static void chat_free_peer(struct chat_peer* peer)
+{
+    loop_remove(&peer->state->loop, &peer->watch);
+    loop_remove(&peer->state->loop, &peer->handshake_timer);
+    user_close(&peer->remote);
+    frame_reader_free(&peer->reader);
+    free_block(&peer->receiving);
+    if(peer->receiving_job!=NULL)
+    {
+        chat_free_job(peer->receiving_job);
+    }
+    transfer_close(&peer->file_out, 1);
+    transfer_close(&peer->file_in, 1);
+    send_queue_free(&peer->sending);
+    if(peer->history!=NULL)
+    {
+        for(size_t i=0;i<peer->history_size;++i)
+        {
+            free_message(&peer->history[i]);
+        }
+        free(peer->history);
+    }
+    free(peer);
+}
+//Returns a peer that isn't connected, for a new connection to reuse.
+static struct chat_peer* chat_idle_peer(struct chat_state* state)
+{
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        if(state->peers[i]->remote.state==NOT_CONNECTED)
+        {
+            return state->peers[i];
+        }
+    }
+    return NULL;
+}
+static void chat_show_peer(struct chat_state* state, struct chat_peer* peer)
+{
+    state->current=peer;
+    peer->unread=0;
+    if(!state->pipe)
+    {
+        ui_update(state);
+    }
+}
+//Watches the peer's current socket, or its connection attempts, if any. A
+//handshake timer left from an earlier one is stopped.
+static void chat_watch_peer(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    loop_remove(&state->loop, &peer->watch);
+    loop_remove(&state->loop, &peer->handshake_timer);
+    int fd=user_fd(&peer->remote);
+    if(fd!=-1)
+    {
+        loop_add(
+            &state->loop,
+            &peer->watch,
+            fd,
+            0,
+            chat_peer_ready,
+            peer
         );
+    }
+}
+//Forgets about the lookup in flight for the peer, if any.
+static void chat_cancel_resolve(struct chat_peer* peer)
+{
+    if(peer->resolving!=NULL)
+    {
+        resolver_cancel(&peer->state->resolver, peer->resolving);
+        peer->resolving=NULL;
+    }
+}
+static unsigned chat_connect_to(
+    struct chat_peer* peer,
+    const struct addrinfo* address,
+    const char* node,
+    uint16_t port
+){
+    unsigned err=user_begin_connect(&peer->remote, address);
+    peer->incoming=0;
+    chat_watch_peer(peer);
+    if(err)
+    {
+        chat_peer_status(peer, "Connecting to %s:%d failed", node, port);
         return 1;
     }
-    else
+    chat_peer_status(peer, "Connecting to %s:%d", node, port);
+    return 0;
+}
+unsigned chat_begin_connect(struct chat_state* state, struct address* addr)
+{
+    struct chat_peer* peer=state->current;
+    if(peer->remote.state==CONNECTED)
+    {//The session carries on in its own tab.
+        peer=chat_idle_peer(state);
+        if(peer==NULL)
+        {
+            peer=chat_add_peer(state);
+        }
+        if(peer==NULL)
+        {
+            chat_push_status(
+                state,
+                "Can't connect to more than %d peers",
+                CHAT_MAX_PEERS
+            );
+            return 1;
+        }
+        chat_show_peer(state, peer);
+    }
+    chat_cancel_resolve(peer);
+    const struct addrinfo* address=resolver_lookup(
+        &state->resolver,
+        addr->node,
+        addr->port
+    );
+    if(address!=NULL)
+    {
+        return chat_connect_to(peer, address, addr->node, addr->port);
+    }
+    //Anything else waits for DNS in chat_resolver_ready().
+    user_begin_resolve(&peer->remote);
+    peer->incoming=0;
+    chat_watch_peer(peer);
+    peer->resolving=resolver_submit(
+        &state->resolver,
+        addr->node,
+        addr->port,
+        peer
+    );
+    if(peer->resolving==NULL)
     {
-        chat_push_status(state, "Connecting to %s:%d", addr->node, addr->port);
+        user_disconnect(&peer->remote);
+        chat_push_status(state, "Too many lookups in progress");
+        return 1;
     }
+    chat_push_status(state, "Looking up %s", addr->node);
     return 0;
 }
 unsigned chat_begin_listen(struct chat_state* state, uint16_t port)
 {
+    loop_remove(&state->loop, &state->listen_watch);
     node_close(&state->local.node);
-    if(node_listen(&state->local.node, port))
-    {
+    if(node_listen(&state->local.node, port)||
+       loop_add(
+            &state->loop,
+            &state->listen_watch,
+            state->local.node.socket,
+            LOOP_READ,
+            chat_listen_ready,
+            state
+       )
+    ){
+        node_close(&state->local.node);
         chat_push_status(state, "Listening on port %d failed", port);
         return 1;
     }
@@ -132,312 +430,1542 @@ unsigned chat_begin_listen(struct chat_state* state, uint16_t port)
     }
     return 0;
 }
+//Called once the handshake with the remote has succeeded.
+static void chat_connected(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    peer->plain_bytes=0;
+    peer->pad_bytes=0;
+    peer->session_codebook=peer->remote.features&USER_FEATURE_DICT?
+        &state->dict:&state->codebook;
+    unsigned compact=(peer->remote.features&USER_FEATURE_COMPACT_HEADER)!=0;
+    frame_format_init(&peer->send_format, compact);
+    frame_reader_set_compact(&peer->reader, compact);
+    if(state->uring.fd!=-1)
+    {
+        //The ring takes over the socket. Requests in it should wait for
+        //data instead of failing with EAGAIN.
+        loop_remove(&state->loop, &peer->watch);
+        int socket=peer->remote.node.socket;
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL)&~O_NONBLOCK);
+        peer->connection++;
+        peer->readahead_head=UINT64_MAX;
+        peer->paired_readahead_head=UINT64_MAX;
+    }
+    chat_peer_status(
+        peer,
+        peer->remote.features&USER_FEATURE_DICT?
+            "Connected! Messages are compressed with your dictionary.":
+        peer->remote.features&USER_FEATURE_COMPRESS?
+            "Connected! Messages are compressed.":
+            "Connected!"
+    );
+    if(peer!=state->current)
+    {
+        chat_push_status(
+            state,
+            "%s connected, see /switch %zu",
+            peer->remote.name,
+            peer->index+1
+        );
+    }
+}
+//Disconnects peer and forgets everything that was in flight on the
+//connection.
+static void chat_drop_connection(struct chat_peer* peer)
+{
+    chat_cancel_resolve(peer);
+    loop_remove(&peer->state->loop, &peer->watch);
+    loop_remove(&peer->state->loop, &peer->handshake_timer);
+    send_queue_clear(&peer->sending);
+    frame_reader_reset(&peer->reader);
+    peer->receiving_pinned=RECLAIM_UNPINNED;
+    //Messages that did arrive are still shown, before the key goes.
+    chat_wait_decrypts(peer);
+    user_disconnect(&peer->remote);
+    if(peer->receiving_job!=NULL)
+    {
+        chat_free_job(peer->receiving_job);
+        peer->receiving_job=NULL;
+    }
+    if(transfer_active(&peer->file_out))
+    {
+        chat_peer_status(peer, "Sending %s aborted", peer->file_out.name);
+        transfer_close(&peer->file_out, 1);
+    }
+    if(transfer_active(&peer->file_in))
+    {
+        chat_peer_status(peer, "Receiving %s aborted", peer->file_in.name);
+        transfer_close(&peer->file_in, 1);
+    }
+}
 void chat_disconnect(struct chat_state* state, uint32_t id)
 {
     struct user* u=NULL;
     switch(id)
     {
     case ID_REMOTE:
-        u=&state->remote;
+        u=&state->current->remote;
         break;
     default:
         break;
     }
     if(u!=NULL&&u->state!=NOT_CONNECTED)
     {
-        user_disconnect(&state->remote);
+        chat_drop_connection(state->current);
         chat_push_status(state, "Disconnected");
     }
 }
+void chat_list_peers(struct chat_state* state)
+{
+    static const char* const state_names[]={
+        "not connected",
+        "connecting",
+        "connected"
+    };
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        struct chat_peer* peer=state->peers[i];
+        if(peer==state->current)
+        {
+            chat_push_status(
+                state,
+                "%zu: %s, %s, shown",
+                i+1,
+                peer->remote.name,
+                state_names[peer->remote.state]
+            );
+        }
+        else
+        {
+            chat_push_status(
+                state,
+                "%zu: %s, %s, %zu unread",
+                i+1,
+                peer->remote.name,
+                state_names[peer->remote.state],
+                peer->unread
+            );
+        }
+    }
+}
+unsigned chat_switch_peer(struct chat_state* state, size_t index)
+{
+    if(index>=state->peers_size)
+    {
+        chat_push_status(state, "No peer %zu, see /peers", index+1);
+        return 1;
+    }
+    chat_show_peer(state, state->peers[index]);
+    return 0;
+}
 void chat_end_listen(struct chat_state* state)
 {
     if(state->local.node.socket!=-1)
     {
+        loop_remove(&state->loop, &state->listen_watch);
         node_close(&state->local.node);
         chat_push_status(state, "Stopped listening for connections");
     }
 }
 static unsigned chat_init(struct chat_args* a, struct chat_state* state)
 {
+    //A closed stdout or socket shows up as EPIPE instead, so the keys are
+    //still closed cleanly.
+    signal(SIGPIPE, SIG_IGN);
+    if(loop_init(&state->loop))
+    {
+        fprintf(stderr, "Unable to create an event loop\n");
+        return 1;
+    }
+    //Before any helper threads start, so that they leave SIGWINCH to the
+    //loop.
+    if(!a->pipe&&
+       loop_add_signal(
+            &state->loop,
+            &state->resize_watch,
+            SIGWINCH,
+            chat_resize_ready,
+            state
+       )
+    ){
+        fprintf(stderr, "Unable to watch for terminal resizes\n");
+        loop_free(&state->loop);
+        return 1;
+    }
+    state->uring.fd=-1;
+    state->readahead_request.callback=chat_readahead_done;
+    state->readahead_request.userdata=state;
+    state->readahead_request.busy=0;
+    state->readahead_head=UINT64_MAX;
+    if(a->io_uring)
+    {
+        if(uring_init(&state->uring, CHAT_URING_ENTRIES))
+        {
+            fprintf(stderr, "Unable to set up an io_uring\n");
+            loop_free(&state->loop);
+            return 1;
+        }
+        if( loop_add(
+                &state->loop,
+                &state->uring_watch,
+                state->uring.fd,
+                LOOP_READ,
+                chat_uring_ready,
+                state
+            )
+        ){
+            fprintf(stderr, "Unable to watch the io_uring\n");
+            uring_free(&state->uring);
+            loop_free(&state->loop);
+            return 1;
+        }
+    }
+    state->crypto.running=0;
+    //--pipe hands its streamed chunks on too, they come back in order.
+    if(a->crypto_thread&&crypto_init(&state->crypto)==0&&
+       loop_add(
+            &state->loop,
+            &state->crypto_watch,
+            state->crypto.done_fd,
+            LOOP_READ,
+            chat_crypto_ready,
+            state
+       )
+    ){//Without the helper thread messages are just decrypted in place.
+        crypto_end(&state->crypto);
+    }
+    if(resolver_init(&state->resolver, a->dns_ttl))
+    {
+        fprintf(stderr, "Unable to start the resolver\n");
+        goto fail_resolver;
+    }
+    if(a->hosts_path!=NULL&&
+       resolver_load_hosts(&state->resolver, a->hosts_path))
+    {
+        fprintf(stderr, "Unable to read \"%s\"\n", a->hosts_path);
+        goto fail_resolver;
+    }
+    if( loop_add(
+            &state->loop,
+            &state->resolver_watch,
+            resolver_fd(&state->resolver),
+            LOOP_READ,
+            chat_resolver_ready,
+            state
+        )
+    ){
+        fprintf(stderr, "Unable to watch the resolver\n");
+        goto fail_resolver;
+    }
+    state->redraw=0;
     key_store_init(&state->keys);
+    key_store_set_sync_policy(&state->keys, a->sync_messages, a->sync_ms);
     if(key_store_open_local(&state->keys, a->local_key_path))
     {
         fprintf(stderr, "Unable to open \"%s\"\n", a->local_key_path);
         goto fail;
     }
-    if(key_store_open_remote(&state->keys, a->remote_key_path))
+    if(a->remote_key_path!=NULL&&
+       key_store_open_remote(&state->keys, a->remote_key_path))
     {
         fprintf(stderr, "Unable to open \"%s\"\n", a->remote_key_path);
         goto fail;
     }
+    if(a->key_dir!=NULL&&
+       key_store_open_dir(&state->keys, a->key_dir, a->key_cache_size))
+    {
+        fprintf(stderr, "Unable to index \"%s\"\n", a->key_dir);
+        goto fail;
+    }
     user_init(&state->local, ID_LOCAL);
-    user_init(&state->remote, ID_REMOTE);
+    state->offered_features=USER_DEFAULT_FEATURES;
+    if(a->dict_path!=NULL)
+    {
+        if(codebook_load(&state->dict, a->dict_path))
+        {
+            fprintf(stderr, "Unable to load \"%s\"\n", a->dict_path);
+            goto fail;
+        }
+        state->offered_features|=USER_FEATURE_DICT;
+    }
+    if(!a->compress)
+    {
+        state->offered_features&=~(USER_FEATURE_COMPRESS|USER_FEATURE_DICT);
+    }
     user_set_name(&state->local, "Local");
-    user_set_name(&state->remote, "Remote");
     state->local.key=&state->keys.local;
 
-    state->receiving.data=NULL;
-    state->receiving.size=0;
-    state->received_size=0;
-    state->sending.data=NULL;
-    state->sending.size=0;
-    state->sent_size=0;
-    state->history=NULL;
-    state->history_size=0;
-    state->history_line=0;
+    state->prefetch.running=0;
+    if(a->prefetch_window!=0)
+    {
+        //Without the helper thread pad bytes are just read on demand.
+        prefetch_init(&state->prefetch, a->prefetch_window);
+    }
+    prefetch_track(&state->prefetch, PREFETCH_LOCAL, state->local.key);
+    state->reclaim.running=0;
+    if(a->reclaim_batch!=0)
+    {
+        reclaim_init(&state->reclaim, a->reclaim_batch);
+    }
+
+    codebook_init_default(&state->codebook);
+    state->scratch=NULL;
+    state->scratch_capacity=0;
+    state->file_chunk=(uint8_t*)malloc(TRANSFER_CHUNK_SIZE);
+    state->send_queue_limit=a->send_queue_limit;
+    state->max_frame=a->max_frame;
+    state->peers_size=0;
+    state->current=chat_add_peer(state);
     state->input.data=NULL;
     state->input.size=0;
     state->cursor_index=0;
     state->running=1;
+    state->pipe=a->pipe;
+    state->pipe_block=NULL;
+    state->pipe_eof=0;
+    state->pipe_remote_eof=0;
 
-    ui_init(state);
+    if(state->pipe)
+    {
+        state->pipe_block=(uint8_t*)malloc(CHAT_PIPE_BLOCK_SIZE);
+        //Read until EAGAIN like any other edge triggered descriptor.
+        state->stdin_flags=fcntl(STDIN_FILENO, F_GETFL);
+        fcntl(STDIN_FILENO, F_SETFL, state->stdin_flags|O_NONBLOCK);
+    }
+    else
+    {
+        ui_init(state);
+    }
+    if( loop_add(
+            &state->loop,
+            &state->input_watch,
+            STDIN_FILENO,
+            LOOP_READ,
+            chat_input_ready,
+            state
+        )
+    ){
+        chat_push_status(state, "Unable to watch stdin");
+        state->running=0;
+    }
 
     if(a->wait_for_remote)
     {
-        chat_begin_listen(state, a->addr.port);
+        if(chat_begin_listen(state, a->addr.port)&&state->pipe)
+        {
+            state->running=0;
+        }
     }
-    else
+    else if(chat_begin_connect(state, &a->addr)&&state->pipe)
     {
-        chat_begin_connect(state, &a->addr);
+        state->running=0;
     }
     return 0;
 fail:
     key_store_close(&state->keys);
+fail_resolver:
+    resolver_end(&state->resolver);
+    crypto_end(&state->crypto);
+    uring_free(&state->uring);
+    loop_free(&state->loop);
     return 1;
 }
 static void chat_end(struct chat_state* state)
 {
-    ui_end(state);
+    if(!state->pipe)
+    {
+        ui_end(state);
+    }
+    else
+    {
+        fcntl(STDIN_FILENO, F_SETFL, state->stdin_flags);
+    }
+    free(state->pipe_block);
+    loop_free(&state->loop);
+    prefetch_end(&state->prefetch);
+    reclaim_end(&state->reclaim);
     user_close(&state->local);
-    user_close(&state->remote);
-    key_store_close(&state->keys);
-    free_block(&state->receiving);
-    free_block(&state->sending);
-    free_block(&state->input);
-    if(state->history!=NULL)
+    //Closing the sockets ends the requests that are still in the ring.
+    for(size_t i=0;i<state->peers_size;++i)
     {
-        for(size_t i=0;i<state->history_size;++i)
-        {
-            free_message(&state->history[i]);
-        }
-        free(state->history);
+        user_close(&state->peers[i]->remote);
+    }
+    uring_free(&state->uring);
+    struct crypto_job* job;
+    while((job=crypto_next(&state->crypto, 1))!=NULL)
+    {
+        chat_free_job(job);
+    }
+    crypto_end(&state->crypto);
+    resolver_end(&state->resolver);
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        chat_free_peer(state->peers[i]);
     }
+    key_store_close(&state->keys);
+    free(state->scratch);
+    free(state->file_chunk);
+    free_block(&state->input);
 }
-unsigned chat_begin_send(struct chat_state* state, struct block* b)
+//Grows a reused buffer to hold at least size bytes. The old contents are
+//not kept.
+static void chat_reserve(uint8_t** data, size_t* capacity, size_t size)
 {
-    free_block(&state->sending);
-    state->sent_size=0;
-
-    state->sending.size=b->size+MESSAGE_HEADER_SIZE;
-    state->sending.data=(uint8_t*)malloc(state->sending.size);
-
-    uint32_t size=htobe32((uint32_t)state->sending.size-MESSAGE_HEADER_SIZE);
-    uint64_t head=htobe64(state->local.key->head);
-    memcpy(state->sending.data+MESSAGE_SIZE_OFFSET, &size, sizeof(size));
-    memcpy(state->sending.data+MESSAGE_HEAD_OFFSET, &head, sizeof(head));
-    memcpy(
-        state->sending.data+MESSAGE_HEADER_SIZE,
-        b->data,
-        b->size
-    );
-    struct block content;
-    content.data=state->sending.data+MESSAGE_HEADER_SIZE;
-    content.size=state->sending.size-MESSAGE_HEADER_SIZE;
-    if(encrypt(state->local.key, &content))
+    if(size>*capacity)
     {
-        chat_push_status(state, "Out of local key data!");
-        return 1;
+        free(*data);
+        *data=(uint8_t*)malloc(size);
+        *capacity=size;
     }
-    return 0;
 }
-static unsigned chat_handle_message(struct chat_state* state)
+//Ring fills handled per wakeup.
+#define CHAT_RECV_ROUNDS 16
+#define CHAT_QUEUE_FULL 1
+#define CHAT_QUEUE_NO_PAD 2
+//Returns the local key kept for the remote of peer, or NULL if peer isn't
+//connected or sends with the one from the command line, which is looked
+//after on its own.
+static struct key* chat_paired_key(struct chat_peer* peer)
 {
-    struct message new_message;
-    new_message.id=ID_REMOTE;
-    new_message.timestamp=time(NULL);
-    new_message.text.data=state->receiving.data+MESSAGE_HEADER_SIZE;
-    new_message.text.size=state->receiving.size-MESSAGE_HEADER_SIZE;
-    chat_push_message(state, &new_message);
-    free_block(&state->receiving);
-    return 0;
+    struct key* k=peer->remote.state==CONNECTED?peer->remote.local_key:NULL;
+    return k!=&peer->state->keys.local?k:NULL;
 }
-static unsigned chat_handle_recv(struct chat_state* state)
-{
-    if(state->receiving.size==0)
+//Encrypts body into a new frame on the send queue. Returns CHAT_QUEUE_FULL
+//if it doesn't fit, in which case no pad is spent, or CHAT_QUEUE_NO_PAD if
+//encrypting failed.
+static unsigned chat_queue_frame(
+    struct chat_peer* peer,
+    const uint8_t* body,
+    size_t body_size,
+    uint32_t flags
+){
+    struct key* local=peer->remote.local_key;
+    if(send_queue_reserve(&peer->sending, FRAME_MAX_HEADER_SIZE, body_size))
     {
-        block_create(&state->receiving, MESSAGE_HEADER_SIZE);
-        state->received_size=0;
+        return CHAT_QUEUE_FULL;
     }
-    size_t received=node_recv(
-        &state->remote.node,
-        state->receiving.data+state->received_size,
-        state->receiving.size-state->received_size
+    struct frame_format format=peer->send_format;
+    uint8_t header[FRAME_MAX_HEADER_SIZE];
+    size_t header_size=frame_format_header(
+        &peer->send_format,
+        header,
+        body_size,
+        local->head,
+        flags
+    );
+    //The pad is XORed straight into the queued frame.
+    uint8_t* frame_body=send_queue_push(
+        &peer->sending,
+        header,
+        header_size,
+        body_size
     );
-    state->received_size+=received;
-    if(received==0)
+    unsigned err=body_size==0?
+        0:encrypt_into(local, frame_body, body, body_size);
+    if(err)
     {
-        return 1;
+        send_queue_cancel(&peer->sending);
+        peer->send_format=format;
+        chat_peer_status(
+            peer,
+            err==KEY_REUSED?
+                "Local key has been used past its head!":
+                "Out of local key data!"
+        );
+        return CHAT_QUEUE_NO_PAD;
     }
-    if(state->received_size==state->receiving.size)
+    return 0;
+}
+unsigned chat_begin_send(struct chat_state* state, struct block* b)
+{
+    struct chat_peer* peer=state->current;
+    //Every byte saved here is a byte of pad saved.
+    const uint8_t* body=b->data;
+    size_t body_size=b->size;
+    uint32_t flags=FRAME_FLAG_KIND(FRAME_KIND_MESSAGE);
+    if(peer->remote.features&USER_FEATURE_COMPRESS&&b->size>1)
     {
-        if(state->receiving.size==MESSAGE_HEADER_SIZE)
-        {
-            uint32_t size=0;
-            uint64_t head=0;
-            memcpy(
-                &size,
-                state->receiving.data+MESSAGE_SIZE_OFFSET,
-                sizeof(size)
-            );
-            memcpy(
-                &head,
-                state->receiving.data+MESSAGE_HEAD_OFFSET,
-                sizeof(head)
-            );
-            size=be32toh(size);
-            head=be64toh(head);
-            key_seek(state->remote.key, head);
-            state->receiving.size+=size;
-            state->receiving.data=(uint8_t*)realloc(
-                state->receiving.data,
-                state->receiving.size
-            );
-        }
-        else
+        chat_reserve(&state->scratch, &state->scratch_capacity, b->size);
+        size_t compressed_size=codebook_compress(
+            peer->session_codebook,
+            state->scratch,
+            b->size-1,
+            b->data,
+            b->size,
+            NULL
+        );
+        if(compressed_size!=0)
         {
-            //Decrypt message content
-            struct block content;
-            content.data=state->receiving.data+MESSAGE_HEADER_SIZE;
-            content.size=state->receiving.size-MESSAGE_HEADER_SIZE;
-            if(decrypt(state->remote.key, &content))
-            {
-                chat_push_status(state, "Out of remote key data!");
-                return 1;
-            }
-            return chat_handle_message(state);
+            body=state->scratch;
+            body_size=compressed_size;
+            flags|=FRAME_FLAG_COMPRESSED;
         }
     }
-    return 0;
-}
-static unsigned chat_handle_send(struct chat_state* state)
-{
-    if(state->sending.size==0)
+    unsigned err=chat_queue_frame(peer, body, body_size, flags);
+    if(err==CHAT_QUEUE_FULL)
     {
-        return 0;
+        chat_push_status(state, "Too many unsent messages!");
     }
-    size_t sent=node_send(
-        &state->remote.node,
-        state->sending.data+state->sent_size,
-        state->sending.size-state->sent_size
-    );
-    state->sent_size+=sent;
-    if(state->sent_size==state->sending.size)
+    if(err)
     {
-        free_block(&state->sending);
-        state->sent_size=0;
+        return 1;
     }
+    peer->plain_bytes+=b->size;
+    peer->pad_bytes+=body_size;
     return 0;
 }
-void chat(struct chat_args* a)
+unsigned chat_send_file(struct chat_state* state, const char* path)
 {
-    struct chat_state state;
-    if(chat_init(a, &state))
+    struct chat_peer* peer=state->current;
+    if(peer->remote.state!=CONNECTED||
+       !(peer->remote.features&USER_FEATURE_FILES))
     {
-        return;
+        chat_push_status(state, "The remote can't receive files");
+        return 1;
     }
-    while(state.running)
+    if(transfer_active(&peer->file_out))
     {
-        fd_set read_ready, write_ready;
-        FD_ZERO(&read_ready);
-        FD_ZERO(&write_ready);
-        FD_SET(STDIN_FILENO, &read_ready);
-
-        int biggest=STDIN_FILENO;
-
-        if(state.remote.state==CONNECTED)
+        chat_push_status(state, "Already sending %s", peer->file_out.name);
+        return 1;
+    }
+    if(transfer_open_send(&peer->file_out, path))
+    {
+        chat_push_status(state, "Unable to open \"%s\"", path);
+        return 1;
+    }
+    //The name and size are encrypted like any message.
+    size_t name_size=strlen(peer->file_out.name);
+    uint8_t* body=(uint8_t*)malloc(8+name_size);
+    uint64_t size=htole64(peer->file_out.size);
+    memcpy(body, &size, 8);
+    memcpy(body+8, peer->file_out.name, name_size);
+    unsigned err=chat_queue_frame(
+        peer,
+        body,
+        8+name_size,
+        FRAME_FLAG_KIND(FRAME_KIND_FILE_BEGIN)
+    );
+    free(body);
+    if(err)
+    {
+        if(err==CHAT_QUEUE_FULL)
         {
-            FD_SET(state.remote.node.socket, &read_ready);
-            biggest=state.remote.node.socket>biggest?
-                    state.remote.node.socket:biggest;
+            chat_push_status(state, "Too many unsent messages!");
         }
-        if(state.remote.state==CONNECTING||
-           (state.remote.state==CONNECTED&&
-            state.sending.size!=state.sent_size&&state.sending.size!=0))
+        transfer_close(&peer->file_out, 1);
+        return 1;
+    }
+    chat_push_status(
+        state,
+        "Sending %s (%.1f MiB)",
+        peer->file_out.name,
+        peer->file_out.size/(double)(1<<20)
+    );
+    peer->file_out_shown=-1;
+    return 0;
+}
+//Keeps a few chunks of the file being sent in the send queue, so that the
+//socket never waits for the disk.
+static void chat_pump_file(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    struct transfer* t=&peer->file_out;
+    while(transfer_active(t)&&
+          peer->sending.size<TRANSFER_CHUNKS_IN_FLIGHT&&
+          !send_queue_reserve(
+              &peer->sending,
+              FRAME_MAX_HEADER_SIZE,
+              TRANSFER_CHUNK_SIZE
+          )
+    ){
+        ssize_t size=transfer_read(t, state->file_chunk, TRANSFER_CHUNK_SIZE);
+        if(size>0)
         {
-            //There's a message to send or the socket is connecting
-            FD_SET(state.remote.node.socket, &write_ready);
-            biggest=state.remote.node.socket>biggest?
-                    state.remote.node.socket:biggest;
+            if( chat_queue_frame(
+                    peer,
+                    state->file_chunk,
+                    size,
+                    FRAME_FLAG_KIND(FRAME_KIND_FILE_DATA)
+                )==0
+            ){
+                continue;
+            }
+            //Out of pad, the file still has to be ended below.
+            chat_peer_status(peer, "Sending %s failed", t->name);
+            size=-1;
         }
-        if(a->wait_for_remote&&state.remote.state==NOT_CONNECTED)
+        else if(size==-1)
         {
-            FD_SET(state.local.node.socket, &read_ready);
-            biggest=state.local.node.socket>biggest?
-                    state.local.node.socket:biggest;
+            chat_peer_status(peer, "Reading %s failed", t->name);
         }
-        if(
-            select(
-                biggest+1,
-                &read_ready,
-                &write_ready,
+        //Done or failed, either way the receiver checks the size it got.
+        //The end frame is empty, so it needs no pad and there's room for it.
+        if( chat_queue_frame(
+                peer,
                 NULL,
-                NULL
-            )==-1
+                0,
+                FRAME_FLAG_KIND(FRAME_KIND_FILE_END)
+            )==0&&size==0
         ){
-            //Resizing the terminal causes select to fail with "Interrupted
-            //system call", so we just update the ui and carry on.
-            if(errno==EINTR)
-            {
-                ui_update(&state);
-                continue;
-            }
-            break;
+            chat_peer_status(
+                peer,
+                "Sent %s, %.1f MiB/s",
+                t->name,
+                transfer_rate(t)/(1<<20)
+            );
+        }
+        transfer_close(t, size!=0);
+    }
+}
+static unsigned chat_handle_message(
+    struct chat_peer* peer,
+    const struct block* text
+){
+    struct message new_message;
+    new_message.id=ID_REMOTE;
+    new_message.timestamp=time(NULL);
+    new_message.text=*text;
+    chat_push_message(peer->state, peer, &new_message);
+    return 0;
+}
+static void chat_handle_file_begin(struct chat_peer* peer)
+{
+    struct transfer* t=&peer->file_in;
+    if(transfer_active(t))
+    {
+        chat_peer_status(peer, "Receiving %s aborted", t->name);
+        transfer_close(t, 1);
+    }
+    uint64_t size=0;
+    if(peer->receiving.size<=8)
+    {
+        chat_peer_status(peer, "Received a malformed file header!");
+        return;
+    }
+    memcpy(&size, peer->receiving.data, 8);
+    if( transfer_open_receive(
+            t,
+            (const char*)peer->receiving.data+8,
+            peer->receiving.size-8,
+            le64toh(size)
+        )
+    ){
+        chat_peer_status(peer, "Unable to save a file from the remote");
+        return;
+    }
+    chat_peer_status(
+        peer,
+        "Receiving %s (%.1f MiB)",
+        t->name,
+        t->size/(double)(1<<20)
+    );
+    peer->file_in_shown=-1;
+}
+static void chat_handle_file_data(
+    struct chat_peer* peer,
+    const uint8_t* data,
+    size_t size
+){
+    struct transfer* t=&peer->file_in;
+    if(!transfer_active(t))
+    {
+        return;
+    }
+    if(size>t->size-t->done)
+    {//Not what was announced, it could go on until the disk is full.
+        chat_peer_status(peer, "%s is larger than announced", t->name);
+        transfer_close(t, 1);
+        return;
+    }
+    if(transfer_write(t, data, size))
+    {
+        chat_peer_status(peer, "Writing %s failed", t->name);
+        transfer_close(t, 1);
+    }
+}
+static void chat_handle_file_end(struct chat_peer* peer)
+{
+    struct transfer* t=&peer->file_in;
+    if(!transfer_active(t))
+    {
+        return;
+    }
+    if(t->done!=t->size)
+    {
+        chat_peer_status(peer, "%s arrived incomplete", t->name);
+        transfer_close(t, 1);
+        return;
+    }
+    chat_peer_status(
+        peer,
+        "Received %s, %.1f MiB/s",
+        t->name,
+        transfer_rate(t)/(1<<20)
+    );
+    transfer_close(t, 0);
+}
+//Decompresses the received message if needed and shows it.
+static unsigned chat_handle_body(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    if(FRAME_KIND(peer->receiving_flags)!=FRAME_KIND_MESSAGE)
+    {//Keep what's shown in the order it arrived.
+        chat_wait_decrypts(peer);
+    }
+    switch(FRAME_KIND(peer->receiving_flags))
+    {
+    case FRAME_KIND_FILE_BEGIN:
+        chat_handle_file_begin(peer);
+        return 0;
+    case FRAME_KIND_FILE_END:
+        chat_handle_file_end(peer);
+        return 0;
+    default:
+        break;
+    }
+    struct block text=peer->receiving;
+    if(peer->receiving_flags&FRAME_FLAG_COMPRESSED)
+    {
+        size_t size=codebook_decompressed_size(
+            peer->session_codebook,
+            peer->receiving.data,
+            peer->receiving.size
+        );
+        if(size==SIZE_MAX)
+        {
+            chat_peer_status(peer, "Received a malformed message!");
+            return 0;
         }
-        if(FD_ISSET(state.remote.node.socket, &read_ready))
+        chat_reserve(&state->scratch, &state->scratch_capacity, size);
+        codebook_decompress(
+            peer->session_codebook,
+            state->scratch,
+            peer->receiving.data,
+            peer->receiving.size
+        );
+        text.data=state->scratch;
+        text.size=size;
+    }
+    peer->plain_bytes+=text.size;
+    peer->pad_bytes+=peer->receiving.size;
+    return chat_handle_message(peer, &text);
+}
+//What is done with a decrypted crypto_job, its tag.
+#define CHAT_JOB_MESSAGE 0
+#define CHAT_JOB_FILE_DATA 1
+#define CHAT_JOB_PIPE 2
+//Hands on what the helper thread has decrypted.
+static void chat_decrypted(struct crypto_job* job)
+{
+    struct chat_peer* peer=(struct chat_peer*)job->owner;
+    const struct block* text=&job->msg.text;
+    peer->decrypting--;
+    //The peer's later jobs only use pad after this one's.
+    peer->decrypting_pinned=job->pad-key_pad(peer->remote.key);
+    if(job->malformed)
+    {
+        chat_peer_status(peer, "Received a malformed message!");
+    }
+    else if(job->tag==CHAT_JOB_FILE_DATA)
+    {
+        chat_handle_file_data(peer, text->data, text->size);
+    }
+    else if(job->tag==CHAT_JOB_PIPE)
+    {
+        chat_pipe_write(peer->state, text->data, text->size);
+    }
+    else
+    {
+        peer->plain_bytes+=text->size;
+        chat_handle_message(peer, text);
+    }
+    chat_free_job(job);
+}
+static void chat_submit_job(struct chat_peer* peer, struct crypto_job* job)
+{
+    struct chat_state* state=peer->state;
+    while(crypto_submit(&state->crypto, job))
+    {//Full, make room by finishing the oldest one.
+        chat_decrypted(crypto_next(&state->crypto, 1));
+    }
+    if(peer->decrypting++==0)
+    {
+        peer->decrypting_pinned=job->pad-key_pad(peer->remote.key);
+    }
+}
+//Hands the assembled receiving_job to the helper thread.
+static void chat_decrypt_later(struct chat_peer* peer)
+{
+    struct crypto_job* job=peer->receiving_job;
+    peer->receiving_job=NULL;
+    peer->pad_bytes+=job->msg.text.size;
+    chat_submit_job(peer, job);
+}
+static void chat_wait_decrypts(struct chat_peer* peer)
+{
+    while(peer->decrypting!=0)
+    {
+        chat_decrypted(crypto_next(&peer->state->crypto, 1));
+    }
+}
+//Starts a job for a message that the helper thread can decrypt.
+static struct crypto_job* chat_new_job(
+    struct chat_peer* peer,
+    const struct frame_event* e
+){
+    struct crypto_job* job=(struct crypto_job*)malloc(
+        sizeof(struct crypto_job)
+    );
+    job->owner=peer;
+    job->tag=CHAT_JOB_MESSAGE;
+    job->msg.id=ID_REMOTE;
+    job->msg.timestamp=time(NULL);
+    job->msg.text.data=(uint8_t*)malloc(e->size);
+    job->msg.text.size=0;
+    job->pad=peer->receiving_pad;
+    job->codebook=e->flags&FRAME_FLAG_COMPRESSED?
+        peer->session_codebook:NULL;
+    job->malformed=0;
+    return job;
+}
+//Hands a piece of a streamed body to the helper thread, pad is where its
+//pad starts.
+static void chat_decrypt_piece(
+    struct chat_peer* peer,
+    const uint8_t* pad,
+    const struct frame_event* e
+){
+    struct crypto_job* job=(struct crypto_job*)malloc(
+        sizeof(struct crypto_job)
+    );
+    job->owner=peer;
+    job->tag=FRAME_KIND(peer->receiving_flags)==FRAME_KIND_FILE_DATA?
+        CHAT_JOB_FILE_DATA:CHAT_JOB_PIPE;
+    job->msg.id=ID_REMOTE;
+    job->msg.timestamp=0;
+    job->msg.text.data=(uint8_t*)malloc(e->data_size);
+    memcpy(job->msg.text.data, e->data, e->data_size);
+    job->msg.text.size=e->data_size;
+    job->pad=pad;
+    job->codebook=NULL;
+    job->malformed=0;
+    chat_submit_job(peer, job);
+}
+static unsigned chat_handle_frame(
+    struct chat_peer* peer,
+    const struct frame_event* e
+){
+    struct chat_state* state=peer->state;
+    switch(e->type)
+    {
+    case FRAME_HEADER:
         {
-            chat_handle_recv(&state);
+            struct key* k=peer->remote.key;
+            peer->receiving_pinned=e->head;
+            peer->receiving.size=0;
+            peer->receiving_flags=e->flags;
+            peer->receiving_offset=0;
+            //The pad is claimed up front, so the body can be decrypted piece
+            //by piece. The head only follows the remote's for pad that is
+            //really claimed, an empty or rejected frame leaves it alone.
+            peer->receiving_pad=NULL;
+            uint64_t head=k->head;
+            if(e->size!=0)
+            {
+                key_seek(k, e->head);
+            }
+            unsigned err=key_claim(k, e->size, &peer->receiving_pad);
+            if(err)
+            {
+                key_seek(k, head);
+            }
+            if(err==KEY_REUSED)
+            {//Never decrypt with pad that has been used before.
+                chat_peer_status(
+                    peer,
+                    "Remote tried to reuse pad, message rejected!"
+                );
+                peer->receiving_pad=NULL;
+                return 0;
+            }
+            else if(err)
+            {
+                chat_peer_status(peer, "Out of remote key data!");
+                return 1;
+            }
+            //File data goes straight to disk, and in --pipe mode plain
+            //messages straight to stdout.
+            peer->receiving_streamed=
+                FRAME_KIND(e->flags)==FRAME_KIND_FILE_DATA||
+                (state->pipe&&
+                 FRAME_KIND(e->flags)==FRAME_KIND_MESSAGE&&
+                 !(e->flags&FRAME_FLAG_COMPRESSED));
+            if( !peer->receiving_streamed&&state->crypto.running&&
+                FRAME_KIND(e->flags)==FRAME_KIND_MESSAGE
+            ){
+                peer->receiving_job=chat_new_job(peer, e);
+            }
+            else if(!peer->receiving_streamed)
+            {
+                //The body buffer only ever grows, so bursts of messages
+                //don't cost an allocation each. The reader has already
+                //checked the size against --max-frame.
+                chat_reserve(
+                    &peer->receiving.data,
+                    &peer->receiving_capacity,
+                    e->size
+                );
+            }
+            break;
         }
-        if(FD_ISSET(state.remote.node.socket, &write_ready))
+    case FRAME_DATA:
         {
-            if(state.remote.state==CONNECTING)
+            if(peer->receiving_pad==NULL)
+            {//Rejected, skip the body.
+                break;
+            }
+            const uint8_t* pad=peer->receiving_pad+peer->receiving_offset;
+            peer->receiving_offset+=e->data_size;
+            if(peer->receiving_streamed&&state->crypto.running)
+            {//Still handed on in order, after the jobs before it.
+                chat_decrypt_piece(peer, pad, e);
+                break;
+            }
+            if(peer->receiving_streamed)
             {
-                if(user_finish_connect(&state.remote, &state.keys))
+                chat_reserve(
+                    &state->scratch,
+                    &state->scratch_capacity,
+                    e->data_size
+                );
+                xor_blocks(state->scratch, pad, e->data, e->data_size);
+                if(FRAME_KIND(peer->receiving_flags)==FRAME_KIND_FILE_DATA)
                 {
-                    user_disconnect(&state.remote);
-                    state.remote.key=NULL;
-                    chat_push_status(&state, "Connection failed");
+                    chat_handle_file_data(peer, state->scratch, e->data_size);
                 }
                 else
                 {
-                    chat_push_status(&state, "Connected!");
+                    chat_pipe_write(state, state->scratch, e->data_size);
                 }
+                break;
             }
-            else
-            {
-                chat_handle_send(&state);
+            if(peer->receiving_job!=NULL)
+            {//Decrypted later, by the helper thread.
+                struct block* text=&peer->receiving_job->msg.text;
+                memcpy(text->data+text->size, e->data, e->data_size);
+                text->size+=e->data_size;
+                break;
+            }
+            xor_blocks(
+                peer->receiving.data+peer->receiving.size,
+                pad,
+                e->data,
+                e->data_size
+            );
+            peer->receiving.size+=e->data_size;
+            break;
+        }
+    case FRAME_END:
+        peer->receiving_pinned=RECLAIM_UNPINNED;
+        if(peer->receiving_pad==NULL)
+        {
+            return 0;
+        }
+        if(peer->receiving_streamed)
+        {
+            if( state->pipe&&peer->receiving_offset==0&&
+                FRAME_KIND(peer->receiving_flags)==FRAME_KIND_MESSAGE
+            ){//Whatever came before it is written out first.
+                chat_wait_decrypts(peer);
+                state->pipe_remote_eof=1;
+            }
+            return 0;
+        }
+        if(peer->receiving_job!=NULL)
+        {
+            chat_decrypt_later(peer);
+            return 0;
+        }
+        return chat_handle_body(peer);
+    case FRAME_ERROR:
+        chat_peer_status(peer, "Received a malformed or oversized frame!");
+        node_close(&peer->remote.node);
+        return 1;
+    }
+    return 0;
+}
+//Handles everything in the frame reader.
+static unsigned chat_handle_frames(struct chat_peer* peer)
+{
+    //A single recv() may have brought in any number of frames.
+    struct frame_event e;
+    while(frame_reader_next(&peer->reader, &e))
+    {
+        if(chat_handle_frame(peer, &e))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+static unsigned chat_handle_recv(struct chat_peer* peer)
+{
+    //Whatever is left over waits for the next round, so a fast remote can't
+    //starve everything else.
+    for(unsigned i=0;i<CHAT_RECV_ROUNDS;++i)
+    {
+        if(frame_reader_fill(&peer->reader, &peer->remote.node)==0)
+        {
+            loop_clear(&peer->watch, LOOP_READ);
+            return node_error(&peer->remote.node)!=0;
+        }
+        if(chat_handle_frames(peer))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+//Returns non-zero if a --io-uring completion belongs to a connection that
+//has since ended.
+static int chat_stale(struct chat_peer* peer, struct uring_request* req)
+{
+    return peer->remote.state!=CONNECTED||req->tag!=peer->connection;
+}
+static void chat_recv_done(struct uring_request* req)
+{
+    struct chat_peer* peer=(struct chat_peer*)req->userdata;
+    if(chat_stale(peer, req))
+    {
+        return;
+    }
+    if(req->result==-EINTR||req->result==-EAGAIN)
+    {//Tried again with the next submission.
+        return;
+    }
+    if(req->result<=0)
+    {//Closed by the remote or broken.
+        node_close(&peer->remote.node);
+        return;
+    }
+    frame_reader_commit(&peer->reader, req->result);
+    chat_handle_frames(peer);
+}
+static void chat_send_done(struct uring_request* req)
+{
+    struct chat_peer* peer=(struct chat_peer*)req->userdata;
+    if(chat_stale(peer, req))
+    {
+        return;
+    }
+    if(req->result==-EINTR||req->result==-EAGAIN)
+    {
+        return;
+    }
+    if(req->result<0)
+    {
+        node_close(&peer->remote.node);
+        return;
+    }
+    send_queue_advance(&peer->sending, req->result);
+}
+static void chat_readahead_done(struct uring_request* req)
+{
+    //Only a hint, so failures don't matter.
+    (void)req;
+}
+//Asks for the pad ahead of the head of k to be read into the page cache,
+//so that the mapping doesn't fault on it. Done again once the head is
+//halfway through.
+static void chat_readahead(
+    struct chat_state* state,
+    struct uring_request* req,
+    uint64_t* readahead_head,
+    struct key* k
+){
+    if(k==NULL||req->busy||k->head>=k->size)
+    {
+        return;
+    }
+    if(k->head>=*readahead_head&&
+       k->head-*readahead_head<CHAT_READAHEAD_SIZE/2
+    ){
+        return;
+    }
+    uint64_t size=k->size-k->head;
+    if(size>CHAT_READAHEAD_SIZE)
+    {
+        size=CHAT_READAHEAD_SIZE;
+    }
+    if( uring_fadvise(
+            &state->uring,
+            req,
+            k->fd,
+            KEY_HEADER_SIZE+k->head,
+            size,
+            POSIX_FADV_WILLNEED
+        )==0
+    ){
+        *readahead_head=k->head;
+    }
+}
+//Queues the I/O every peer is ready for with --io-uring, and submits all
+//of it with a single system call.
+static void chat_uring_submit(struct chat_state* state)
+{
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        struct chat_peer* peer=state->peers[i];
+        if(peer->remote.state!=CONNECTED||peer->remote.node.socket==-1)
+        {
+            continue;
+        }
+        int socket=peer->remote.node.socket;
+        size_t iov_count=frame_reader_space(&peer->reader, peer->recv_iov);
+        if( !peer->recv_request.busy&&iov_count!=0&&
+            uring_readv(
+                &state->uring,
+                &peer->recv_request,
+                socket,
+                peer->recv_iov,
+                iov_count
+            )==0
+        ){
+            peer->recv_request.tag=peer->connection;
+        }
+        if(!peer->send_request.busy&&!send_queue_empty(&peer->sending))
+        {
+            iov_count=send_queue_iov(
+                &peer->sending,
+                peer->send_iov,
+                SEND_QUEUE_MAX_IOV
+            );
+            if( uring_writev(
+                    &state->uring,
+                    &peer->send_request,
+                    socket,
+                    peer->send_iov,
+                    iov_count
+                )==0
+            ){
+                peer->send_request.tag=peer->connection;
             }
         }
-        if(FD_ISSET(state.local.node.socket, &read_ready))
+        chat_readahead(
+            state,
+            &peer->readahead_request,
+            &peer->readahead_head,
+            peer->remote.key
+        );
+        chat_readahead(
+            state,
+            &peer->paired_readahead_request,
+            &peer->paired_readahead_head,
+            chat_paired_key(peer)
+        );
+    }
+    chat_readahead(
+        state,
+        &state->readahead_request,
+        &state->readahead_head,
+        state->local.key
+    );
+    uring_submit(&state->uring, 0);
+}
+//Syncs the key head journal of k if it's due. Returns how long until it
+//will be, or -1 if never.
+static int chat_sync_key(struct chat_state* state, struct key* k)
+{
+    if(k==NULL)
+    {
+        return -1;
+    }
+    int timeout=key_sync_timeout(k);
+    if(timeout==0)
+    {
+        unsigned failing=k->sync_failed;
+        if(key_sync(k))
         {
-            if(user_accept(&state.remote, &state.local.node, &state.keys))
+            if(!failing)
             {
-                chat_push_status(&state, "Incoming connection failed");
+                chat_push_status(
+                    state,
+                    "Unable to sync the key journal, retrying"
+                );
             }
-            else
+            return key_sync_timeout(k);
+        }
+        return -1;
+    }
+    return timeout;
+}
+//Returns how long the loop may sleep before a key head journal is due to be
+//synced, or -1 for no limit. Syncs the ones that are already due.
+static int chat_sync_keys(struct chat_state* state)
+{
+    int timeout=chat_sync_key(state, state->local.key);
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        struct key* keys[]={
+            state->peers[i]->remote.key,
+            chat_paired_key(state->peers[i])
+        };
+        for(size_t j=0;j<sizeof(keys)/sizeof(*keys);++j)
+        {
+            int key_timeout=chat_sync_key(state, keys[j]);
+            if(key_timeout>0&&(timeout==-1||key_timeout<timeout))
             {
-                chat_push_status(&state, "Connected!");
+                timeout=key_timeout;
             }
         }
-        if(FD_ISSET(STDIN_FILENO, &read_ready))
+    }
+    return timeout;
+}
+static unsigned chat_handle_send(struct chat_peer* peer)
+{
+    if(send_queue_flush(&peer->sending, &peer->remote.node))
+    {
+        loop_clear(&peer->watch, LOOP_WRITE);
+    }
+    return 0;
+}
+//Returns non-zero if stdin should be read in --pipe mode. It's left alone
+//while the send queue is full, which in turn holds back whoever is writing
+//into stdin.
+static int chat_pipe_wants_input(struct chat_state* state)
+{
+    struct chat_peer* peer=state->current;
+    return peer->remote.state==CONNECTED&&
+        state->pipe_eof==0&&
+        !send_queue_reserve(
+            &peer->sending,
+            FRAME_MAX_HEADER_SIZE,
+            CHAT_PIPE_BLOCK_SIZE
+        );
+}
+//Sends the next block of stdin in --pipe mode.
+static void chat_pipe_input(struct chat_state* state)
+{
+    ssize_t size=read(STDIN_FILENO, state->pipe_block, CHAT_PIPE_BLOCK_SIZE);
+    if(size==-1&&(errno==EAGAIN||errno==EINTR))
+    {
+        if(errno==EAGAIN)
+        {
+            loop_clear(&state->input_watch, LOOP_READ);
+        }
+        return;
+    }
+    if(size<=0)
+    {//Sent as an empty message.
+        state->pipe_eof=1;
+        size=0;
+    }
+    //Arbitrary data rarely compresses and would only slow the pipe down.
+    if( chat_queue_frame(
+            state->current,
+            state->pipe_block,
+            size,
+            FRAME_FLAG_KIND(FRAME_KIND_MESSAGE)
+        )
+    ){
+        state->running=0;
+    }
+}
+//Returns non-zero when a shown transfer's percentage has changed.
+static int chat_file_progress(struct chat_state* state)
+{
+    struct chat_peer* peer=state->current;
+    int out=transfer_active(&peer->file_out)?
+        transfer_percent(&peer->file_out):-1;
+    int in=transfer_active(&peer->file_in)?
+        transfer_percent(&peer->file_in):-1;
+    int changed=out!=peer->file_out_shown||in!=peer->file_in_shown;
+    peer->file_out_shown=out;
+    peer->file_in_shown=in;
+    return changed;
+}
+static void chat_handshake_failed(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    user_disconnect(&peer->remote);
+    chat_watch_peer(peer);
+    if(!peer->incoming)
+    {
+        chat_peer_status(peer, "Connection failed");
+        state->running=!state->pipe;
+        return;
+    }
+    chat_push_status(state, "Incoming connection failed");
+    if( peer->index!=0&&peer->index==state->peers_size-1&&
+        peer!=state->current&&peer->history_size==0
+    ){//Nobody has seen it yet, so it can go again.
+        state->peers_size--;
+        chat_free_peer(peer);
+    }
+}
+static void chat_handshake_timeout(struct loop_watch* w)
+{
+    chat_handshake_failed((struct chat_peer*)w->userdata);
+}
+//Carries the handshake on as far as the socket allows.
+static void chat_handshake(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    unsigned connecting=peer->remote.handshake.phase==USER_HANDSHAKE_CONNECT;
+    unsigned err=user_finish_connect(&peer->remote, &state->keys);
+    if(err!=0&&err!=USER_WOULD_BLOCK)
+    {
+        if(err==USER_KEY_IN_USE)
+        {
+            chat_push_status(
+                state,
+                "The local key for that peer is in use with another one"
+            );
+        }
+        chat_handshake_failed(peer);
+        return;
+    }
+    if( connecting&&
+        (err==0||peer->remote.handshake.phase!=USER_HANDSHAKE_CONNECT)
+    ){//The socket has just connected, the remote gets this long to answer.
+        //It's watched from now on instead of the attempts.
+        chat_watch_peer(peer);
+        loop_add_timer(
+            &state->loop,
+            &peer->handshake_timer,
+            USER_HANDSHAKE_TIMEOUT_MS,
+            chat_handshake_timeout,
+            peer
+        );
+    }
+    if(err==USER_WOULD_BLOCK)
+    {
+        loop_clear(&peer->watch, LOOP_READ|LOOP_WRITE);
+        return;
+    }
+    loop_remove(&state->loop, &peer->handshake_timer);
+    chat_connected(peer);
+}
+static void chat_peer_ready(struct loop_watch* w)
+{
+    struct chat_peer* peer=(struct chat_peer*)w->userdata;
+    if(peer->remote.state==CONNECTING)
+    {
+        chat_handshake(peer);
+        return;
+    }
+    if(w->ready&LOOP_READ)
+    {
+        chat_handle_recv(peer);
+    }
+    if(w->ready&LOOP_WRITE&&!send_queue_empty(&peer->sending))
+    {
+        chat_handle_send(peer);
+    }
+}
+//Returns non-zero if there's a peer for the next incoming connection.
+static int chat_can_accept(struct chat_state* state)
+{
+    return chat_idle_peer(state)!=NULL||
+        (!state->pipe&&state->peers_size<CHAT_MAX_PEERS);
+}
+static void chat_listen_ready(struct loop_watch* w)
+{
+    struct chat_state* state=(struct chat_state*)w->userdata;
+    while(w->ready&LOOP_READ&&chat_can_accept(state))
+    {
+        struct chat_peer* peer=chat_idle_peer(state);
+        unsigned added=peer==NULL;
+        if(added)
+        {
+            peer=chat_add_peer(state);
+        }
+        unsigned err=user_accept(&peer->remote, &state->local.node);
+        if(err==0)
+        {//The handshake goes on in chat_peer_ready().
+            peer->incoming=1;
+            chat_watch_peer(peer);
+            continue;
+        }
+        if(err==NODE_WOULD_BLOCK)
+        {
+            loop_clear(w, LOOP_READ);
+        }
+        else
+        {
+            chat_push_status(state, "Incoming connection failed");
+        }
+        if(added)
+        {//Nobody has seen it yet, so it can go again.
+            state->peers_size--;
+            chat_free_peer(peer);
+        }
+    }
+}
+static void chat_input_ready(struct loop_watch* w)
+{
+    struct chat_state* state=(struct chat_state*)w->userdata;
+    if(!state->pipe)
+    {
+        ui_handle_input(state);
+        loop_clear(w, LOOP_READ);
+        return;
+    }
+    while(w->ready&LOOP_READ&&chat_pipe_wants_input(state))
+    {
+        chat_pipe_input(state);
+    }
+}
+static void chat_uring_ready(struct loop_watch* w)
+{
+    uring_reap(&((struct chat_state*)w->userdata)->uring);
+    loop_clear(w, LOOP_READ);
+}
+static void chat_crypto_ready(struct loop_watch* w)
+{
+    struct chat_state* state=(struct chat_state*)w->userdata;
+    struct crypto_job* job;
+    while((job=crypto_next(&state->crypto, 0))!=NULL)
+    {
+        chat_decrypted(job);
+    }
+    loop_clear(w, LOOP_READ);
+}
+static void chat_resolved(struct resolver_request* req)
+{
+    struct chat_peer* peer=(struct chat_peer*)req->owner;
+    struct chat_state* state=peer->state;
+    peer->resolving=NULL;
+    if(req->addresses==NULL)
+    {
+        user_disconnect(&peer->remote);
+        chat_peer_status(
+            peer,
+            "Unable to resolve %s: %s",
+            req->node,
+            gai_strerror(req->error)
+        );
+        state->running=state->running&&!state->pipe;
+    }
+    else if(chat_connect_to(peer, req->addresses, req->node, req->port))
+    {
+        state->running=state->running&&!state->pipe;
+    }
+}
+static void chat_resolver_ready(struct loop_watch* w)
+{
+    struct chat_state* state=(struct chat_state*)w->userdata;
+    struct resolver_request* req;
+    while((req=resolver_next(&state->resolver))!=NULL)
+    {
+        chat_resolved(req);
+        resolver_request_free(req);
+    }
+    loop_clear(w, LOOP_READ);
+}
+static void chat_resize_ready(struct loop_watch* w)
+{
+    while(loop_take_signal(w));
+    ui_resize((struct chat_state*)w->userdata);
+}
+//Sets what the main loop waits for.
+static void chat_update_wants(struct chat_state* state)
+{
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        struct chat_peer* peer=state->peers[i];
+        peer->watch.want=
+            peer->remote.state==CONNECTING?user_wants(&peer->remote):
+            state->uring.fd!=-1?0:
+            send_queue_empty(&peer->sending)?LOOP_READ:LOOP_READ|LOOP_WRITE;
+    }
+    state->listen_watch.want=chat_can_accept(state)?LOOP_READ:0;
+    if(state->pipe)
+    {
+        state->input_watch.want=chat_pipe_wants_input(state)?LOOP_READ:0;
+    }
+}
+//Handles a peer whose connection has broken.
+static void chat_check_peer(struct chat_peer* peer)
+{
+    struct chat_state* state=peer->state;
+    if(peer->remote.state==CONNECTED&&node_error(&peer->remote.node))
+    {
+        chat_drop_connection(peer);
+        chat_peer_status(peer, "Remote disconnected");
+        //A pipe lasts for a single connection.
+        state->running=state->running&&!state->pipe;
+    }
+    //Keep the pad following the remote head resident
+    struct key* k=peer->remote.state==CONNECTED?peer->remote.key:NULL;
+    prefetch_track(&state->prefetch, PREFETCH_REMOTE+peer->index, k);
+    //Pad that the helper thread or the frame being received still reads
+    //is left alone.
+    uint64_t pinned=peer->receiving_pinned;
+    if(peer->decrypting!=0&&peer->decrypting_pinned<pinned)
+    {
+        pinned=peer->decrypting_pinned;
+    }
+    reclaim_track(&state->reclaim, RECLAIM_REMOTE+peer->index, k, pinned);
+    struct key* paired=chat_paired_key(peer);
+    prefetch_track(&state->prefetch, PREFETCH_PAIRED+peer->index, paired);
+    reclaim_track(
+        &state->reclaim,
+        RECLAIM_PAIRED+peer->index,
+        paired,
+        RECLAIM_UNPINNED
+    );
+}
+void chat(struct chat_args* a)
+{
+    struct chat_state state;
+    if(chat_init(a, &state))
+    {
+        return;
+    }
+    while(state.running)
+    {
+        for(size_t i=0;i<state.peers_size;++i)
+        {
+            chat_pump_file(state.peers[i]);
+        }
+        chat_update_wants(&state);
+        if(state.uring.fd!=-1)
         {
-            ui_handle_input(&state);
+            chat_uring_submit(&state);
+        }
+        if(!state.pipe)
+        {//Once for everything that changed this round.
+            ui_draw(&state);
+        }
+        if( loop_wait(&state.loop, chat_sync_keys(&state))&&
+            errno!=EINTR
+        ){
+            break;
         }
-        if(state.remote.state==CONNECTED&&node_error(&state.remote.node))
+        if( state.pipe_eof&&state.pipe_remote_eof&&
+            send_queue_empty(&state.current->sending)
+        ){//Both ways are done.
+            state.running=0;
+        }
+        for(size_t i=0;i<state.peers_size;++i)
+        {
+            chat_check_peer(state.peers[i]);
+        }
+        if(!state.pipe&&chat_file_progress(&state))
         {
-            user_disconnect(&state.remote);
-            state.remote.key=NULL;
-            chat_push_status(&state, "Remote disconnected");
+            ui_update(&state);
         }
+        prefetch_track(&state.prefetch, PREFETCH_LOCAL, state.local.key);
+        reclaim_track(
+            &state.reclaim,
+            RECLAIM_LOCAL,
+            state.local.key,
+            RECLAIM_UNPINNED
+        );
+        //Only close keys once the helper threads have let go of them.
+        key_store_trim(&state.keys);
     }
     chat_end(&state);
     return;
@@ -29,45 +29,206 @@ SOFTWARE.
     #include "message.h"
     #include "block.h"
     #include "address.h"
+    #include "prefetch.h"
+    #include "reclaim.h"
+    #include "sendqueue.h"
+    #include "frame.h"
+    #include "codebook.h"
+    #include "transfer.h"
+    #include "loop.h"
+    #include "uring.h"
+    #include "crypto.h"
+    #include "resolver.h"
     #include <stdlib.h>
 
-    struct chat_state
+    #define CHAT_PIPE_BLOCK_SIZE (64<<10)
+    //Each peer has a prefetch and a reclaim slot of its own.
+    #define CHAT_MAX_PEERS PREFETCH_MAX_REMOTES
+    #if RECLAIM_MAX_REMOTES<CHAT_MAX_PEERS
+        #error "Not enough reclaim slots for every peer"
+    #endif
+    //Room for a read, a write and a readahead per peer, and the local
+    //key's readahead.
+    #define CHAT_URING_ENTRIES 128
+    //Pad asked to be read into the page cache ahead of each head with
+    //--io-uring.
+    #define CHAT_READAHEAD_SIZE (4<<20)
+
+    struct chat_state;
+    //A session with one remote, shown in a tab of its own.
+    struct chat_peer
     {
-        struct key_store keys;
-        struct user local, remote;
+        struct user remote;
+        struct chat_state* state;
+        //Position in chat_state.peers, which never changes. Also the
+        //peer's prefetch and reclaim slot after the local key's.
+        size_t index;
+        struct loop_watch watch;
+        //Runs while the handshake is in progress.
+        struct loop_watch handshake_timer;
+        //Set if the connection was accepted rather than made.
+        unsigned incoming;
+        //Lookup of the address being connected to, or NULL.
+        struct resolver_request* resolving;
 
         struct message* history;
         size_t history_size;
         size_t history_line;
-        int history_width, history_height;//width and height of the history box
+        //Messages added while another peer was shown.
+        size_t unread;
+
+        struct frame_reader reader;
+        //Body of the frame being received, decrypted as it arrives. File
+        //data skips it and goes straight to file_in. Allocated size is
+        //receiving_capacity, the buffer is reused between frames.
+        struct block receiving;
+        size_t receiving_capacity;
+        uint32_t receiving_flags;
+        //Pad claimed for the frame being received, NULL if it was rejected.
+        const uint8_t* receiving_pad;
+        size_t receiving_offset;
+        //Head offset of that pad while the body is still arriving, kept
+        //from the reclaimer however large the frame. RECLAIM_UNPINNED
+        //between frames.
+        uint64_t receiving_pinned;
+        //The body is handed on piece by piece instead of being assembled in
+        //receiving.
+        unsigned receiving_streamed;
+        //Set instead when the body is assembled still encrypted, for
+        //chat_state.crypto to finish.
+        struct crypto_job* receiving_job;
+        //Jobs of this peer in chat_state.crypto. Their pad mustn't be
+        //reclaimed yet, none of it is before decrypting_pinned, a head
+        //offset.
+        size_t decrypting;
+        uint64_t decrypting_pinned;
+
+        //One of chat_state's codebooks, picked in the handshake.
+        const struct codebook* session_codebook;
+        //Message bytes before compression and pad spent on them, counted in
+        //both directions since the connection was formed.
+        uint64_t plain_bytes;
+        uint64_t pad_bytes;
+
+        //Files being sent and received, one of each at a time.
+        struct transfer file_out, file_in;
+        //Progress last shown in the UI, in percent.
+        int file_out_shown, file_in_shown;
+
+        struct send_queue sending;
+        struct frame_format send_format;
+
+        //--io-uring requests. They're tagged with connection, which counts
+        //up on every connection, so that late completions from an old one
+        //are ignored.
+        uint64_t connection;
+        struct uring_request recv_request, send_request;
+        struct iovec recv_iov[2];
+        struct iovec send_iov[SEND_QUEUE_MAX_IOV];
+        struct uring_request readahead_request;
+        //Head the pad was last read ahead from, UINT64_MAX for never.
+        uint64_t readahead_head;
+        //The same for the local key kept for this peer.
+        struct uring_request paired_readahead_request;
+        uint64_t paired_readahead_head;
+    };
+    struct chat_state
+    {
+        struct key_store keys;
+        //local.key is the local key from the command line. Each peer sends
+        //with its remote.local_key instead, which is that one only for a
+        //single peer at a time, see key_store_acquire_local().
+        struct user local;
+        //Peers are only added, disconnected ones are reused for new
+        //connections.
+        struct chat_peer* peers[CHAT_MAX_PEERS];
+        size_t peers_size;
+        //The peer whose history is shown and who gets typed messages.
+        struct chat_peer* current;
+        //Everything the main loop waits on besides the peers. input is
+        //stdin, resize is SIGWINCH and listen is local's socket.
+        struct loop loop;
+        struct loop_watch listen_watch;
+        struct loop_watch input_watch, resize_watch;
+        struct prefetch prefetch;
+        struct reclaim reclaim;
+        //With --io-uring, the peers' socket I/O and pad readahead go
+        //through this in a batch per loop round. fd is -1 otherwise.
+        struct uring uring;
+        struct loop_watch uring_watch;
+        struct uring_request readahead_request;
+        uint64_t readahead_head;
+        //Received messages and the streamed bodies of file data and --pipe
+        //are decrypted on this helper thread, unless --crypto-thread 0 left
+        //it not running. Each peer's jobs come back in the order they
+        //arrived.
+        struct crypto crypto;
+        struct loop_watch crypto_watch;
+        //Addresses given to /connect are resolved on helper threads.
+        struct resolver resolver;
+        struct loop_watch resolver_watch;
+
+        //Set by ui_update(), the UI is drawn once per loop round.
+        unsigned redraw;
+        //Width and height of the history box
+        int history_width, history_height;
 
         struct block input;
         size_t cursor_index;
 
-        struct block receiving;
-        size_t received_size;
+        //Used when both ends have compression on.
+        struct codebook codebook;
+        //Trained codebook given with --dict.
+        struct codebook dict;
+        //Compressed or decompressed copy of a message, reused like
+        //receiving.
+        uint8_t* scratch;
+        size_t scratch_capacity;
+        //Holds one chunk of a file on its way into a send queue.
+        uint8_t* file_chunk;
+
+        //Given to every new peer.
+        uint32_t offered_features;
+        size_t send_queue_limit;
+        size_t max_frame;
 
-        struct block sending;
-        size_t sent_size;
+        //--pipe mode, stdin is read in blocks of CHAT_PIPE_BLOCK_SIZE. An
+        //empty message marks the end of either side's input. There's only
+        //ever one peer.
+        unsigned pipe;
+        uint8_t* pipe_block;
+        unsigned pipe_eof, pipe_remote_eof;
+        //Restored on exit, --pipe makes stdin non-blocking.
+        int stdin_flags;
 
         unsigned running;
     };
 
     const char* chat_id_name(struct chat_state* state, uint32_t id);
+    //Adds msg to the history of peer.
     void chat_push_message(
         struct chat_state* state,
+        struct chat_peer* peer,
         const struct message* msg
     );
+    //Adds a status message to the history of the current peer.
     void chat_push_status(
         struct chat_state* state,
         const char* format,
         ...
     );
+    //Connects the current peer, or a new one if it's already connected.
     unsigned chat_begin_connect(struct chat_state* state, struct address* addr);
     unsigned chat_begin_listen(struct chat_state* state, uint16_t port);
     void chat_end_listen(struct chat_state* state);
     void chat_disconnect(struct chat_state* state, uint32_t id);
+    //Lists the peers as status messages.
+    void chat_list_peers(struct chat_state* state);
+    //Shows the peer with the given index.
+    unsigned chat_switch_peer(struct chat_state* state, size_t index);
 
+    //Sends b to the current peer.
     unsigned chat_begin_send(struct chat_state* state, struct block* b);
+    unsigned chat_send_file(struct chat_state* state, const char* path);
     void chat(struct chat_args* a);
 #endif
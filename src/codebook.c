@@ -0,0 +1,527 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "codebook.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+//Marks the end of a message in the training token strings.
+#define CODEBOOK_TRAIN_SEPARATOR 0xFFFF
+//Fragments seen fewer times than this don't get a code.
+#define CODEBOOK_TRAIN_MIN_COUNT 3
+
+//Letters, punctuation and the most frequent words and letter groups of
+//English chat.
+static const char* default_entries[]={
+    " ", "e", "t", "a", "o", "i", "n", "s", "h", "r", "d", "l", "u", "c",
+    "m", "w", "y", "f", "g", "p", "b", "v", "k", "j", "x", "q", "z",
+    ".", ",", "!", "?", "'", ":", "-", ")", "(", "\n", "0", "1", "2",
+    "3", "4", "5", "6", "7", "8", "9", "I", "T", "A", "S", "W", "H",
+    "O", "Y", "N", "M", "B", "C", "D",
+    " the ", "the ", " the", "The ", " and ", "and ", " to ", "to ",
+    " of ", " a ", " in ", " is ", " it ", "it ", " you ", "you ",
+    " that ", "that ", " for ", " on ", " with ", " this ", " be ",
+    " are ", " have ", " not ", " but ", " was ", " at ", " so ", " we ",
+    " can ", " just ", " what ", "what ", " do ", " if ", " my ", " me ",
+    " all ", " about ", " there ", " will ", " would ", " think ",
+    " know ", " like ", " get ", " now ", " when ", " how ", " yeah",
+    " ok", "ok", "yes", "no ", "lol", "haha", "thanks", "please",
+    " I'm ", "I'm ", " don't ", "don't ", " it's ", "It's ", " I ",
+    "I ", "Hi", "hi", "hey", "Hey", "hello", "Hello", "good", "time",
+    "work", "going", "really", "right", "today", "tomorrow", "later",
+    "sure", "maybe", "people", "because", "something", "should",
+    "could", "one", "out", "up", "here", "then", "some", "more",
+    "ing ", "ing", "ion", "tion", "ed ", "er ", "es ", "ly ", "s ",
+    "e ", "t ", "d ", "y ", "n ", "r ", "o ", ". ", ", ", "? ", "! ",
+    "th", "he", "in", "er", "an", "re", "on", "at", "en", "nd", "ti",
+    "es", "or", "te", "of", "ed", "is", "it", "al", "ar", "st", "nt",
+    "to", "ng", "se", "ha", "as", "ou", "io", "le", "ve", "co", "me",
+    "de", "ri", "ro", "ic", "ne", "ea", "ra", "ce", "li", "ch",
+    "ll", "be", "ma", "si", "om", "ur", "wh", "ee", "oo", "ay", "ow",
+    "ut", "ck", "ght", "ome", "ent", "ess", "ave", "ust", "ome ",
+    "..."
+};
+
+//FNV-1a over the entries, so that the same table gets the same id
+//everywhere.
+static uint32_t codebook_hash(const struct codebook* cb)
+{
+    uint32_t hash=2166136261u;
+    for(unsigned i=0;i<cb->count;++i)
+    {
+        hash=(hash^cb->sizes[i])*16777619u;
+        for(unsigned j=0;j<cb->sizes[i];++j)
+        {
+            hash=(hash^cb->entries[i][j])*16777619u;
+        }
+    }
+    return hash;
+}
+unsigned codebook_init(
+    struct codebook* cb,
+    const uint8_t* const* entries,
+    const size_t* sizes,
+    unsigned count
+){
+    if(count>CODEBOOK_MAX_ENTRIES)
+    {
+        return 1;
+    }
+    memset(cb, 0, sizeof(struct codebook));
+    for(unsigned i=0;i<count;++i)
+    {
+        if(sizes[i]==0||sizes[i]>CODEBOOK_MAX_ENTRY_SIZE)
+        {
+            return 1;
+        }
+        memcpy(cb->entries[i], entries[i], sizes[i]);
+        cb->sizes[i]=sizes[i];
+        size_t prefix_size=sizes[i]<8?sizes[i]:8;
+        uint64_t prefix=0;
+        memcpy(&prefix, cb->entries[i], 8);
+        cb->prefixes[i]=le64toh(prefix);
+        cb->masks[i]=prefix_size==8?UINT64_MAX:(1ull<<(prefix_size*8))-1;
+        cb->prefixes[i]&=cb->masks[i];
+    }
+    cb->count=count;
+    //Bucket the codes by their first byte.
+    for(unsigned i=0;i<count;++i)
+    {
+        cb->first_begin[cb->entries[i][0]+1]++;
+    }
+    for(unsigned b=0;b<256;++b)
+    {
+        cb->first_begin[b+1]+=cb->first_begin[b];
+    }
+    uint16_t fill[256];
+    memcpy(fill, cb->first_begin, sizeof(fill));
+    for(unsigned i=0;i<count;++i)
+    {
+        cb->by_first[fill[cb->entries[i][0]]++]=i;
+    }
+    //Longest first within each bucket, so the first match is the best
+    //greedy one. The buckets are tiny, insertion sort does.
+    for(unsigned b=0;b<256;++b)
+    {
+        for(unsigned i=cb->first_begin[b]+1;i<cb->first_begin[b+1];++i)
+        {
+            uint8_t code=cb->by_first[i];
+            unsigned j=i;
+            while(j>cb->first_begin[b]&&
+                  cb->sizes[cb->by_first[j-1]]<cb->sizes[code])
+            {
+                cb->by_first[j]=cb->by_first[j-1];
+                j--;
+            }
+            cb->by_first[j]=code;
+        }
+    }
+    cb->id=codebook_hash(cb);
+    return 0;
+}
+void codebook_init_default(struct codebook* cb)
+{
+    const unsigned count=sizeof(default_entries)/sizeof(default_entries[0]);
+    const uint8_t* entries[sizeof(default_entries)/sizeof(default_entries[0])];
+    size_t sizes[sizeof(default_entries)/sizeof(default_entries[0])];
+    for(unsigned i=0;i<count;++i)
+    {
+        entries[i]=(const uint8_t*)default_entries[i];
+        sizes[i]=strlen(default_entries[i]);
+    }
+    codebook_init(cb, entries, sizes, count);
+}
+//Writes the pending literal bytes. Returns non-zero if they don't fit.
+static unsigned codebook_flush_literals(
+    uint8_t* dst,
+    size_t dst_capacity,
+    size_t* dst_size,
+    const uint8_t* literals,
+    size_t count
+){
+    while(count>0)
+    {
+        size_t run=count>256?256:count;
+        size_t needed=run==1?2:run+2;
+        if(needed>dst_capacity-*dst_size)
+        {
+            return 1;
+        }
+        if(run==1)
+        {
+            dst[(*dst_size)++]=CODEBOOK_LITERAL;
+        }
+        else
+        {
+            dst[(*dst_size)++]=CODEBOOK_LITERAL_RUN;
+            dst[(*dst_size)++]=run-1;
+        }
+        memcpy(dst+*dst_size, literals, run);
+        *dst_size+=run;
+        literals+=run;
+        count-=run;
+    }
+    return 0;
+}
+size_t codebook_compress(
+    const struct codebook* cb,
+    uint8_t* dst,
+    size_t dst_capacity,
+    const uint8_t* src,
+    size_t size,
+    uint32_t* usage
+){
+    size_t dst_size=0;
+    size_t literal_begin=0, literal_count=0;
+    for(size_t i=0;i<size;)
+    {
+        //Greedy longest match among the entries starting with this byte.
+        unsigned begin=cb->first_begin[src[i]];
+        unsigned end=cb->first_begin[src[i]+1];
+        int code=-1;
+        uint64_t word=0;
+        memcpy(&word, src+i, size-i<8?size-i:8);
+        word=le64toh(word);
+        for(unsigned j=begin;j<end;++j)
+        {
+            uint8_t c=cb->by_first[j];
+            if(cb->sizes[c]<=size-i&&(word&cb->masks[c])==cb->prefixes[c]&&
+               (cb->sizes[c]<=8||
+                memcmp(cb->entries[c]+8, src+i+8, cb->sizes[c]-8)==0))
+            {
+                code=c;
+                break;
+            }
+        }
+        if(code==-1)
+        {
+            if(literal_count==0)
+            {
+                literal_begin=i;
+            }
+            literal_count++;
+            i++;
+            continue;
+        }
+        if( codebook_flush_literals(
+                dst,
+                dst_capacity,
+                &dst_size,
+                src+literal_begin,
+                literal_count
+            )||dst_size==dst_capacity
+        ){
+            return 0;
+        }
+        literal_count=0;
+        dst[dst_size++]=code;
+        if(usage!=NULL)
+        {
+            usage[code]++;
+        }
+        i+=cb->sizes[code];
+    }
+    if( codebook_flush_literals(
+            dst,
+            dst_capacity,
+            &dst_size,
+            src+literal_begin,
+            literal_count
+        )
+    ){
+        return 0;
+    }
+    return dst_size;
+}
+size_t codebook_decompressed_size(
+    const struct codebook* cb,
+    const uint8_t* src,
+    size_t size
+){
+    size_t out=0;
+    for(size_t i=0;i<size;)
+    {
+        uint8_t code=src[i++];
+        if(code==CODEBOOK_LITERAL||code==CODEBOOK_LITERAL_RUN)
+        {
+            size_t run=1;
+            if(code==CODEBOOK_LITERAL_RUN)
+            {
+                if(i==size)
+                {
+                    return SIZE_MAX;
+                }
+                run=(size_t)src[i++]+1;
+            }
+            if(run>size-i)
+            {
+                return SIZE_MAX;
+            }
+            i+=run;
+            out+=run;
+        }
+        else if(code<cb->count)
+        {
+            out+=cb->sizes[code];
+        }
+        else
+        {
+            return SIZE_MAX;
+        }
+    }
+    return out;
+}
+unsigned codebook_decompress(
+    const struct codebook* cb,
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t size
+){
+    for(size_t i=0;i<size;)
+    {
+        uint8_t code=src[i++];
+        if(code==CODEBOOK_LITERAL||code==CODEBOOK_LITERAL_RUN)
+        {
+            size_t run=1;
+            if(code==CODEBOOK_LITERAL_RUN)
+            {
+                if(i==size)
+                {
+                    return 1;
+                }
+                run=(size_t)src[i++]+1;
+            }
+            if(run>size-i)
+            {
+                return 1;
+            }
+            memcpy(dst, src+i, run);
+            dst+=run;
+            i+=run;
+        }
+        else if(code<cb->count)
+        {
+            memcpy(dst, cb->entries[code], cb->sizes[code]);
+            dst+=cb->sizes[code];
+        }
+        else
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+//Training works on the messages as strings of tokens. Every token is a
+//byte or a merge of two earlier tokens, so the table never grows past the
+//number of codes.
+struct codebook_tokens
+{
+    uint8_t data[CODEBOOK_MAX_ENTRIES][CODEBOOK_MAX_ENTRY_SIZE];
+    uint8_t sizes[CODEBOOK_MAX_ENTRIES];
+    unsigned count;
+};
+//Returns the token for the given bytes, adding it if it's new.
+static unsigned codebook_token(
+    struct codebook_tokens* t,
+    const uint8_t* data,
+    size_t size
+){
+    for(unsigned i=0;i<t->count;++i)
+    {
+        if(t->sizes[i]==size&&memcmp(t->data[i], data, size)==0)
+        {
+            return i;
+        }
+    }
+    memcpy(t->data[t->count], data, size);
+    t->sizes[t->count]=size;
+    return t->count++;
+}
+unsigned codebook_train(
+    struct codebook* cb,
+    const struct block* messages,
+    size_t count
+){
+    //Messages are laid out one after another, CODEBOOK_TRAIN_SEPARATOR
+    //keeps tokens from merging across them.
+    size_t total=0;
+    uint32_t byte_counts[256]={0};
+    for(size_t i=0;i<count;++i)
+    {
+        total+=messages[i].size+1;
+        for(size_t j=0;j<messages[i].size;++j)
+        {
+            byte_counts[messages[i].data[j]]++;
+        }
+    }
+    //Bytes seen only once or twice are cheaper as literals than as codes
+    //that push out longer fragments.
+    struct codebook_tokens t;
+    t.count=0;
+    uint16_t byte_token[256];
+    for(unsigned b=0;b<256;++b)
+    {
+        byte_token[b]=CODEBOOK_TRAIN_SEPARATOR;
+        if(byte_counts[b]>=CODEBOOK_TRAIN_MIN_COUNT&&
+           t.count<CODEBOOK_MAX_ENTRIES/2)
+        {
+            uint8_t byte=b;
+            byte_token[b]=codebook_token(&t, &byte, 1);
+        }
+    }
+    if(t.count==0)
+    {
+        return 1;
+    }
+    uint16_t* tokens=(uint16_t*)malloc(total*sizeof(uint16_t));
+    size_t size=0;
+    for(size_t i=0;i<count;++i)
+    {
+        for(size_t j=0;j<messages[i].size;++j)
+        {
+            tokens[size++]=byte_token[messages[i].data[j]];
+        }
+        tokens[size++]=CODEBOOK_TRAIN_SEPARATOR;
+    }
+    //Byte pair encoding: keep merging the most frequent pair of adjacent
+    //tokens into a new one.
+    uint32_t* pair_counts=(uint32_t*)malloc(
+        CODEBOOK_MAX_ENTRIES*CODEBOOK_MAX_ENTRIES*sizeof(uint32_t)
+    );
+    while(t.count<CODEBOOK_MAX_ENTRIES)
+    {
+        memset(
+            pair_counts,
+            0,
+            CODEBOOK_MAX_ENTRIES*CODEBOOK_MAX_ENTRIES*sizeof(uint32_t)
+        );
+        uint32_t best_count=0;
+        unsigned best=0;
+        for(size_t i=0;i+1<size;++i)
+        {
+            unsigned a=tokens[i], b=tokens[i+1];
+            if(a==CODEBOOK_TRAIN_SEPARATOR||b==CODEBOOK_TRAIN_SEPARATOR||
+               t.sizes[a]+t.sizes[b]>CODEBOOK_MAX_ENTRY_SIZE)
+            {
+                continue;
+            }
+            unsigned pair=a*CODEBOOK_MAX_ENTRIES+b;
+            if(++pair_counts[pair]>best_count)
+            {
+                best_count=pair_counts[pair];
+                best=pair;
+            }
+            //Runs like "aaa" hold one pair, not two.
+            if(a==b&&i+2<size&&tokens[i+2]==a)
+            {
+                i++;
+            }
+        }
+        if(best_count<CODEBOOK_TRAIN_MIN_COUNT)
+        {
+            break;
+        }
+        unsigned a=best/CODEBOOK_MAX_ENTRIES, b=best%CODEBOOK_MAX_ENTRIES;
+        uint8_t merged[CODEBOOK_MAX_ENTRY_SIZE];
+        memcpy(merged, t.data[a], t.sizes[a]);
+        memcpy(merged+t.sizes[a], t.data[b], t.sizes[b]);
+        unsigned token=codebook_token(&t, merged, t.sizes[a]+t.sizes[b]);
+        //Rewrite the token strings with the merged pair.
+        size_t out=0;
+        for(size_t i=0;i<size;++i)
+        {
+            if(i+1<size&&tokens[i]==a&&tokens[i+1]==b)
+            {
+                tokens[out++]=token;
+                i++;
+            }
+            else
+            {
+                tokens[out++]=tokens[i];
+            }
+        }
+        size=out;
+    }
+    free(pair_counts);
+    free(tokens);
+    const uint8_t* entries[CODEBOOK_MAX_ENTRIES];
+    size_t sizes[CODEBOOK_MAX_ENTRIES];
+    for(unsigned i=0;i<t.count;++i)
+    {
+        entries[i]=t.data[i];
+        sizes[i]=t.sizes[i];
+    }
+    return codebook_init(cb, entries, sizes, t.count);
+}
+unsigned codebook_load(struct codebook* cb, const char* path)
+{
+    FILE* f=fopen(path, "rb");
+    if(f==NULL)
+    {
+        return 1;
+    }
+    uint8_t header[12];
+    uint32_t count=0;
+    unsigned fail=fread(header, 1, sizeof(header), f)!=sizeof(header)||
+        memcmp(header, CODEBOOK_FILE_MAGIC, 8)!=0;
+    if(!fail)
+    {
+        memcpy(&count, header+8, sizeof(count));
+        count=le32toh(count);
+        fail=count>CODEBOOK_MAX_ENTRIES;
+    }
+    uint8_t data[CODEBOOK_MAX_ENTRIES][CODEBOOK_MAX_ENTRY_SIZE];
+    const uint8_t* entries[CODEBOOK_MAX_ENTRIES];
+    size_t sizes[CODEBOOK_MAX_ENTRIES];
+    for(uint32_t i=0;!fail&&i<count;++i)
+    {
+        int size=fgetc(f);
+        fail=size<=0||size>CODEBOOK_MAX_ENTRY_SIZE||
+            fread(data[i], 1, size, f)!=(size_t)size;
+        entries[i]=data[i];
+        sizes[i]=size;
+    }
+    fclose(f);
+    return fail||codebook_init(cb, entries, sizes, count);
+}
+unsigned codebook_save(const struct codebook* cb, const char* path)
+{
+    FILE* f=fopen(path, "wb");
+    if(f==NULL)
+    {
+        return 1;
+    }
+    uint32_t count=htole32(cb->count);
+    unsigned fail=fwrite(CODEBOOK_FILE_MAGIC, 1, 8, f)!=8||
+        fwrite(&count, 1, sizeof(count), f)!=sizeof(count);
+    for(unsigned i=0;!fail&&i<cb->count;++i)
+    {
+        fail=fputc(cb->sizes[i], f)==EOF||
+            fwrite(cb->entries[i], 1, cb->sizes[i], f)!=cb->sizes[i];
+    }
+    fail|=fclose(f)!=0;
+    return fail;
+}
@@ -0,0 +1,106 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_CODEBOOK_H_
+#define OTPCHAT_CODEBOOK_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include "block.h"
+    //Codes 0 to 253 stand for entries, 254 is followed by one literal byte
+    //and 255 by n and then n+1 literal bytes.
+    #define CODEBOOK_MAX_ENTRIES 254
+    #define CODEBOOK_MAX_ENTRY_SIZE 16
+    #define CODEBOOK_LITERAL 254
+    #define CODEBOOK_LITERAL_RUN 255
+    #define CODEBOOK_FILE_MAGIC "OTPCHATD"
+
+    //Compression table for short messages. Each input fragment found in the
+    //table costs a single byte, so common words and letter groups shrink
+    //to a fraction of their size while anything else costs at most a few
+    //bytes extra.
+    struct codebook
+    {
+        uint8_t entries[CODEBOOK_MAX_ENTRIES][CODEBOOK_MAX_ENTRY_SIZE];
+        uint8_t sizes[CODEBOOK_MAX_ENTRIES];
+        unsigned count;
+        //Codes of the entries starting with byte b are
+        //by_first[first_begin[b]] to by_first[first_begin[b+1]-1], longest
+        //first.
+        uint16_t first_begin[257];
+        uint8_t by_first[CODEBOOK_MAX_ENTRIES];
+        //First 8 bytes of each entry as a little-endian word and the mask
+        //of the bytes it covers, to test a match with a single compare.
+        uint64_t prefixes[CODEBOOK_MAX_ENTRIES];
+        uint64_t masks[CODEBOOK_MAX_ENTRIES];
+        //Hash of the entries, both ends must have the same one.
+        uint32_t id;
+    };
+    //Builds a codebook from count entries of sizes[i] bytes each. Returns
+    //non-zero if there are too many entries or one of them is too long.
+    unsigned codebook_init(
+        struct codebook* cb,
+        const uint8_t* const* entries,
+        const size_t* sizes,
+        unsigned count
+    );
+    //The built-in codebook, made for English chat messages.
+    void codebook_init_default(struct codebook* cb);
+    //Builds a codebook for messages like the count given ones.
+    //Returns non-zero if there's nothing to learn from.
+    unsigned codebook_train(
+        struct codebook* cb,
+        const struct block* messages,
+        size_t count
+    );
+    //A codebook file is CODEBOOK_FILE_MAGIC, a le32 entry count and each
+    //entry as a size byte followed by its bytes. Both return non-zero on
+    //failure.
+    unsigned codebook_load(struct codebook* cb, const char* path);
+    unsigned codebook_save(const struct codebook* cb, const char* path);
+    //Compresses src into dst. Returns the compressed size, or 0 if it
+    //wouldn't fit in dst_capacity bytes. Passing size-1 as dst_capacity
+    //gives up as soon as compressing stops paying off. If usage isn't NULL,
+    //usage[code] is incremented for every entry used.
+    size_t codebook_compress(
+        const struct codebook* cb,
+        uint8_t* dst,
+        size_t dst_capacity,
+        const uint8_t* src,
+        size_t size,
+        uint32_t* usage
+    );
+    //Returns the size src decompresses to, or SIZE_MAX if it's malformed.
+    size_t codebook_decompressed_size(
+        const struct codebook* cb,
+        const uint8_t* src,
+        size_t size
+    );
+    //dst must hold codebook_decompressed_size() bytes. Returns non-zero if
+    //src is malformed.
+    unsigned codebook_decompress(
+        const struct codebook* cb,
+        uint8_t* dst,
+        const uint8_t* src,
+        size_t size
+    );
+#endif
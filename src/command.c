@@ -23,6 +23,7 @@ SOFTWARE.
 */
 #include "command.h"
 #include "chat.h"
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #define ARG_SEPARATORS " \t"
@@ -138,7 +139,81 @@ static unsigned command_endlisten(
     chat_end_listen(state);
     return 0;
 }
-
+//Appends the messages of the current peer to a file, one per line, for
+//otpchat --train-dict.
+static unsigned command_export(
+    struct chat_state* state,
+    int argc, char** argv
+){
+    if(argc!=1)
+    {
+        return 2;
+    }
+    FILE* f=fopen(argv[0], "ab");
+    if(f==NULL)
+    {
+        chat_push_status(state, "Unable to open \"%s\"", argv[0]);
+        return 1;
+    }
+    size_t exported=0;
+    const struct chat_peer* peer=state->current;
+    for(size_t i=0;i<peer->history_size;++i)
+    {
+        const struct message* msg=&peer->history[i];
+        if(msg->id!=ID_LOCAL&&msg->id!=ID_REMOTE)
+        {
+            continue;
+        }
+        fwrite(msg->text.data, 1, msg->text.size, f);
+        fputc('\n', f);
+        exported++;
+    }
+    if(fclose(f)!=0)
+    {
+        chat_push_status(state, "Writing \"%s\" failed", argv[0]);
+        return 1;
+    }
+    chat_push_status(state, "Exported %zu messages", exported);
+    return 0;
+}
+static unsigned command_sendfile(
+    struct chat_state* state,
+    int argc, char** argv
+){
+    if(argc!=1)
+    {
+        return 2;
+    }
+    return chat_send_file(state, argv[0]);
+}
+static unsigned command_peers(
+    struct chat_state* state,
+    int argc, char** argv
+){
+    (void)argv;
+    if(argc!=0)
+    {
+        return 2;
+    }
+    chat_list_peers(state);
+    return 0;
+}
+static unsigned command_switch(
+    struct chat_state* state,
+    int argc, char** argv
+){
+    if(argc!=1)
+    {
+        return 2;
+    }
+    char* index_end=NULL;
+    unsigned long index=strtoul(argv[0], &index_end, 10);
+    if(index==0||*index_end!=0)
+    {
+        return 2;
+    }
+    return chat_switch_peer(state, index-1);
+}
 static unsigned command_quit(struct chat_state* state, int argc, char** argv)
 {
     (void)argv;
@@ -162,6 +237,10 @@ static const struct command_table_entry command_table[]={
     {"disconnect", command_disconnect},
     {"listen", command_listen},
     {"endlisten", command_endlisten},
+    {"export", command_export},
+    {"sendfile", command_sendfile},
+    {"peers", command_peers},
+    {"switch", command_switch},
     {"quit", command_quit}
 };
 unsigned command_handle(struct chat_state* state, const char* command_str)
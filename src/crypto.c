@@ -0,0 +1,169 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "crypto.h"
+#include "codebook.h"
+#include "xor.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+static void crypto_signal(int fd)
+{
+    uint64_t one=1;
+    while(write(fd, &one, sizeof(one))==-1&&errno==EINTR);
+}
+static void crypto_run(struct crypto_job* job)
+{
+    struct block* text=&job->msg.text;
+    xor_blocks(text->data, text->data, job->pad, text->size);
+    if(job->codebook==NULL)
+    {
+        return;
+    }
+    size_t size=codebook_decompressed_size(
+        job->codebook,
+        text->data,
+        text->size
+    );
+    if(size==SIZE_MAX)
+    {
+        job->malformed=1;
+        return;
+    }
+    uint8_t* plain=(uint8_t*)malloc(size);
+    codebook_decompress(job->codebook, plain, text->data, text->size);
+    free(text->data);
+    text->data=plain;
+    text->size=size;
+}
+static void* crypto_thread(void* arg)
+{
+    struct crypto* c=(struct crypto*)arg;
+    for(;;)
+    {
+        struct crypto_job* job=(struct crypto_job*)spsc_pop(&c->jobs);
+        if(job!=NULL)
+        {
+            crypto_run(job);
+            //Can't be full, there are never more than CRYPTO_QUEUE_SIZE
+            //jobs in flight.
+            spsc_push(&c->done, job);
+            crypto_signal(c->done_fd);
+            continue;
+        }
+        if(!__atomic_load_n(&c->running, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+        //Resets the counter. A job pushed since the pop above has bumped
+        //it, so this doesn't block on it.
+        uint64_t count;
+        while(read(c->wake_fd, &count, sizeof(count))==-1&&errno==EINTR);
+    }
+    return NULL;
+}
+unsigned crypto_init(struct crypto* c)
+{
+    c->in_flight=0;
+    c->running=0;
+    c->jobs.slots=NULL;
+    c->done.slots=NULL;
+    c->wake_fd=eventfd(0, EFD_CLOEXEC);
+    c->done_fd=eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if( c->wake_fd==-1||c->done_fd==-1||
+        spsc_init(&c->jobs, CRYPTO_QUEUE_SIZE)||
+        spsc_init(&c->done, CRYPTO_QUEUE_SIZE)
+    ){
+        goto fail;
+    }
+    c->running=1;
+    if(pthread_create(&c->thread, NULL, crypto_thread, c)!=0)
+    {
+        c->running=0;
+        goto fail;
+    }
+    return 0;
+fail:
+    if(c->wake_fd!=-1) close(c->wake_fd);
+    if(c->done_fd!=-1) close(c->done_fd);
+    spsc_free(&c->jobs);
+    spsc_free(&c->done);
+    return 1;
+}
+unsigned crypto_submit(struct crypto* c, struct crypto_job* job)
+{
+    if(c->in_flight==CRYPTO_QUEUE_SIZE||spsc_push(&c->jobs, job))
+    {
+        return 1;
+    }
+    c->in_flight++;
+    crypto_signal(c->wake_fd);
+    return 0;
+}
+struct crypto_job* crypto_next(struct crypto* c, unsigned wait)
+{
+    if(c->in_flight==0)
+    {
+        return NULL;
+    }
+    for(;;)
+    {
+        struct crypto_job* job=(struct crypto_job*)spsc_pop(&c->done);
+        if(job!=NULL)
+        {
+            c->in_flight--;
+            return job;
+        }
+        //Same as in the thread, reset the counter and look again so that
+        //no wakeup is lost.
+        uint64_t count;
+        if(read(c->done_fd, &count, sizeof(count))==sizeof(count))
+        {
+            continue;
+        }
+        if(!wait)
+        {
+            return NULL;
+        }
+        struct pollfd p={c->done_fd, POLLIN, 0};
+        poll(&p, 1, -1);
+    }
+}
+void crypto_end(struct crypto* c)
+{
+    if(!c->running)
+    {
+        return;
+    }
+    __atomic_store_n(&c->running, 0, __ATOMIC_RELEASE);
+    crypto_signal(c->wake_fd);
+    pthread_join(c->thread, NULL);
+    close(c->wake_fd);
+    close(c->done_fd);
+    spsc_free(&c->jobs);
+    spsc_free(&c->done);
+}
@@ -0,0 +1,76 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_CRYPTO_H_
+#define OTPCHAT_CRYPTO_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <pthread.h>
+    #include "message.h"
+    #include "spsc.h"
+    //Jobs in flight at once.
+    #define CRYPTO_QUEUE_SIZE 64
+
+    struct codebook;
+    //A received message to decrypt, and decompress if codebook isn't NULL,
+    //or a piece of one.
+    struct crypto_job
+    {
+        //Whoever queued the job and what it does with the plaintext,
+        //untouched by the thread.
+        void* owner;
+        uint32_t tag;
+        //Holds the ciphertext going in and the plaintext coming out.
+        struct message msg;
+        //Stays mapped until the job has come back.
+        const uint8_t* pad;
+        const struct codebook* codebook;
+        //Set if the plaintext didn't decompress.
+        unsigned malformed;
+    };
+    //Decrypts received messages on a helper thread. Jobs go there and back
+    //through a pair of lock-free queues, and come back in the order they
+    //were queued.
+    struct crypto
+    {
+        pthread_t thread;
+        struct spsc jobs;
+        struct spsc done;
+        //The thread sleeps on wake_fd. done_fd becomes readable when jobs
+        //have come back, for the event loop to watch.
+        int wake_fd;
+        int done_fd;
+        size_t in_flight;
+        unsigned running;
+    };
+    //Returns non-zero on failure.
+    unsigned crypto_init(struct crypto* c);
+    //Returns non-zero if CRYPTO_QUEUE_SIZE jobs are already in flight.
+    unsigned crypto_submit(struct crypto* c, struct crypto_job* job);
+    //Returns the next finished job, or NULL if there is none yet. With wait,
+    //blocks for it as long as there are jobs in flight.
+    struct crypto_job* crypto_next(struct crypto* c, unsigned wait);
+    //Get every job back with crypto_next() first, the ones still in flight
+    //are lost otherwise.
+    void crypto_end(struct crypto* c);
+#endif
@@ -0,0 +1,330 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "frame.h"
+#include "node.h"
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/uio.h>
+
+void frame_write_header(
+    uint8_t* header,
+    uint32_t size,
+    uint64_t head,
+    uint32_t flags
+){
+    size=htobe32(size|flags);
+    head=htobe64(head);
+    memcpy(header+FRAME_SIZE_OFFSET, &size, sizeof(size));
+    memcpy(header+FRAME_HEAD_OFFSET, &head, sizeof(head));
+}
+void frame_format_init(struct frame_format* f, unsigned compact)
+{
+    f->compact=compact;
+    f->synced=0;
+    f->next_head=0;
+}
+static size_t frame_put_varint(uint8_t* dst, uint64_t value)
+{
+    size_t size=0;
+    while(value>=0x80)
+    {
+        dst[size++]=(value&0x7F)|0x80;
+        value>>=7;
+    }
+    dst[size++]=value;
+    return size;
+}
+//Returns the number of bytes read, 0 if src ends before the varint does
+//or -1 if it's too long to be valid.
+static int frame_get_varint(const uint8_t* src, size_t size, uint64_t* value)
+{
+    *value=0;
+    for(size_t i=0;i<size;++i)
+    {
+        if(i==10)
+        {
+            return -1;
+        }
+        *value|=(uint64_t)(src[i]&0x7F)<<(7*i);
+        if(!(src[i]&0x80))
+        {
+            return i+1;
+        }
+    }
+    return size>=10?-1:0;
+}
+size_t frame_format_header(
+    struct frame_format* f,
+    uint8_t* header,
+    uint32_t size,
+    uint64_t head,
+    uint32_t flags
+){
+    if(!f->compact)
+    {
+        frame_write_header(header, size, head, flags);
+        return FRAME_HEADER_SIZE;
+    }
+    unsigned mode=FRAME_HEAD_ABSOLUTE;
+    if(f->synced&&head>=f->next_head)
+    {
+        mode=head==f->next_head?FRAME_HEAD_NEXT:FRAME_HEAD_SKIP;
+    }
+    uint64_t first=(uint64_t)size<<FRAME_COMPACT_SIZE_SHIFT|mode|
+        FRAME_KIND(flags)<<FRAME_COMPACT_KIND_SHIFT;
+    if(flags&FRAME_FLAG_COMPRESSED)
+    {
+        first|=FRAME_COMPACT_COMPRESSED;
+    }
+    size_t header_size=frame_put_varint(header, first);
+    if(mode==FRAME_HEAD_SKIP)
+    {
+        header_size+=frame_put_varint(header+header_size, head-f->next_head);
+    }
+    else if(mode==FRAME_HEAD_ABSOLUTE)
+    {
+        header_size+=frame_put_varint(header+header_size, head);
+    }
+    f->synced=1;
+    f->next_head=head+size;
+    return header_size;
+}
+//Parses a compact header from the size bytes at header. Returns its
+//length, 0 if it isn't complete yet or -1 if it's malformed.
+static int frame_parse_compact(
+    struct frame_format* f,
+    const uint8_t* header,
+    size_t size,
+    struct frame_event* e
+){
+    uint64_t first=0;
+    int first_size=frame_get_varint(header, size, &first);
+    if(first_size<=0)
+    {
+        return first_size;
+    }
+    if((first>>FRAME_COMPACT_SIZE_SHIFT)>FRAME_SIZE_MASK)
+    {
+        return -1;
+    }
+    e->size=first>>FRAME_COMPACT_SIZE_SHIFT;
+    e->flags=first&FRAME_COMPACT_COMPRESSED?FRAME_FLAG_COMPRESSED:0;
+    e->flags|=FRAME_FLAG_KIND(first>>FRAME_COMPACT_KIND_SHIFT&3);
+    int header_size=first_size;
+    uint64_t value=0;
+    switch(first&FRAME_HEAD_MODE_MASK)
+    {
+    case FRAME_HEAD_NEXT:
+        e->head=f->next_head;
+        break;
+    case FRAME_HEAD_SKIP:
+    case FRAME_HEAD_ABSOLUTE:
+        {
+            int value_size=frame_get_varint(
+                header+first_size,
+                size-first_size,
+                &value
+            );
+            if(value_size<=0)
+            {
+                return value_size;
+            }
+            header_size+=value_size;
+            e->head=(first&FRAME_HEAD_MODE_MASK)==FRAME_HEAD_SKIP?
+                f->next_head+value:value;
+        }
+        break;
+    default:
+        return -1;
+    }
+    if((first&FRAME_HEAD_MODE_MASK)!=FRAME_HEAD_ABSOLUTE&&!f->synced)
+    {//Nothing to be relative to.
+        return -1;
+    }
+    f->synced=1;
+    f->next_head=e->head+e->size;
+    return header_size;
+}
+void frame_reader_init(struct frame_reader* r, size_t capacity)
+{
+    //Always room for at least one header.
+    r->capacity=16;
+    while(r->capacity<capacity)
+    {
+        r->capacity*=2;
+    }
+    r->ring=(uint8_t*)malloc(r->capacity);
+    r->max_size=FRAME_SIZE_MASK;
+    frame_reader_reset(r);
+}
+void frame_reader_free(struct frame_reader* r)
+{
+    free(r->ring);
+    r->ring=NULL;
+    r->capacity=0;
+}
+void frame_reader_reset(struct frame_reader* r)
+{
+    r->read=0;
+    r->write=0;
+    r->in_body=0;
+    r->body_left=0;
+    frame_format_init(&r->format, 0);
+}
+void frame_reader_set_compact(struct frame_reader* r, unsigned compact)
+{
+    frame_format_init(&r->format, compact);
+}
+void frame_reader_set_max_size(struct frame_reader* r, size_t max_size)
+{
+    r->max_size=max_size;
+}
+size_t frame_reader_space(struct frame_reader* r, struct iovec iov[2])
+{
+    size_t free_size=r->capacity-(r->write-r->read);
+    if(free_size==0)
+    {
+        return 0;
+    }
+    size_t start=r->write&(r->capacity-1);
+    size_t first=r->capacity-start;
+    if(first>free_size)
+    {
+        first=free_size;
+    }
+    iov[0].iov_base=r->ring+start;
+    iov[0].iov_len=first;
+    iov[1].iov_base=r->ring;
+    iov[1].iov_len=free_size-first;
+    return free_size==first?1:2;
+}
+void frame_reader_commit(struct frame_reader* r, size_t received)
+{
+    r->write+=received;
+}
+size_t frame_reader_fill(struct frame_reader* r, struct node* remote)
+{
+    struct iovec iov[2];
+    size_t iov_count=frame_reader_space(r, iov);
+    if(iov_count==0)
+    {
+        return 0;
+    }
+    size_t received=node_recvv(remote, iov, iov_count);
+    frame_reader_commit(r, received);
+    return received;
+}
+unsigned frame_reader_next(struct frame_reader* r, struct frame_event* e)
+{
+    size_t available=r->write-r->read;
+    size_t start=r->read&(r->capacity-1);
+    if(!r->in_body)
+    {
+        if(available<(r->format.compact?1:FRAME_HEADER_SIZE))
+        {
+            return 0;
+        }
+        //The header may wrap around the end of the ring.
+        uint8_t header[FRAME_MAX_HEADER_SIZE];
+        size_t header_size=available<FRAME_MAX_HEADER_SIZE?
+            available:FRAME_MAX_HEADER_SIZE;
+        size_t first=r->capacity-start;
+        if(first>=header_size)
+        {
+            memcpy(header, r->ring+start, header_size);
+        }
+        else
+        {
+            memcpy(header, r->ring+start, first);
+            memcpy(header+first, r->ring, header_size-first);
+        }
+        if(r->format.compact)
+        {
+            int parsed=frame_parse_compact(
+                &r->format,
+                header,
+                header_size,
+                e
+            );
+            if(parsed<0)
+            {
+                e->type=FRAME_ERROR;
+                return 1;
+            }
+            if(parsed==0)
+            {
+                return 0;
+            }
+            header_size=parsed;
+        }
+        else
+        {
+            memcpy(&e->size, header+FRAME_SIZE_OFFSET, sizeof(e->size));
+            memcpy(&e->head, header+FRAME_HEAD_OFFSET, sizeof(e->head));
+            e->size=be32toh(e->size);
+            e->flags=e->size&~FRAME_SIZE_MASK;
+            e->size&=FRAME_SIZE_MASK;
+            e->head=be64toh(e->head);
+            header_size=FRAME_HEADER_SIZE;
+        }
+        if(e->size>r->max_size)
+        {
+            e->type=FRAME_ERROR;
+            return 1;
+        }
+        e->type=FRAME_HEADER;
+        r->read+=header_size;
+        r->in_body=1;
+        r->body_left=e->size;
+        return 1;
+    }
+    if(r->body_left==0)
+    {
+        e->type=FRAME_END;
+        r->in_body=0;
+        return 1;
+    }
+    if(available==0)
+    {
+        return 0;
+    }
+    //Hand out the largest contiguous piece of the body there is.
+    size_t chunk=r->capacity-start;
+    if(chunk>available)
+    {
+        chunk=available;
+    }
+    if(chunk>r->body_left)
+    {
+        chunk=r->body_left;
+    }
+    e->type=FRAME_DATA;
+    e->data=r->ring+start;
+    e->data_size=chunk;
+    r->read+=chunk;
+    r->body_left-=chunk;
+    return 1;
+}
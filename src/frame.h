@@ -0,0 +1,155 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_FRAME_H_
+#define OTPCHAT_FRAME_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <sys/uio.h>
+    //A frame is a be32 body size and the be64 head of the pad used to
+    //encrypt the body, followed by the body. The top bits of the size are
+    //flags.
+    #define FRAME_HEADER_SIZE 12
+    #define FRAME_SIZE_OFFSET 0
+    #define FRAME_HEAD_OFFSET 4
+    #define FRAME_SIZE_MASK 0x1FFFFFFFu
+    //The body was run through the session codebook before encryption.
+    #define FRAME_FLAG_COMPRESSED 0x80000000u
+    //What the body is, one of the FRAME_KIND values.
+    #define FRAME_KIND_SHIFT 29
+    #define FRAME_KIND_MASK (3u<<FRAME_KIND_SHIFT)
+    #define FRAME_KIND(flags) (((flags)&FRAME_KIND_MASK)>>FRAME_KIND_SHIFT)
+    #define FRAME_FLAG_KIND(kind) ((uint32_t)(kind)<<FRAME_KIND_SHIFT)
+    #define FRAME_KIND_MESSAGE 0
+    //le64 file size followed by the file name.
+    #define FRAME_KIND_FILE_BEGIN 1
+    #define FRAME_KIND_FILE_DATA 2
+    //Empty body.
+    #define FRAME_KIND_FILE_END 3
+    #define FRAME_READER_DEFAULT_SIZE (64<<10)
+    #define FRAME_DEFAULT_MAX_SIZE (1<<20)
+    //Compact frames start with a varint of the size shifted left by five,
+    //the low bits being the kind, FRAME_COMPACT_COMPRESSED and one of the
+    //head modes.
+    //FRAME_HEAD_NEXT means the body continues the pad right where the
+    //previous frame ended, FRAME_HEAD_SKIP is followed by a varint of how
+    //far past that it starts and FRAME_HEAD_ABSOLUTE by the head itself.
+    #define FRAME_COMPACT_COMPRESSED 0x4
+    #define FRAME_HEAD_NEXT 0
+    #define FRAME_HEAD_SKIP 1
+    #define FRAME_HEAD_ABSOLUTE 2
+    #define FRAME_HEAD_MODE_MASK 0x3
+    #define FRAME_COMPACT_KIND_SHIFT 3
+    #define FRAME_COMPACT_SIZE_SHIFT 5
+    //Longest header of either layout, a 5 byte and a 10 byte varint.
+    #define FRAME_MAX_HEADER_SIZE 15
+
+    struct node;
+    //Writes a fixed size header.
+    void frame_write_header(
+        uint8_t* header,
+        uint32_t size,
+        uint64_t head,
+        uint32_t flags
+    );
+    //Header layout of one direction of a connection. Compact headers only
+    //carry the head when the pad doesn't simply continue, so both ends
+    //track where the previous frame ended.
+    struct frame_format
+    {
+        unsigned compact;
+        //Set once a frame has been through, until then heads are absolute.
+        unsigned synced;
+        uint64_t next_head;
+    };
+    void frame_format_init(struct frame_format* f, unsigned compact);
+    //Writes the header of the next frame, which must hold
+    //FRAME_MAX_HEADER_SIZE bytes. Returns the size of the header.
+    size_t frame_format_header(
+        struct frame_format* f,
+        uint8_t* header,
+        uint32_t size,
+        uint64_t head,
+        uint32_t flags
+    );
+
+    enum frame_event_type
+    {
+        FRAME_HEADER,
+        FRAME_DATA,
+        FRAME_END,
+        //The stream can't be parsed any further.
+        FRAME_ERROR
+    };
+    struct frame_event
+    {
+        enum frame_event_type type;
+        //Set by FRAME_HEADER.
+        uint32_t size;
+        uint64_t head;
+        uint32_t flags;
+        //Set by FRAME_DATA. Points into the ring buffer and stays valid
+        //until the next frame_reader_fill() or frame_reader_space().
+        const uint8_t* data;
+        size_t data_size;
+    };
+    //Splits a byte stream into frames. Incoming data is received into a
+    //ring buffer, so any number of frames can come from a single recv()
+    //and nothing is allocated per frame.
+    struct frame_reader
+    {
+        uint8_t* ring;
+        //Power of two
+        size_t capacity;
+        //Total bytes read out of and written into the ring, the positions
+        //in it are these modulo capacity.
+        uint64_t read, write;
+        struct frame_format format;
+        unsigned in_body;
+        //Body bytes of the current frame not yet handed out.
+        size_t body_left;
+        //Larger frames are an error, caught before their bodies are read.
+        size_t max_size;
+    };
+    //capacity is rounded up to a power of two.
+    void frame_reader_init(struct frame_reader* r, size_t capacity);
+    void frame_reader_free(struct frame_reader* r);
+    //Drops any partially received frame and goes back to fixed size
+    //headers.
+    void frame_reader_reset(struct frame_reader* r);
+    //Switches to compact headers, before any of them have been received.
+    void frame_reader_set_compact(struct frame_reader* r, unsigned compact);
+    void frame_reader_set_max_size(struct frame_reader* r, size_t max_size);
+    //Receives as much as fits in the ring with a single call. Returns the
+    //number of bytes received. Does not block. Check node_error() when this
+    //returns 0.
+    size_t frame_reader_fill(struct frame_reader* r, struct node* remote);
+    //For receiving some other way: points iov at the free space in the
+    //ring and returns the number of segments, 0 if the ring is full. Call
+    //frame_reader_commit() once the bytes are in.
+    size_t frame_reader_space(struct frame_reader* r, struct iovec iov[2]);
+    void frame_reader_commit(struct frame_reader* r, size_t received);
+    //Returns non-zero and fills in e if there is a new event. Every header
+    //is followed by data events covering its body and an end event.
+    unsigned frame_reader_next(struct frame_reader* r, struct frame_event* e);
+#endif
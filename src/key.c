@@ -24,127 +24,621 @@ SOFTWARE.
 #define _DEFAULT_SOURCE
 #include "key.h"
 #include "block.h"
+#include "xor.h"
+#include "range.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <endian.h>
+#include <time.h>
 #define KEY_MAGIC "OTPCHAT0"
 #define KEY_HEAD_OFFSET 8
 #define KEY_ID_OFFSET 16
-#define KEY_DATA_OFFSET 32
-#define BUFFER_SIZE 4096
+#define KEY_DATA_OFFSET KEY_HEADER_SIZE
+//How much of the pad is requested to be read in ahead of a non-sequential
+//head.
+#define KEY_READAHEAD_SIZE (1<<20)
+//A record is the little-endian range of pad used by a message followed by
+//a check value, so that a torn write can be told apart from a real record.
+#define KEY_JOURNAL_RECORD_SIZE 24
+#define KEY_USED_MAGIC "OTPCHATU"
+#define KEY_USED_HEADER_SIZE 16
+//Once the journal has this many records, the head is written to the key
+//header and the journal is started over.
+#define KEY_JOURNAL_MAX_RECORDS 4096
 
-unsigned key_open(struct key* k, const char* path)
+static uint64_t key_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000ull+ts.tv_nsec/1000000;
+}
+//Makes the head in the mapped header durable.
+static unsigned key_write_header_head(struct key* k)
+{
+    uint64_t head_le=htole64(k->head);
+    memcpy(k->map+KEY_HEAD_OFFSET, &head_le, sizeof(head_le));
+    return msync(k->map, KEY_DATA_OFFSET, MS_SYNC)!=0;
+}
+static char* key_path_with_suffix(const char* path, const char* suffix)
+{
+    size_t path_len=strlen(path);
+    size_t suffix_len=strlen(suffix);
+    char* result=(char*)malloc(path_len+suffix_len+1);
+    memcpy(result, path, path_len);
+    memcpy(result+path_len, suffix, suffix_len+1);
+    return result;
+}
+static uint64_t key_journal_check(uint64_t begin, uint64_t end)
+{
+    return ~(begin^(end<<32|end>>32));
+}
+//Loads the set of used pad ranges. Keys that never had one are assumed to
+//have used everything before their head.
+static unsigned key_used_load(struct key* k)
+{
+    range_set_init(&k->used);
+    int fd=open(k->used_path, O_RDONLY);
+    if(fd==-1)
+    {
+        range_set_add(&k->used, 0, k->head);
+        return 0;
+    }
+    uint8_t header[KEY_USED_HEADER_SIZE];
+    uint64_t count=0;
+    unsigned fail=pread(fd, header, sizeof(header), 0)!=sizeof(header)||
+        memcmp(header, KEY_USED_MAGIC, strlen(KEY_USED_MAGIC))!=0;
+    if(!fail)
+    {
+        memcpy(&count, header+8, sizeof(count));
+        count=le64toh(count);
+    }
+    for(uint64_t i=0;!fail&&i<count;++i)
+    {
+        uint64_t r[2];
+        fail=pread(
+            fd,
+            r,
+            sizeof(r),
+            KEY_USED_HEADER_SIZE+i*sizeof(r)
+        )!=sizeof(r);
+        range_set_add(&k->used, le64toh(r[0]), le64toh(r[1]));
+    }
+    close(fd);
+    return fail;
+}
+//Writes the set of used ranges next to the key, replacing the old file
+//atomically.
+static unsigned key_used_save(struct key* k)
 {
-    k->stream=fopen(path, "rb+");
-    if(k->stream==NULL)
+    size_t size=KEY_USED_HEADER_SIZE+k->used.size*2*sizeof(uint64_t);
+    uint8_t* data=(uint8_t*)malloc(size);
+    uint64_t count=htole64(k->used.size);
+    memcpy(data, KEY_USED_MAGIC, strlen(KEY_USED_MAGIC));
+    memcpy(data+8, &count, sizeof(count));
+    for(size_t i=0;i<k->used.size;++i)
+    {
+        uint64_t r[2]={
+            htole64(k->used.ranges[i].begin),
+            htole64(k->used.ranges[i].end)
+        };
+        memcpy(data+KEY_USED_HEADER_SIZE+i*sizeof(r), r, sizeof(r));
+    }
+    char* tmp_path=key_path_with_suffix(k->used_path, ".tmp");
+    unsigned fail=1;
+    int fd=open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if(fd!=-1)
+    {
+        fail=write(fd, data, size)!=(ssize_t)size;
+        fail|=fsync(fd)!=0;
+        fail|=close(fd)!=0;
+        fail=fail||rename(tmp_path, k->used_path)!=0;
+        if(fail)
+        {
+            unlink(tmp_path);
+        }
+    }
+    free(tmp_path);
+    free(data);
+    return fail;
+}
+//Reads the journal, adding the ranges it recorded to the used set and
+//moving the head to the furthest point among them.
+static unsigned key_journal_open(struct key* k, const char* path)
+{
+    k->journal_path=key_path_with_suffix(path, KEY_JOURNAL_SUFFIX);
+    k->used_path=key_path_with_suffix(path, KEY_USED_SUFFIX);
+    k->journal_records=0;
+    k->journal_pending=0;
+    k->journal_pending_since_ms=0;
+    k->sync_failed=0;
+    if(key_used_load(k))
     {
         return 1;
     }
-
-    char magic_check[8]={0};
-    size_t sz=2;
-    if(fread(magic_check, 1, 8, k->stream)!=8||
-       strncmp(magic_check, KEY_MAGIC, 8)!=0||
-       (sz=fread(&k->head, 1, sizeof(k->head), k->stream))!=sizeof(k->head)||
-       fread(&k->id, 1, sizeof(k->id), k->stream)!=sizeof(k->id))
-    {
-        fclose(k->stream);
+    k->journal_fd=open(k->journal_path, O_RDWR|O_CREAT|O_APPEND, 0600);
+    if(k->journal_fd==-1)
+    {
         return 1;
     }
-    k->head=le64toh(k->head);
-    //Get key size
-    fseek(k->stream, 0, SEEK_END);
-    k->size=ftell(k->stream)-KEY_DATA_OFFSET;
-    if(fseek(k->stream, k->head+KEY_DATA_OFFSET, SEEK_SET)!=0)
+    uint8_t record[KEY_JOURNAL_RECORD_SIZE];
+    while(
+        pread(
+            k->journal_fd,
+            record,
+            sizeof(record),
+            k->journal_records*sizeof(record)
+        )==sizeof(record)
+    ){
+        uint64_t r[3];
+        memcpy(r, record, sizeof(r));
+        uint64_t begin=le64toh(r[0]);
+        uint64_t end=le64toh(r[1]);
+        if(le64toh(r[2])!=key_journal_check(begin, end))
+        {//Torn tail from a crash, everything before it is intact.
+            break;
+        }
+        range_set_add(&k->used, begin, end);
+        if(end>k->head)
+        {
+            k->head=end;
+        }
+        k->journal_records++;
+    }
+    //Drop whatever couldn't be parsed so that appends line up again.
+    if(ftruncate(k->journal_fd, k->journal_records*sizeof(record))==-1)
     {
-        fclose(k->stream);
         return 1;
     }
+    k->journal_head=k->head;
+    k->synced_head=k->head;
     return 0;
 }
-unsigned key_create(struct key* k, const char* path, size_t sz)
+//Writes the head to the header and the used ranges to their own file, then
+//empties the journal.
+static void key_journal_compact(struct key* k)
 {
-    k->stream=fopen(path, "wb+");
-    if(k->stream==NULL)
+    if(key_write_header_head(k)||fsync(k->fd)==-1||key_used_save(k))
+    {
+        return;
+    }
+    if(ftruncate(k->journal_fd, 0)==0)
     {
+        fdatasync(k->journal_fd);
+        k->journal_records=0;
+        k->journal_pending=0;
+    }
+    //The header and the used ranges cover everything claimed so far.
+    if(k->head>k->journal_head)
+    {
+        k->journal_head=k->head;
+    }
+    k->synced_head=k->journal_head;
+}
+//Marks [begin, end) used and logs it. The record survives the process
+//crashing right away, and a power loss once key_sync() has run.
+static void key_commit(struct key* k, uint64_t begin, uint64_t end)
+{
+    range_set_add(&k->used, begin, end);
+    if(k->journal_fd==-1)
+    {
+        return;
+    }
+    uint64_t r[3]={
+        htole64(begin),
+        htole64(end),
+        htole64(key_journal_check(begin, end))
+    };
+    uint8_t record[KEY_JOURNAL_RECORD_SIZE];
+    memcpy(record, r, sizeof(record));
+    if(write(k->journal_fd, record, sizeof(record))!=sizeof(record))
+    {//Fall back to a synchronous update.
+        key_journal_compact(k);
+        return;
+    }
+    k->journal_records++;
+    if(end>k->journal_head)
+    {
+        k->journal_head=end;
+    }
+    if(k->journal_pending++==0)
+    {
+        k->journal_pending_since_ms=key_time_ms();
+    }
+    if(k->journal_records>=KEY_JOURNAL_MAX_RECORDS)
+    {
+        key_journal_compact(k);
+    }
+    else if(
+        (k->journal_pending>=k->sync_messages&&!k->sync_failed)||
+        key_sync_timeout(k)==0
+    ){
+        key_sync(k);
+    }
+}
+void key_set_sync_policy(
+    struct key* k,
+    unsigned sync_messages,
+    unsigned sync_ms
+){
+    k->sync_messages=sync_messages;
+    k->sync_ms=sync_ms;
+}
+int key_sync_timeout(struct key* k)
+{
+    if(k->journal_pending==0)
+    {
+        return -1;
+    }
+    uint64_t elapsed=key_time_ms()-k->journal_pending_since_ms;
+    return elapsed>=k->sync_ms?0:(int)(k->sync_ms-elapsed);
+}
+unsigned key_sync(struct key* k)
+{
+    if(k->journal_pending==0)
+    {
+        return 0;
+    }
+    if(fdatasync(k->journal_fd)==-1)
+    {//Back off instead of spinning on a broken disk.
+        k->journal_pending_since_ms=key_time_ms();
+        k->sync_failed=1;
         return 1;
     }
-    //Write magic sequence
-    fwrite(KEY_MAGIC, 1, strlen(KEY_MAGIC), k->stream);
-    //Write head address
-    k->head=0;
-    fwrite(&k->head, sizeof(k->head), 1, k->stream);
+    k->journal_pending=0;
+    k->sync_failed=0;
+    k->synced_head=k->journal_head;
+    return 0;
+}
 
-    int urandom=open("/dev/urandom", O_RDONLY);
-    //Generate random id
-    (void)read(urandom, &k->id, sizeof(k->id));
-    //Write id
-    fwrite(&k->id, 1, sizeof(k->id), k->stream);
+static void key_readahead(struct key* k)
+{
+    if(k->head>=k->size)
+    {
+        return;
+    }
+    //madvise() wants a page-aligned address
+    size_t page_size=sysconf(_SC_PAGESIZE);
+    size_t begin=(k->head+KEY_DATA_OFFSET)&~(page_size-1);
+    size_t end=k->head+KEY_DATA_OFFSET+KEY_READAHEAD_SIZE;
+    if(end>k->size+KEY_DATA_OFFSET)
+    {
+        end=k->size+KEY_DATA_OFFSET;
+    }
+    madvise(k->map+begin, end-begin, MADV_WILLNEED);
+}
+unsigned key_open(struct key* k, const char* path)
+{
+    return key_open_with_state(k, path, path);
+}
+unsigned key_open_with_state(
+    struct key* k,
+    const char* path,
+    const char* state_path
+){
+    k->map=NULL;
+    k->journal_fd=-1;
+    k->journal_path=NULL;
+    k->used_path=NULL;
+    range_set_init(&k->used);
+    k->sync_messages=KEY_DEFAULT_SYNC_MESSAGES;
+    k->sync_ms=KEY_DEFAULT_SYNC_MS;
+    k->fd=open(path, O_RDWR);
+    if(k->fd==-1)
+    {
+        return 1;
+    }
 
-    //Write key data
-    uint8_t* buffer=(uint8_t*)malloc(BUFFER_SIZE);
-    size_t written=0;
-    while(written<sz)
-    {
-        size_t bsize=sz-written;
-        bsize=BUFFER_SIZE<bsize?BUFFER_SIZE:bsize;
-        bsize=read(urandom, buffer, bsize);
-        if(bsize<=0||fwrite(buffer, 1, bsize, k->stream)!=bsize)
-        {
-            free(buffer);
-            fclose(k->stream);
-            return 1;
-        }
-        written+=bsize;
+    struct stat st;
+    if(fstat(k->fd, &st)==-1||st.st_size<KEY_DATA_OFFSET)
+    {
+        goto fail;
+    }
+    k->map=(uint8_t*)mmap(
+        NULL,
+        st.st_size,
+        PROT_READ|PROT_WRITE,
+        MAP_SHARED,
+        k->fd,
+        0
+    );
+    if(k->map==MAP_FAILED)
+    {
+        k->map=NULL;
+        goto fail;
     }
-    free(buffer);
-    fseek(k->stream, KEY_DATA_OFFSET, SEEK_SET);
-    k->size=sz;
+    k->size=st.st_size-KEY_DATA_OFFSET;
+    if(key_parse_header(k->map, k->id, &k->head))
+    {
+        goto fail;
+    }
+    if(key_journal_open(k, state_path))
+    {
+        goto fail;
+    }
+    //Pad bytes are consumed front to back, so let the kernel read ahead
+    //aggressively and drop pages behind the head.
+    madvise(k->map, st.st_size, MADV_SEQUENTIAL);
+    key_readahead(k);
     return 0;
+fail:
+    //Don't go through key_close(), the header can't be trusted yet.
+    if(k->journal_fd!=-1)
+    {
+        close(k->journal_fd);
+        k->journal_fd=-1;
+    }
+    free(k->journal_path);
+    k->journal_path=NULL;
+    free(k->used_path);
+    k->used_path=NULL;
+    range_set_free(&k->used);
+    if(k->map!=NULL)
+    {
+        munmap(k->map, st.st_size);
+        k->map=NULL;
+    }
+    close(k->fd);
+    k->fd=-1;
+    return 1;
+}
+unsigned key_create(
+    struct key* k,
+    const char* path,
+    size_t sz,
+    const struct keygen_options* options
+){
+    int fd=open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+    if(fd==-1)
+    {
+        return 1;
+    }
+    uint8_t header[KEY_DATA_OFFSET];
+    //Write magic sequence
+    memcpy(header, KEY_MAGIC, strlen(KEY_MAGIC));
+    //Write head address
+    uint64_t head=0;
+    memcpy(header+KEY_HEAD_OFFSET, &head, sizeof(head));
+    //Generate random id
+    if(keygen_random(header+KEY_ID_OFFSET, sizeof(k->id))||
+       pwrite(fd, header, sizeof(header), 0)!=sizeof(header)||
+       keygen_fill(fd, KEY_DATA_OFFSET, sz, options)||
+       fsync(fd)==-1)
+    {
+        close(fd);
+        return 1;
+    }
+    if(close(fd)!=0)
+    {
+        return 1;
+    }
+    return key_open(k, path);
 }
 void key_close(struct key* k)
 {
-    if(k->stream!=NULL)
+    if(k->map!=NULL)
     {
-        //Save head index
-        size_t head_le=htole64(k->head);
-        fseek(k->stream, KEY_HEAD_OFFSET, SEEK_SET);
-        fwrite(&head_le, sizeof(&head_le), 1, k->stream);
-        //Close stream
-        fclose(k->stream);
-        k->stream=NULL;
+        //Save head index and used ranges. The journal is only removed once
+        //they are known to be on disk. A key nothing was ever used from
+        //gets no file of ranges.
+        if(key_write_header_head(k)==0&&fsync(k->fd)==0&&
+           k->journal_path!=NULL&&(k->used.size==0||key_used_save(k)==0))
+        {
+            unlink(k->journal_path);
+        }
+        munmap(k->map, k->size+KEY_DATA_OFFSET);
+        k->map=NULL;
     }
+    if(k->fd!=-1)
+    {
+        close(k->fd);
+        k->fd=-1;
+    }
+    if(k->journal_fd!=-1)
+    {
+        close(k->journal_fd);
+        k->journal_fd=-1;
+    }
+    free(k->journal_path);
+    k->journal_path=NULL;
+    free(k->used_path);
+    k->used_path=NULL;
+    range_set_free(&k->used);
 }
 void key_seek(struct key* k, uint64_t new_head)
 {
-    fseek(k->stream, new_head+KEY_DATA_OFFSET, SEEK_SET);
+    if(new_head==k->head)
+    {//Sequential use, the kernel is already reading ahead.
+        return;
+    }
     k->head=new_head;
+    key_readahead(k);
+}
+uint8_t* key_pad(struct key* k)
+{
+    return k->map+KEY_DATA_OFFSET;
+}
+unsigned key_parse_header(
+    const uint8_t* header,
+    uint8_t* id,
+    uint64_t* head
+){
+    if(memcmp(header, KEY_MAGIC, strlen(KEY_MAGIC))!=0)
+    {
+        return 1;
+    }
+    memcpy(head, header+KEY_HEAD_OFFSET, sizeof(*head));
+    *head=le64toh(*head);
+    memcpy(id, header+KEY_ID_OFFSET, 16);
+    return 0;
+}
+//The table is grown before it's more than this full
+#define KEY_INDEX_MAX_LOAD_PERCENT 50
+#define KEY_INDEX_MIN_CAPACITY 16
+
+#define KEY_ROTL(x, b) (((x)<<(b))|((x)>>(64-(b))))
+static void key_sip_round(uint64_t* v)
+{
+    v[0]+=v[1]; v[1]=KEY_ROTL(v[1], 13); v[1]^=v[0]; v[0]=KEY_ROTL(v[0], 32);
+    v[2]+=v[3]; v[3]=KEY_ROTL(v[3], 16); v[3]^=v[2];
+    v[0]+=v[3]; v[3]=KEY_ROTL(v[3], 21); v[3]^=v[0];
+    v[2]+=v[1]; v[1]=KEY_ROTL(v[1], 17); v[1]^=v[2]; v[2]=KEY_ROTL(v[2], 32);
+}
+//SipHash-2-4 of the 16 byte id.
+static size_t key_index_hash(const struct key_store* store, const uint8_t* id)
+{
+    //Ids are random, but they come from the network too. Without knowing
+    //the key, peers can't pick ids that pile up in one bucket.
+    const uint64_t* k=store->index_key;
+    uint64_t v[4]={
+        k[0]^0x736f6d6570736575ull,
+        k[1]^0x646f72616e646f6dull,
+        k[0]^0x6c7967656e657261ull,
+        k[1]^0x7465646279746573ull
+    };
+    uint64_t m[3];
+    memcpy(m, id, 16);
+    m[0]=le64toh(m[0]);
+    m[1]=le64toh(m[1]);
+    //The last block only holds the length.
+    m[2]=(uint64_t)16<<56;
+    for(unsigned i=0;i<3;++i)
+    {
+        v[3]^=m[i];
+        key_sip_round(v);
+        key_sip_round(v);
+        v[0]^=m[i];
+    }
+    v[2]^=0xff;
+    for(unsigned i=0;i<4;++i)
+    {
+        key_sip_round(v);
+    }
+    return (size_t)(v[0]^v[1]^v[2]^v[3]);
+}
+//Returns the slot holding id, or the empty slot where it would go.
+static size_t key_index_slot(const struct key_store* store, const uint8_t* id)
+{
+    size_t mask=store->index_capacity-1;
+    size_t slot=key_index_hash(store, id)&mask;
+    while(store->index[slot]!=0)
+    {
+        const struct key* k=&store->remotes[store->index[slot]-1]->key;
+        if(memcmp(k->id, id, sizeof(k->id))==0)
+        {
+            break;
+        }
+        slot=(slot+1)&mask;
+    }
+    return slot;
+}
+static void key_index_grow(struct key_store* store)
+{
+    size_t* old_index=store->index;
+    store->index_capacity=store->index_capacity==0?
+        KEY_INDEX_MIN_CAPACITY:store->index_capacity*2;
+    store->index=(size_t*)calloc(store->index_capacity, sizeof(size_t));
+    for(size_t i=0;i<store->remotes_size;++i)
+    {
+        store->index[key_index_slot(store, store->remotes[i]->key.id)]=i+1;
+    }
+    free(old_index);
+}
+//Removes the given slot, shifting back entries that would otherwise become
+//unreachable.
+static void key_index_remove(struct key_store* store, size_t slot)
+{
+    size_t mask=store->index_capacity-1;
+    size_t hole=slot;
+    store->index[hole]=0;
+    for(size_t i=(hole+1)&mask;store->index[i]!=0;i=(i+1)&mask)
+    {
+        const uint8_t* id=store->remotes[store->index[i]-1]->key.id;
+        size_t home=key_index_hash(store, id)&mask;
+        //The entry can fill the hole unless its home lies cyclically in
+        //(hole, i].
+        unsigned stays=hole<i?home>hole&&home<=i:home>hole||home<=i;
+        if(!stays)
+        {
+            store->index[hole]=store->index[i];
+            store->index[i]=0;
+            hole=i;
+        }
+    }
 }
 void key_store_init(struct key_store* store)
 {
-    store->local.stream=NULL;
+    store->local.fd=-1;
+    store->local.map=NULL;
+    store->local.journal_fd=-1;
+    store->local.journal_path=NULL;
+    store->local.used_path=NULL;
+    range_set_init(&store->local.used);
+    store->local_refs=0;
+    store->locals=NULL;
+    store->locals_size=0;
+    store->locals_capacity=0;
     store->remotes=NULL;
     store->remotes_size=0;
+    store->remotes_capacity=0;
+    store->index=NULL;
+    store->index_capacity=0;
+    if(keygen_random(store->index_key, sizeof(store->index_key)))
+    {
+        store->index_key[0]=(uint64_t)time(NULL);
+        store->index_key[1]=(uint64_t)getpid();
+    }
+    store->sync_messages=KEY_DEFAULT_SYNC_MESSAGES;
+    store->sync_ms=KEY_DEFAULT_SYNC_MS;
+    store->dir.path=NULL;
+    store->dir.map=NULL;
+    store->cache_size=KEY_STORE_DEFAULT_CACHE_SIZE;
+    store->clock=0;
 }
 void key_store_close(struct key_store* store)
 {
     key_close(&store->local);
+    for(size_t i=0;i<store->locals_size;++i)
+    {
+        key_close(&store->locals[i]->key);
+        free(store->locals[i]);
+    }
+    free(store->locals);
+    store->locals=NULL;
+    store->locals_size=0;
+    store->locals_capacity=0;
     if(store->remotes!=NULL)
     {
         size_t i=0;
         for(i=0;i<store->remotes_size;++i)
         {
-            key_close(store->remotes+i);
+            key_close(&store->remotes[i]->key);
+            free(store->remotes[i]);
         }
         free(store->remotes);
         store->remotes=NULL;
+        store->remotes_size=0;
+        store->remotes_capacity=0;
     }
+    free(store->index);
+    store->index=NULL;
+    store->index_capacity=0;
+    key_dir_close(&store->dir);
+}
+unsigned key_store_open_dir(
+    struct key_store* store,
+    const char* dir_path,
+    size_t cache_size
+){
+    key_dir_close(&store->dir);
+    store->cache_size=cache_size;
+    return key_dir_open(&store->dir, dir_path);
 }
 unsigned key_store_open_local(
     struct key_store* store,
@@ -155,6 +649,11 @@ unsigned key_store_open_local(
     {
         return 1;
     }
+    key_set_sync_policy(
+        &store->local,
+        store->sync_messages,
+        store->sync_ms
+    );
     return 0;
 }
 unsigned key_store_open_remote(
@@ -166,66 +665,349 @@ unsigned key_store_open_remote(
     {
         return 1;
     }
-    store->remotes=(struct key*)realloc(
-        store->remotes,
-        sizeof(struct key)*++store->remotes_size
-    );
-    memcpy(&store->remotes[store->remotes_size-1], &remote, sizeof(struct key));
+    if(key_store_add_remote(store, &remote))
+    {
+        key_close(&remote);
+        return 1;
+    }
     return 0;
 }
+static struct key_store_entry* key_store_insert(
+    struct key_store* store,
+    const struct key* remote
+){
+    if((store->remotes_size+1)*100>
+       store->index_capacity*KEY_INDEX_MAX_LOAD_PERCENT)
+    {
+        key_index_grow(store);
+    }
+    size_t slot=key_index_slot(store, remote->id);
+    if(store->index[slot]!=0)
+    {
+        return NULL;
+    }
+    if(store->remotes_size==store->remotes_capacity)
+    {
+        store->remotes_capacity=store->remotes_capacity==0?
+            KEY_INDEX_MIN_CAPACITY:store->remotes_capacity*2;
+        store->remotes=(struct key_store_entry**)realloc(
+            store->remotes,
+            sizeof(struct key_store_entry*)*store->remotes_capacity
+        );
+    }
+    struct key_store_entry* e=
+        (struct key_store_entry*)malloc(sizeof(struct key_store_entry));
+    memcpy(&e->key, remote, sizeof(struct key));
+    e->refs=0;
+    e->from_dir=0;
+    e->last_used=store->clock;
+    key_set_sync_policy(&e->key, store->sync_messages, store->sync_ms);
+    store->remotes[store->remotes_size++]=e;
+    store->index[slot]=store->remotes_size;
+    return e;
+}
+unsigned key_store_add_remote(
+    struct key_store* store,
+    const struct key* remote
+){
+    return key_store_insert(store, remote)==NULL;
+}
+static struct key_store_entry* key_store_open_from_dir(
+    struct key_store* store,
+    const uint8_t* id
+){
+    char* path=key_dir_find(&store->dir, id);
+    if(path==NULL)
+    {
+        return NULL;
+    }
+    char* state_path=key_dir_state_path(path);
+    struct key remote;
+    unsigned fail=state_path==NULL||
+        key_open_with_state(&remote, path, state_path);
+    free(state_path);
+    free(path);
+    if(fail)
+    {
+        return NULL;
+    }
+    struct key_store_entry* e=NULL;
+    //The index can be out of date if the file was replaced since.
+    if(memcmp(remote.id, id, sizeof(remote.id))!=0||
+       (e=key_store_insert(store, &remote))==NULL)
+    {
+        key_close(&remote);
+        return NULL;
+    }
+    e->from_dir=1;
+    return e;
+}
 struct key* key_store_find(struct key_store* store, uint8_t* id)
 {
-    size_t i=0;
-    for(i=0;i<store->remotes_size;++i)
+    struct key_store_entry* e=NULL;
+    if(store->index_capacity!=0)
     {
-        if( memcmp(
-                store->remotes[i].id,
-                id,
-                sizeof(store->remotes[i].id)
-            )==0
-        ){
-            return store->remotes+i;
+        size_t slot=key_index_slot(store, id);
+        if(store->index[slot]!=0)
+        {
+            e=store->remotes[store->index[slot]-1];
         }
     }
-    return NULL;
+    if(e==NULL)
+    {
+        e=key_store_open_from_dir(store, id);
+        if(e==NULL)
+        {
+            return NULL;
+        }
+    }
+    e->refs++;
+    e->last_used=++store->clock;
+    return &e->key;
 }
-
-static unsigned key_get_block(
+void key_store_release(struct key_store* store, struct key* k)
+{
+    (void)store;
+    struct key_store_entry* e=(struct key_store_entry*)k;
+    if(e->refs>0)
+    {
+        e->refs--;
+    }
+}
+//Returns the local key of the file at path, opening it unless it's open
+//already, or NULL on failure.
+static struct key* key_store_open_paired(
+    struct key_store* store,
+    const char* path
+){
+    //The id is read first, a copy of a key that is open already must share
+    //its head and used ranges.
+    uint8_t header[KEY_HEADER_SIZE];
+    uint8_t id[16];
+    uint64_t head;
+    int fd=open(path, O_RDONLY);
+    if(fd==-1)
+    {
+        return NULL;
+    }
+    unsigned fail=pread(fd, header, sizeof(header), 0)!=sizeof(header)||
+        key_parse_header(header, id, &head);
+    close(fd);
+    if(fail)
+    {
+        return NULL;
+    }
+    if(memcmp(id, store->local.id, sizeof(id))==0)
+    {
+        return &store->local;
+    }
+    for(size_t i=0;i<store->locals_size;++i)
+    {
+        if(memcmp(id, store->locals[i]->key.id, sizeof(id))==0)
+        {
+            return &store->locals[i]->key;
+        }
+    }
+    //Pad that's also received with would be used twice.
+    char* remote_path=key_dir_find(&store->dir, id);
+    unsigned received=remote_path!=NULL||
+        (store->index_capacity!=0&&store->index[key_index_slot(store, id)]!=0);
+    free(remote_path);
+    if(received)
+    {
+        return NULL;
+    }
+    char* state_path=key_dir_state_path(path);
+    struct key local;
+    fail=state_path==NULL||key_open_with_state(&local, path, state_path);
+    free(state_path);
+    if(fail)
+    {
+        return NULL;
+    }
+    if(memcmp(local.id, id, sizeof(id))!=0)
+    {//Replaced in the meantime
+        key_close(&local);
+        return NULL;
+    }
+    if(store->locals_size==store->locals_capacity)
+    {
+        store->locals_capacity=store->locals_capacity==0?
+            4:store->locals_capacity*2;
+        store->locals=(struct key_store_entry**)realloc(
+            store->locals,
+            sizeof(struct key_store_entry*)*store->locals_capacity
+        );
+    }
+    struct key_store_entry* e=
+        (struct key_store_entry*)malloc(sizeof(struct key_store_entry));
+    memcpy(&e->key, &local, sizeof(struct key));
+    e->refs=0;
+    e->from_dir=1;
+    e->last_used=store->clock;
+    key_set_sync_policy(&e->key, store->sync_messages, store->sync_ms);
+    store->locals[store->locals_size++]=e;
+    return &e->key;
+}
+static unsigned* key_store_local_refs(struct key_store* store, struct key* k)
+{
+    return k==&store->local?
+        &store->local_refs:&((struct key_store_entry*)k)->refs;
+}
+struct key* key_store_acquire_local(
+    struct key_store* store,
+    const struct key* remote
+){
+    struct key* k=&store->local;
+    char* path=remote!=NULL?key_dir_local_path(&store->dir, remote->id):NULL;
+    if(path!=NULL)
+    {
+        k=key_store_open_paired(store, path);
+        free(path);
+    }
+    if(k==NULL||*key_store_local_refs(store, k)!=0||
+       (remote!=NULL&&memcmp(k->id, remote->id, sizeof(k->id))==0))
+    {
+        return NULL;
+    }
+    (*key_store_local_refs(store, k))++;
+    return k;
+}
+void key_store_release_local(struct key_store* store, struct key* k)
+{
+    unsigned* refs=key_store_local_refs(store, k);
+    if(*refs>0)
+    {
+        (*refs)--;
+    }
+}
+void key_store_trim(struct key_store* store)
+{
+    for(size_t i=0;i<store->locals_size;)
+    {
+        struct key_store_entry* e=store->locals[i];
+        if(e->refs!=0)
+        {
+            ++i;
+            continue;
+        }
+        key_close(&e->key);
+        free(e);
+        store->locals[i]=store->locals[--store->locals_size];
+    }
+    size_t open=0;
+    for(size_t i=0;i<store->remotes_size;++i)
+    {
+        open+=store->remotes[i]->from_dir;
+    }
+    while(open>store->cache_size)
+    {
+        size_t lru=store->remotes_size;
+        for(size_t i=0;i<store->remotes_size;++i)
+        {
+            struct key_store_entry* e=store->remotes[i];
+            if(e->from_dir&&e->refs==0&&
+               (lru==store->remotes_size||
+                e->last_used<store->remotes[lru]->last_used))
+            {
+                lru=i;
+            }
+        }
+        if(lru==store->remotes_size)
+        {//Everything left is in use
+            break;
+        }
+        struct key_store_entry* e=store->remotes[lru];
+        key_index_remove(store, key_index_slot(store, e->key.id));
+        key_close(&e->key);
+        free(e);
+        //Fill the gap with the last entry
+        store->remotes_size--;
+        if(lru!=store->remotes_size)
+        {
+            struct key_store_entry* moved=store->remotes[store->remotes_size];
+            store->remotes[lru]=moved;
+            store->index[key_index_slot(store, moved->key.id)]=lru+1;
+        }
+        open--;
+    }
+}
+void key_store_set_sync_policy(
+    struct key_store* store,
+    unsigned sync_messages,
+    unsigned sync_ms
+){
+    store->sync_messages=sync_messages;
+    store->sync_ms=sync_ms;
+    if(store->local.map!=NULL)
+    {
+        key_set_sync_policy(&store->local, sync_messages, sync_ms);
+    }
+    for(size_t i=0;i<store->remotes_size;++i)
+    {
+        key_set_sync_policy(&store->remotes[i]->key, sync_messages, sync_ms);
+    }
+    for(size_t i=0;i<store->locals_size;++i)
+    {
+        key_set_sync_policy(&store->locals[i]->key, sync_messages, sync_ms);
+    }
+}
+//Returns the next bytes of pad in key_block and moves the head past them.
+//Returns KEY_OUT_OF_DATA or KEY_REUSED on failure.
+unsigned key_claim(
     struct key* k,
-    struct block* key_block,
-    uint64_t bytes
-){
-    key_block->size=bytes;
-    key_block->data=(uint8_t*)malloc(key_block->size);
-    size_t read_bytes=fread(key_block->data, 1, bytes, k->stream);
-    key_block->size=read_bytes;
-    k->head+=read_bytes;
-
-    if(read_bytes!=bytes)
+    uint64_t bytes,
+    const uint8_t** key_block
+){
+    if(k->head>k->size||bytes>k->size-k->head)
     {
-        return 1;
+        return KEY_OUT_OF_DATA;
+    }
+    if(range_set_overlaps(&k->used, k->head, k->head+bytes))
+    {
+        return KEY_REUSED;
+    }
+    *key_block=k->map+KEY_DATA_OFFSET+k->head;
+    if(bytes==0)
+    {//No pad is used, so there's nothing to record.
+        return 0;
     }
+    key_commit(k, k->head, k->head+bytes);
+    k->head+=bytes;
     return 0;
 }
-unsigned encrypt(
+unsigned encrypt_into(
     struct key* k,
-    struct block* message
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t size
 ){
-    struct block key_block;
-    if(key_get_block(k, &key_block, message->size))
-    {//There's not enough key data
-        return 1;
-    }
-    for(uint64_t i=0;i<message->size;++i)
+    const uint8_t* key_block=NULL;
+    unsigned err=key_claim(k, size, &key_block);
+    if(err)
     {
-        message->data[i]=key_block.data[i]^message->data[i];
+        return err;
     }
-    free_block(&key_block);
+    xor_blocks(dst, key_block, src, size);
     return 0;
 }
+unsigned decrypt_into(
+    struct key* k,
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t size
+){
+    return encrypt_into(k, dst, src, size);
+}
+unsigned encrypt(
+    struct key* k,
+    struct block* message
+){
+    return encrypt_into(k, message->data, message->data, message->size);
+}
 unsigned decrypt(
     struct key* k,
     struct block* message
 ){
-    return encrypt(k, message);
+    return decrypt_into(k, message->data, message->data, message->size);
 }
@@ -24,25 +24,128 @@ SOFTWARE.
 #ifndef OTPCHAT_KEY_H_
 #define OTPCHAT_KEY_H_
     #include <stdint.h>
-    #include <stdio.h>
+    #include <stddef.h>
+    #include "keygen.h"
+    #include "keydir.h"
+    #include "range.h"
+    #define KEY_HEADER_SIZE 32
+    #define KEY_JOURNAL_SUFFIX ".journal"
+    #define KEY_USED_SUFFIX ".used"
     //Treat this struct as read-only when accessing directly
     struct key
     {
-        FILE* stream;
+        int fd;
+        //The whole key file is mapped, header included. Pad bytes are read
+        //straight from the mapping.
+        uint8_t* map;
         size_t size;
         uint8_t id[16];
         uint64_t head;
+
+        //Pad ranges that have been used. Pad is never handed out twice.
+        struct range_set used;
+        char* used_path;
+        //Append-only log of used ranges next to the key file, see
+        //key_commit().
+        int journal_fd;
+        char* journal_path;
+        uint64_t journal_records;
+        //Records written since the last fdatasync().
+        unsigned journal_pending;
+        uint64_t journal_pending_since_ms;
+        //Set while fdatasync() keeps failing, it's retried every sync_ms.
+        unsigned sync_failed;
+        //End of the furthest range written to the journal, and of the
+        //furthest one known to be on disk. Pad beyond synced_head could be
+        //handed out again after a power loss, so it must not be wiped.
+        uint64_t journal_head;
+        uint64_t synced_head;
+        //Group commit policy
+        unsigned sync_messages;
+        unsigned sync_ms;
     };
+    #define KEY_DEFAULT_SYNC_MESSAGES 16
+    #define KEY_DEFAULT_SYNC_MS 500
     unsigned key_open(struct key* k, const char* path);
-    unsigned key_create(struct key* k, const char* path, size_t sz);
+    //Like key_open(), but the journal and used ranges are kept at
+    //state_path with their suffixes instead of next to the key.
+    unsigned key_open_with_state(
+        struct key* k,
+        const char* path,
+        const char* state_path
+    );
+    //options may be NULL for the defaults.
+    unsigned key_create(
+        struct key* k,
+        const char* path,
+        size_t sz,
+        const struct keygen_options* options
+    );
     void key_close(struct key* k);
     void key_seek(struct key* k, uint64_t new_head);
+    //The head journal is fsynced once sync_messages heads are pending or the
+    //oldest pending one is sync_ms old, whichever comes first.
+    void key_set_sync_policy(
+        struct key* k,
+        unsigned sync_messages,
+        unsigned sync_ms
+    );
+    //Milliseconds until key_sync() is due, or -1 if nothing is pending.
+    int key_sync_timeout(struct key* k);
+    //Makes every head logged so far durable. Returns non-zero on failure,
+    //in which case the next attempt is sync_ms away.
+    unsigned key_sync(struct key* k);
+    //Returns a pointer to the first pad byte in the mapping.
+    uint8_t* key_pad(struct key* k);
+    //Checks the magic of a KEY_HEADER_SIZE byte key header and extracts the
+    //id and stored head from it. Returns non-zero if it's not a key.
+    unsigned key_parse_header(
+        const uint8_t* header,
+        uint8_t* id,
+        uint64_t* head
+    );
+
+    struct key_store_entry
+    {
+        //First so that a pointer to the key is also one to the entry.
+        struct key key;
+        //Users currently holding the key, see key_store_release().
+        unsigned refs;
+        //Keys opened from the key directory may be closed again when unused.
+        unsigned from_dir;
+        uint64_t last_used;
+    };
+    #define KEY_STORE_DEFAULT_CACHE_SIZE 64
 
     struct key_store
     {
         struct key local;
-        struct key* remotes;
+        //Connections sending with local, see key_store_acquire_local().
+        unsigned local_refs;
+        //Local keys opened from the local subdirectory of the key
+        //directory, each for a single remote key.
+        struct key_store_entry** locals;
+        size_t locals_size;
+        size_t locals_capacity;
+        //Each remote key is allocated separately so that pointers to them
+        //stay valid as the store grows.
+        struct key_store_entry** remotes;
         size_t remotes_size;
+        size_t remotes_capacity;
+        //Open addressing hash table from key id to remotes index+1, 0 marks
+        //an empty slot. Its capacity is a power of two.
+        size_t* index;
+        size_t index_capacity;
+        //SipHash key of the table, random for each process.
+        uint64_t index_key[2];
+        unsigned sync_messages;
+        unsigned sync_ms;
+
+        //Optional directory that remote keys are opened from on demand.
+        struct key_dir dir;
+        //At most this many keys from the directory stay open.
+        size_t cache_size;
+        uint64_t clock;
     };
     void key_store_init(struct key_store* store);
     void key_store_close(struct key_store* store);
@@ -54,7 +157,73 @@ SOFTWARE.
         struct key_store* store,
         const char* remote_path
     );
+    //Takes ownership of an already opened key. Returns non-zero if a key
+    //with the same id is already in the store.
+    unsigned key_store_add_remote(
+        struct key_store* store,
+        const struct key* remote
+    );
+    //Returns non-zero on failure. Remote keys not found among the opened ones
+    //are looked up from the directory from now on.
+    unsigned key_store_open_dir(
+        struct key_store* store,
+        const char* dir_path,
+        size_t cache_size
+    );
+    //Returns the key with the given id, opening it from the key directory if
+    //needed, or NULL. The key stays open at least until it's passed to
+    //key_store_release().
     struct key* key_store_find(struct key_store* store, uint8_t* id);
+    void key_store_release(struct key_store* store, struct key* k);
+    //Returns the local key to send with to the owner of remote: the one
+    //kept for it in the key directory if there is one, otherwise the local
+    //key. remote may be NULL for the latter. Whoever holds a copy of a pad
+    //can read everything sent with it, so a key is only handed to one
+    //connection at a time and NULL is returned while it's taken, or if the
+    //key can't be opened. Give it back with key_store_release_local().
+    struct key* key_store_acquire_local(
+        struct key_store* store,
+        const struct key* remote
+    );
+    void key_store_release_local(struct key_store* store, struct key* k);
+    //Closes the least recently used keys from the directory that aren't held
+    //by anyone, until at most cache_size of them are open. Local keys from
+    //the directory are closed as soon as they aren't held.
+    void key_store_trim(struct key_store* store);
+    //Sets the sync policy of every key, including those opened later.
+    void key_store_set_sync_policy(
+        struct key_store* store,
+        unsigned sync_messages,
+        unsigned sync_ms
+    );
+
+    #define KEY_OUT_OF_DATA 1
+    #define KEY_REUSED 2
+    //XORs size bytes of pad from the head of k with src and stores the result
+    //in dst. dst may equal src. Returns KEY_OUT_OF_DATA if there isn't enough
+    //key data left, or KEY_REUSED if any of the pad has been used before. In
+    //either case dst is left untouched.
+    unsigned encrypt_into(
+        struct key* k,
+        uint8_t* dst,
+        const uint8_t* src,
+        size_t size
+    );
+    unsigned decrypt_into(
+        struct key* k,
+        uint8_t* dst,
+        const uint8_t* src,
+        size_t size
+    );
+
+    //Marks bytes of pad from the head of k used and points key_block at them,
+    //for messages that are decrypted piece by piece as they arrive. Claiming
+    //nothing records nothing. Fails like encrypt_into().
+    unsigned key_claim(
+        struct key* k,
+        uint64_t bytes,
+        const uint8_t** key_block
+    );
 
     struct block;
     unsigned encrypt(
@@ -0,0 +1,444 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "keydir.h"
+#include "key.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define KEY_DIR_INDEX_MAGIC "OTPCHATI"
+#define KEY_DIR_HEADER_SIZE 16
+//id, size, head, name offset and name length, all little-endian.
+#define KEY_DIR_RECORD_SIZE 40
+#define KEY_DIR_SIZE_OFFSET 16
+#define KEY_DIR_HEAD_OFFSET 24
+#define KEY_DIR_NAME_OFFSET 32
+#define KEY_DIR_NAME_LENGTH_OFFSET 36
+
+struct key_dir_entry
+{
+    uint8_t id[16];
+    uint64_t size;
+    uint64_t head;
+    char* name;
+};
+
+static char* key_dir_join(const char* dir, const char* name, size_t name_len)
+{
+    size_t dir_len=strlen(dir);
+    char* path=(char*)malloc(dir_len+1+name_len+1);
+    memcpy(path, dir, dir_len);
+    path[dir_len]='/';
+    memcpy(path+dir_len+1, name, name_len);
+    path[dir_len+1+name_len]=0;
+    return path;
+}
+static int key_dir_entry_compare(const void* a, const void* b)
+{
+    const struct key_dir_entry* ea=(const struct key_dir_entry*)a;
+    const struct key_dir_entry* eb=(const struct key_dir_entry*)b;
+    return memcmp(ea->id, eb->id, sizeof(ea->id));
+}
+//Reads just the header of a key file.
+static unsigned key_dir_read_key(
+    const char* path,
+    struct key_dir_entry* entry
+){
+    int fd=open(path, O_RDONLY);
+    if(fd==-1)
+    {
+        return 1;
+    }
+    uint8_t header[KEY_HEADER_SIZE];
+    struct stat st;
+    unsigned fail=
+        fstat(fd, &st)==-1||
+        !S_ISREG(st.st_mode)||
+        pread(fd, header, sizeof(header), 0)!=sizeof(header)||
+        key_parse_header(header, entry->id, &entry->head);
+    close(fd);
+    if(fail)
+    {
+        return 1;
+    }
+    entry->size=st.st_size-KEY_HEADER_SIZE;
+    return 0;
+}
+static void key_put_le64(uint8_t* dst, uint64_t value)
+{
+    value=htole64(value);
+    memcpy(dst, &value, sizeof(value));
+}
+static uint64_t key_get_le64(const uint8_t* src)
+{
+    uint64_t value=0;
+    memcpy(&value, src, sizeof(value));
+    return le64toh(value);
+}
+static void key_put_le32(uint8_t* dst, uint32_t value)
+{
+    value=htole32(value);
+    memcpy(dst, &value, sizeof(value));
+}
+static uint32_t key_get_le32(const uint8_t* src)
+{
+    uint32_t value=0;
+    memcpy(&value, src, sizeof(value));
+    return le32toh(value);
+}
+static unsigned key_dir_write_index(
+    const char* dir,
+    struct key_dir_entry* entries,
+    size_t count
+){
+    size_t names_size=0;
+    for(size_t i=0;i<count;++i)
+    {
+        names_size+=strlen(entries[i].name);
+    }
+    size_t index_size=
+        KEY_DIR_HEADER_SIZE+count*KEY_DIR_RECORD_SIZE+names_size;
+    uint8_t* index=(uint8_t*)calloc(index_size, 1);
+    memcpy(index, KEY_DIR_INDEX_MAGIC, 8);
+    key_put_le64(index+8, count);
+    uint8_t* names=index+KEY_DIR_HEADER_SIZE+count*KEY_DIR_RECORD_SIZE;
+    size_t name_offset=0;
+    for(size_t i=0;i<count;++i)
+    {
+        uint8_t* record=index+KEY_DIR_HEADER_SIZE+i*KEY_DIR_RECORD_SIZE;
+        size_t name_len=strlen(entries[i].name);
+        memcpy(record, entries[i].id, sizeof(entries[i].id));
+        key_put_le64(record+KEY_DIR_SIZE_OFFSET, entries[i].size);
+        key_put_le64(record+KEY_DIR_HEAD_OFFSET, entries[i].head);
+        key_put_le32(record+KEY_DIR_NAME_OFFSET, name_offset);
+        key_put_le32(record+KEY_DIR_NAME_LENGTH_OFFSET, name_len);
+        memcpy(names+name_offset, entries[i].name, name_len);
+        name_offset+=name_len;
+    }
+    //Write to a temporary file and rename it over the old index, so that
+    //another instance never sees a half-written one.
+    char* tmp_path=key_dir_join(
+        dir,
+        KEY_DIR_INDEX_NAME ".tmp",
+        strlen(KEY_DIR_INDEX_NAME ".tmp")
+    );
+    char* index_path=key_dir_join(
+        dir,
+        KEY_DIR_INDEX_NAME,
+        strlen(KEY_DIR_INDEX_NAME)
+    );
+    unsigned fail=1;
+    int fd=open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if(fd!=-1)
+    {
+        fail=write(fd, index, index_size)!=(ssize_t)index_size;
+        fail|=close(fd)!=0;
+        fail=fail||rename(tmp_path, index_path)!=0;
+        if(fail)
+        {
+            unlink(tmp_path);
+        }
+    }
+    free(tmp_path);
+    free(index_path);
+    free(index);
+    return fail;
+}
+static unsigned key_dir_has_suffix(const char* name, const char* suffix)
+{
+    size_t name_len=strlen(name);
+    size_t suffix_len=strlen(suffix);
+    return name_len>=suffix_len&&
+        strcmp(name+name_len-suffix_len, suffix)==0;
+}
+static unsigned key_dir_scan(const char* path)
+{
+    DIR* dir=opendir(path);
+    if(dir==NULL)
+    {
+        return 1;
+    }
+    struct key_dir_entry* entries=NULL;
+    size_t count=0, capacity=0;
+    struct dirent* de=NULL;
+    while((de=readdir(dir))!=NULL)
+    {
+        size_t name_len=strlen(de->d_name);
+        //Skip hidden files, such as the index itself, and the files kept
+        //next to each key.
+        if(de->d_name[0]=='.'||
+           key_dir_has_suffix(de->d_name, KEY_JOURNAL_SUFFIX)||
+           key_dir_has_suffix(de->d_name, KEY_USED_SUFFIX))
+        {
+            continue;
+        }
+        if(count==capacity)
+        {
+            capacity=capacity==0?64:capacity*2;
+            entries=(struct key_dir_entry*)realloc(
+                entries,
+                sizeof(struct key_dir_entry)*capacity
+            );
+        }
+        char* key_path=key_dir_join(path, de->d_name, name_len);
+        if(key_dir_read_key(key_path, &entries[count])==0)
+        {
+            entries[count].name=(char*)malloc(name_len+1);
+            memcpy(entries[count].name, de->d_name, name_len+1);
+            count++;
+        }
+        free(key_path);
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(struct key_dir_entry), key_dir_entry_compare);
+    //Two files with the same id are copies of the same key, keep one.
+    size_t unique=0;
+    for(size_t i=0;i<count;++i)
+    {
+        if(unique>0&&key_dir_entry_compare(&entries[unique-1], &entries[i])==0)
+        {
+            free(entries[i].name);
+            continue;
+        }
+        entries[unique++]=entries[i];
+    }
+    unsigned fail=key_dir_write_index(path, entries, unique);
+    for(size_t i=0;i<unique;++i)
+    {
+        free(entries[i].name);
+    }
+    free(entries);
+    return fail;
+}
+//Returns non-zero if the index has to be rebuilt.
+static unsigned key_dir_stale(const char* path, const char* index_path)
+{
+    struct stat dir_st, index_st;
+    if(stat(path, &dir_st)==-1||stat(index_path, &index_st)==-1)
+    {
+        return 1;
+    }
+    //Adding or removing keys changes the directory's modification time.
+    return dir_st.st_mtim.tv_sec>index_st.st_mtim.tv_sec||
+           (dir_st.st_mtim.tv_sec==index_st.st_mtim.tv_sec&&
+            dir_st.st_mtim.tv_nsec>index_st.st_mtim.tv_nsec);
+}
+static unsigned key_dir_map(struct key_dir* d, const char* index_path)
+{
+    int fd=open(index_path, O_RDONLY);
+    if(fd==-1)
+    {
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fd, &st)==-1||st.st_size<KEY_DIR_HEADER_SIZE)
+    {
+        close(fd);
+        return 1;
+    }
+    d->map=(uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(d->map==MAP_FAILED)
+    {
+        d->map=NULL;
+        return 1;
+    }
+    d->map_size=st.st_size;
+    d->count=key_get_le64(d->map+8);
+    if(memcmp(d->map, KEY_DIR_INDEX_MAGIC, 8)!=0||
+       d->count>(d->map_size-KEY_DIR_HEADER_SIZE)/KEY_DIR_RECORD_SIZE)
+    {
+        munmap(d->map, d->map_size);
+        d->map=NULL;
+        return 1;
+    }
+    //Lookups jump around the index.
+    madvise(d->map, d->map_size, MADV_RANDOM);
+    return 0;
+}
+unsigned key_dir_open(struct key_dir* d, const char* path)
+{
+    d->map=NULL;
+    d->map_size=0;
+    d->count=0;
+    d->path=(char*)malloc(strlen(path)+1);
+    strcpy(d->path, path);
+    char* index_path=key_dir_join(
+        path,
+        KEY_DIR_INDEX_NAME,
+        strlen(KEY_DIR_INDEX_NAME)
+    );
+    unsigned fail=0;
+    if(key_dir_stale(path, index_path))
+    {
+        fail=key_dir_scan(path);
+    }
+    if(!fail&&key_dir_map(d, index_path))
+    {//Broken index, try once more from scratch.
+        fail=key_dir_scan(path)||key_dir_map(d, index_path);
+    }
+    free(index_path);
+    if(fail)
+    {
+        key_dir_close(d);
+        return 1;
+    }
+    return 0;
+}
+void key_dir_close(struct key_dir* d)
+{
+    if(d->map!=NULL)
+    {
+        munmap(d->map, d->map_size);
+        d->map=NULL;
+    }
+    free(d->path);
+    d->path=NULL;
+    d->count=0;
+}
+//Moves the file at old_path to new_path unless there's one there already.
+static unsigned key_dir_migrate(const char* old_path, const char* new_path)
+{
+    struct stat st;
+    if(stat(new_path, &st)==0||errno!=ENOENT)
+    {
+        return 0;
+    }
+    return rename(old_path, new_path)==-1&&errno!=ENOENT;
+}
+char* key_dir_state_path(const char* key_path)
+{
+    const char* slash=strrchr(key_path, '/');
+    const char* name=slash!=NULL?slash+1:key_path;
+    size_t parent_len=slash!=NULL?(size_t)(slash-key_path):1;
+    char* parent=(char*)malloc(parent_len+1);
+    memcpy(parent, slash!=NULL?key_path:".", parent_len);
+    parent[parent_len]=0;
+    char* state_dir=key_dir_join(
+        parent,
+        KEY_DIR_STATE_NAME,
+        strlen(KEY_DIR_STATE_NAME)
+    );
+    free(parent);
+    if(mkdir(state_dir, 0700)==-1&&errno!=EEXIST)
+    {
+        free(state_dir);
+        return NULL;
+    }
+    char* state_path=key_dir_join(state_dir, name, strlen(name));
+    free(state_dir);
+    //Older versions kept these next to the key. Changes the directory
+    //once, which rebuilds the index once.
+    static const char* const suffixes[]={KEY_JOURNAL_SUFFIX, KEY_USED_SUFFIX};
+    for(size_t i=0;i<sizeof(suffixes)/sizeof(*suffixes);++i)
+    {
+        size_t suffix_len=strlen(suffixes[i]);
+        size_t key_len=strlen(key_path);
+        size_t state_len=strlen(state_path);
+        char* old_path=(char*)malloc(key_len+suffix_len+1);
+        char* new_path=(char*)malloc(state_len+suffix_len+1);
+        memcpy(old_path, key_path, key_len);
+        memcpy(old_path+key_len, suffixes[i], suffix_len+1);
+        memcpy(new_path, state_path, state_len);
+        memcpy(new_path+state_len, suffixes[i], suffix_len+1);
+        unsigned fail=key_dir_migrate(old_path, new_path);
+        free(old_path);
+        free(new_path);
+        if(fail)
+        {
+            free(state_path);
+            return NULL;
+        }
+    }
+    return state_path;
+}
+char* key_dir_find(struct key_dir* d, const uint8_t* id)
+{
+    if(d->map==NULL)
+    {
+        return NULL;
+    }
+    const uint8_t* records=d->map+KEY_DIR_HEADER_SIZE;
+    const uint8_t* names=records+d->count*KEY_DIR_RECORD_SIZE;
+    size_t lo=0, hi=d->count;
+    while(lo<hi)
+    {
+        size_t mid=lo+(hi-lo)/2;
+        const uint8_t* record=records+mid*KEY_DIR_RECORD_SIZE;
+        int cmp=memcmp(record, id, 16);
+        if(cmp==0)
+        {
+            uint32_t offset=key_get_le32(record+KEY_DIR_NAME_OFFSET);
+            uint32_t len=key_get_le32(record+KEY_DIR_NAME_LENGTH_OFFSET);
+            if((size_t)(names-d->map)+offset+len>d->map_size)
+            {
+                return NULL;
+            }
+            return key_dir_join(d->path, (const char*)names+offset, len);
+        }
+        else if(cmp<0)
+        {
+            lo=mid+1;
+        }
+        else
+        {
+            hi=mid;
+        }
+    }
+    return NULL;
+}
+char* key_dir_local_path(struct key_dir* d, const uint8_t* remote_id)
+{
+    char* remote_path=key_dir_find(d, remote_id);
+    if(remote_path==NULL)
+    {
+        return NULL;
+    }
+    const char* name=strrchr(remote_path, '/')+1;
+    char* local_dir=key_dir_join(
+        d->path,
+        KEY_DIR_LOCAL_NAME,
+        strlen(KEY_DIR_LOCAL_NAME)
+    );
+    char* path=key_dir_join(local_dir, name, strlen(name));
+    free(local_dir);
+    free(remote_path);
+    //Anything but a missing file is left for opening it to report.
+    struct stat st;
+    if(stat(path, &st)==-1&&errno==ENOENT)
+    {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
@@ -0,0 +1,63 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_KEYDIR_H_
+#define OTPCHAT_KEYDIR_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #define KEY_DIR_INDEX_NAME ".otpchat-index"
+    //Subdirectory for the journals and used ranges of the keys. Creating
+    //and removing them there leaves the mtime of the directory itself, and
+    //with it the index, alone.
+    #define KEY_DIR_STATE_NAME ".otpchat-state"
+    //Subdirectory for local keys that are only sent with to one peer each,
+    //named like that peer's key.
+    #define KEY_DIR_LOCAL_NAME "local"
+
+    //A directory of key files, looked up by id through a sorted on-disk
+    //index so that none of the keys need to be opened up front.
+    struct key_dir
+    {
+        char* path;
+        //The mapped index file
+        uint8_t* map;
+        size_t map_size;
+        uint64_t count;
+    };
+    //Returns non-zero on failure. Maps the index of the directory, scanning
+    //the directory and rewriting the index first if it's missing or older
+    //than the directory.
+    unsigned key_dir_open(struct key_dir* d, const char* path);
+    void key_dir_close(struct key_dir* d);
+    //Returns the path of the key file with the given id in a string that
+    //must be freed, or NULL if the directory doesn't have it.
+    char* key_dir_find(struct key_dir* d, const uint8_t* id);
+    //Returns where the state of the key at key_path is kept, for
+    //key_open_with_state(), in a string that must be freed. Creates the
+    //state directory next to the key and moves state left next to the key
+    //into it. Returns NULL on failure.
+    char* key_dir_state_path(const char* key_path);
+    //Returns the path of the local key kept for the remote key with the
+    //given id in a string that must be freed, or NULL if there's none.
+    char* key_dir_local_path(struct key_dir* d, const uint8_t* remote_id);
+#endif
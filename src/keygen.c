@@ -0,0 +1,240 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _GNU_SOURCE
+#include "keygen.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+//Every worker fills and writes this much at a time.
+#define KEYGEN_CHUNK_SIZE (8<<20)
+#define KEYGEN_ALIGNMENT 4096
+#define KEYGEN_PROGRESS_INTERVAL_MS 250
+
+struct keygen_job
+{
+    int fd;
+    uint64_t offset;
+    uint64_t size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    uint64_t next_chunk;
+    uint64_t chunks;
+    uint64_t done;
+    unsigned running_workers;
+    unsigned failed;
+};
+
+static double keygen_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+unsigned keygen_random(void* buf, size_t size)
+{
+    uint8_t* dst=(uint8_t*)buf;
+    while(size>0)
+    {
+        ssize_t got=getrandom(dst, size, 0);
+        if(got==-1)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        dst+=got;
+        size-=got;
+    }
+    if(size==0)
+    {
+        return 0;
+    }
+    //getrandom() isn't available, fall back to the device.
+    int urandom=open("/dev/urandom", O_RDONLY);
+    if(urandom==-1)
+    {
+        return 1;
+    }
+    while(size>0)
+    {
+        ssize_t got=read(urandom, dst, size);
+        if(got<=0)
+        {
+            close(urandom);
+            return 1;
+        }
+        dst+=got;
+        size-=got;
+    }
+    close(urandom);
+    return 0;
+}
+static unsigned keygen_write(int fd, const uint8_t* buf, size_t size, off_t at)
+{
+    while(size>0)
+    {
+        ssize_t written=pwrite(fd, buf, size, at);
+        if(written==-1)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        buf+=written;
+        size-=written;
+        at+=written;
+    }
+    return 0;
+}
+static void* keygen_worker(void* arg)
+{
+    struct keygen_job* job=(struct keygen_job*)arg;
+    void* buffer=NULL;
+    unsigned failed=posix_memalign(&buffer, KEYGEN_ALIGNMENT, KEYGEN_CHUNK_SIZE);
+
+    pthread_mutex_lock(&job->lock);
+    while(!failed&&!job->failed&&job->next_chunk<job->chunks)
+    {
+        uint64_t chunk=job->next_chunk++;
+        pthread_mutex_unlock(&job->lock);
+
+        uint64_t begin=chunk*KEYGEN_CHUNK_SIZE;
+        uint64_t size=job->size-begin;
+        size=size<KEYGEN_CHUNK_SIZE?size:KEYGEN_CHUNK_SIZE;
+        failed=keygen_random(buffer, size)||
+               keygen_write(job->fd, buffer, size, job->offset+begin);
+
+        pthread_mutex_lock(&job->lock);
+        job->done+=size;
+    }
+    if(failed)
+    {
+        job->failed=1;
+    }
+    job->running_workers--;
+    pthread_cond_signal(&job->done_cond);
+    pthread_mutex_unlock(&job->lock);
+    free(buffer);
+    return NULL;
+}
+unsigned keygen_fill(
+    int fd,
+    uint64_t offset,
+    uint64_t size,
+    const struct keygen_options* options
+){
+    struct keygen_options defaults={0, NULL, NULL};
+    if(options==NULL)
+    {
+        options=&defaults;
+    }
+    //Reserve the whole range up front so that the workers' writes don't
+    //fragment the file. Not every file system can do this.
+    if(size>0&&fallocate(fd, 0, offset, size)==-1&&
+       ftruncate(fd, offset+size)==-1)
+    {
+        return 1;
+    }
+
+    struct keygen_job job;
+    job.fd=fd;
+    job.offset=offset;
+    job.size=size;
+    job.next_chunk=0;
+    job.chunks=(size+KEYGEN_CHUNK_SIZE-1)/KEYGEN_CHUNK_SIZE;
+    job.done=0;
+    job.running_workers=0;
+    job.failed=0;
+
+    unsigned threads=options->threads;
+    if(threads==0)
+    {
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+        threads=cpus>0?cpus:1;
+    }
+    if(threads>job.chunks)
+    {
+        threads=job.chunks;
+    }
+    pthread_t* workers=(pthread_t*)malloc(sizeof(pthread_t)*(threads?threads:1));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.done_cond, NULL);
+
+    double begin=keygen_time();
+    pthread_mutex_lock(&job.lock);
+    unsigned started=0;
+    for(started=0;started<threads;++started)
+    {
+        if(pthread_create(&workers[started], NULL, keygen_worker, &job)!=0)
+        {
+            if(started==0)
+            {
+                job.failed=1;
+            }
+            break;
+        }
+        job.running_workers++;
+    }
+    while(job.running_workers>0)
+    {
+        if(options->progress!=NULL)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec+=KEYGEN_PROGRESS_INTERVAL_MS*1000000l;
+            deadline.tv_sec+=deadline.tv_nsec/1000000000l;
+            deadline.tv_nsec%=1000000000l;
+            pthread_cond_timedwait(&job.done_cond, &job.lock, &deadline);
+            options->progress(
+                job.done,
+                job.size,
+                keygen_time()-begin,
+                options->userdata
+            );
+        }
+        else
+        {
+            pthread_cond_wait(&job.done_cond, &job.lock);
+        }
+    }
+    pthread_mutex_unlock(&job.lock);
+    for(unsigned i=0;i<started;++i)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.done_cond);
+    return job.failed;
+}
@@ -0,0 +1,55 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_KEYGEN_H_
+#define OTPCHAT_KEYGEN_H_
+    #include <stdint.h>
+    #include <stddef.h>
+
+    //Called periodically from the thread that started the generation.
+    typedef void (*keygen_progress)(
+        uint64_t done,
+        uint64_t total,
+        double seconds,
+        void* userdata
+    );
+    struct keygen_options
+    {
+        //0 uses one thread per online CPU.
+        unsigned threads;
+        //May be NULL.
+        keygen_progress progress;
+        void* userdata;
+    };
+    //Fills size random bytes starting at offset in the file fd. The range is
+    //preallocated and split into chunks that worker threads fill from
+    //getrandom() and pwrite() independently. Returns non-zero on failure.
+    unsigned keygen_fill(
+        int fd,
+        uint64_t offset,
+        uint64_t size,
+        const struct keygen_options* options
+    );
+    //Fills buf with size random bytes. Returns non-zero on failure.
+    unsigned keygen_random(void* buf, size_t size);
+#endif
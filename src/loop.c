@@ -0,0 +1,236 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "loop.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#define LOOP_MAX_EVENTS 16
+
+unsigned loop_init(struct loop* l)
+{
+    l->watches=NULL;
+    l->watches_size=0;
+    l->watches_capacity=0;
+    l->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+    return l->epoll_fd==-1;
+}
+void loop_free(struct loop* l)
+{
+    while(l->watches_size!=0)
+    {
+        loop_remove(l, l->watches[l->watches_size-1]);
+    }
+    free(l->watches);
+    l->watches=NULL;
+    l->watches_capacity=0;
+    if(l->epoll_fd!=-1)
+    {
+        close(l->epoll_fd);
+        l->epoll_fd=-1;
+    }
+}
+unsigned loop_add(
+    struct loop* l,
+    struct loop_watch* w,
+    int fd,
+    unsigned want,
+    loop_callback callback,
+    void* userdata
+){
+    w->fd=fd;
+    w->ready=0;
+    w->want=want;
+    w->callback=callback;
+    w->userdata=userdata;
+    w->polled=1;
+    w->owns_fd=0;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events=EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+    ev.data.ptr=w;
+    if(epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &ev)==-1)
+    {
+        if(errno!=EPERM)
+        {
+            return 1;
+        }
+        w->polled=0;
+        w->ready=LOOP_READ|LOOP_WRITE;
+    }
+    if(l->watches_size==l->watches_capacity)
+    {
+        l->watches_capacity=l->watches_capacity==0?8:l->watches_capacity*2;
+        l->watches=(struct loop_watch**)realloc(
+            l->watches,
+            l->watches_capacity*sizeof(struct loop_watch*)
+        );
+    }
+    l->watches[l->watches_size++]=w;
+    return 0;
+}
+void loop_remove(struct loop* l, struct loop_watch* w)
+{
+    for(size_t i=0;i<l->watches_size;++i)
+    {
+        if(l->watches[i]!=w)
+        {
+            continue;
+        }
+        if(w->polled)
+        {
+            epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+        }
+        if(w->owns_fd)
+        {
+            close(w->fd);
+        }
+        l->watches[i]=l->watches[--l->watches_size];
+        w->fd=-1;
+        w->ready=0;
+        return;
+    }
+}
+unsigned loop_add_signal(
+    struct loop* l,
+    struct loop_watch* w,
+    int signum,
+    loop_callback callback,
+    void* userdata
+){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signum);
+    if(pthread_sigmask(SIG_BLOCK, &mask, NULL)!=0)
+    {
+        return 1;
+    }
+    int fd=signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+    if(fd==-1)
+    {
+        return 1;
+    }
+    if(loop_add(l, w, fd, LOOP_READ, callback, userdata))
+    {
+        close(fd);
+        return 1;
+    }
+    w->owns_fd=1;
+    return 0;
+}
+unsigned loop_take_signal(struct loop_watch* w)
+{
+    struct signalfd_siginfo info;
+    if(read(w->fd, &info, sizeof(info))!=sizeof(info))
+    {
+        loop_clear(w, LOOP_READ);
+        return 0;
+    }
+    return 1;
+}
+unsigned loop_add_timer(
+    struct loop* l,
+    struct loop_watch* w,
+    unsigned timeout_ms,
+    loop_callback callback,
+    void* userdata
+){
+    int fd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if(fd==-1)
+    {
+        return 1;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec=timeout_ms/1000;
+    spec.it_value.tv_nsec=(timeout_ms%1000)*1000000L;
+    if(timeout_ms==0)
+    {//Zero would disarm it.
+        spec.it_value.tv_nsec=1;
+    }
+    if( timerfd_settime(fd, 0, &spec, NULL)==-1||
+        loop_add(l, w, fd, LOOP_READ, callback, userdata)
+    ){
+        close(fd);
+        return 1;
+    }
+    w->owns_fd=1;
+    return 0;
+}
+void loop_clear(struct loop_watch* w, unsigned events)
+{
+    if(w->polled)
+    {
+        w->ready&=~events;
+    }
+}
+unsigned loop_wait(struct loop* l, int timeout_ms)
+{
+    for(size_t i=0;i<l->watches_size;++i)
+    {
+        if(l->watches[i]->ready&l->watches[i]->want)
+        {//Work left over from the last round.
+            timeout_ms=0;
+            break;
+        }
+    }
+    struct epoll_event events[LOOP_MAX_EVENTS];
+    int count=epoll_wait(l->epoll_fd, events, LOOP_MAX_EVENTS, timeout_ms);
+    if(count==-1)
+    {
+        return 1;
+    }
+    for(int i=0;i<count;++i)
+    {
+        struct loop_watch* w=(struct loop_watch*)events[i].data.ptr;
+        uint32_t e=events[i].events;
+        //Errors and hangups are found out by reading or writing.
+        if(e&(EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+        {
+            w->ready|=LOOP_READ;
+        }
+        if(e&(EPOLLOUT|EPOLLHUP|EPOLLERR))
+        {
+            w->ready|=LOOP_WRITE;
+        }
+    }
+    //A callback may remove watches, including itself, so the list is walked
+    //by index. A watch moved into an already visited slot waits for the
+    //next round.
+    for(size_t i=0;i<l->watches_size;++i)
+    {
+        struct loop_watch* w=l->watches[i];
+        if(w->callback!=NULL&&w->ready&w->want)
+        {
+            w->callback(w);
+        }
+    }
+    return 0;
+}
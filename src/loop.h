@@ -0,0 +1,104 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_LOOP_H_
+#define OTPCHAT_LOOP_H_
+    #include <stddef.h>
+    #define LOOP_READ 0x1
+    #define LOOP_WRITE 0x2
+
+    struct loop_watch;
+    typedef void (*loop_callback)(struct loop_watch* w);
+    //A descriptor watched by a loop. epoll only reports changes, so the
+    //readiness it has reported is kept in ready until the owner runs into
+    //EAGAIN and calls loop_clear(). The callback runs on every loop_wait()
+    //while the watch is ready for something in want, so it only has to do a
+    //bounded amount of work each time.
+    struct loop_watch
+    {
+        int fd;
+        unsigned ready;
+        unsigned want;
+        loop_callback callback;
+        void* userdata;
+        //0 for files epoll can't watch, like regular files. They are always
+        //ready.
+        unsigned polled;
+        //Set for signal and timer watches, whose descriptor the loop made
+        //and closes.
+        unsigned owns_fd;
+    };
+    struct loop
+    {
+        int epoll_fd;
+        struct loop_watch** watches;
+        size_t watches_size;
+        size_t watches_capacity;
+    };
+    //Returns non-zero on failure.
+    unsigned loop_init(struct loop* l);
+    void loop_free(struct loop* l);
+    //Starts watching fd for both reading and writing. callback may be NULL
+    //for watches that are only looked at through ready. Returns non-zero on
+    //failure.
+    unsigned loop_add(
+        struct loop* l,
+        struct loop_watch* w,
+        int fd,
+        unsigned want,
+        loop_callback callback,
+        void* userdata
+    );
+    //Stops watching. Call this whenever the descriptor is closed, the
+    //watch can then be added again. Does nothing if w isn't in the loop.
+    void loop_remove(struct loop* l, struct loop_watch* w);
+    //Delivers signum through a watch that becomes ready to read when the
+    //signal is raised. The signal is blocked in the calling thread and any
+    //threads it creates afterwards, so call this before starting them.
+    unsigned loop_add_signal(
+        struct loop* l,
+        struct loop_watch* w,
+        int signum,
+        loop_callback callback,
+        void* userdata
+    );
+    //Takes a raised signal from a signal watch. Returns 0 once there are no
+    //more.
+    unsigned loop_take_signal(struct loop_watch* w);
+    //A watch that becomes ready to read once, timeout_ms milliseconds from
+    //now. Remove it to cancel it.
+    unsigned loop_add_timer(
+        struct loop* l,
+        struct loop_watch* w,
+        unsigned timeout_ms,
+        loop_callback callback,
+        void* userdata
+    );
+    //Marks w not ready for events until epoll says otherwise.
+    void loop_clear(struct loop_watch* w, unsigned events);
+    //Waits for at most timeout_ms milliseconds, or forever if -1, and runs
+    //the callbacks of the watches that are ready for what they want. Doesn't
+    //wait at all if one already is. Returns non-zero on failure, EINTR
+    //included.
+    unsigned loop_wait(struct loop* l, int timeout_ms);
+#endif
@@ -21,25 +21,233 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
+#define _DEFAULT_SOURCE
 #include <stdio.h>
+#include <unistd.h>
+#include <time.h>
 #include "key.h"
 #include "args.h"
 #include "chat.h"
+#include "codebook.h"
+#include <stdlib.h>
+#include <string.h>
 
 void print_usage(const char* name)
 {
     fprintf(
         stderr,
-        "Usage: %s <local-key> <remote-key> [<address>[:<port>]]\n"
-        "       %s --generate <size> <new-key-file>\n",
-        name, name
+        "Usage: %s [options] <local-key> <remote-key> [<address>[:<port>]]\n"
+        "       %s [options] --key-dir <dir> <local-key> [<address>[:<port>]]\n"
+        "       %s --generate [--threads <n>] [--benchmark]\n"
+        "                  <size> <new-key-file>\n"
+        "       %s --train-dict <history-file>... <new-dict-file>\n"
+        "Options:\n"
+        "       --compress <0|1>        Compress messages to save pad\n"
+        "       --crypto-thread <0|1>   Decrypt messages on a helper thread\n"
+        "       --dict <file>           Compress with a trained dictionary\n"
+        "       --dns-ttl <seconds>     Remember resolved addresses this long\n"
+        "       --hosts <file>          Names to look up here before DNS\n"
+        "       --io-uring <0|1>        Batch socket and pad I/O in an io_uring\n"
+        "       --key-cache <n>         Keys from --key-dir kept open\n"
+        "       --max-frame <bytes>     Longest message accepted\n"
+        "       --pipe                  Relay stdin and stdout, no UI\n"
+        "       --prefetch <bytes>      Pad kept resident ahead of each head\n"
+        "       --reclaim-batch <bytes> Wipe used pad in batches of this size\n"
+        "       --send-queue <bytes>    Unsent messages kept in memory\n"
+        "       --sync-messages <n>     Sync the key heads every n messages\n"
+        "       --sync-ms <ms>          ... or after this many milliseconds\n",
+        name, name, name, name
     );
 }
-void generate(struct generate_args* a)
+static void generate_progress(
+    uint64_t done,
+    uint64_t total,
+    double seconds,
+    void* userdata
+){
+    (void)userdata;
+    fprintf(
+        stderr,
+        "\r%5.1f%%  %llu/%llu MiB  %.1f MiB/s ",
+        total==0?100.0:done*100.0/total,
+        (unsigned long long)(done>>20),
+        (unsigned long long)(total>>20),
+        seconds>0?done/seconds/(1<<20):0.0
+    );
+}
+static double generate_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+//Removes a benchmark key along with anything kept next to it.
+static void generate_remove(const char* path)
+{
+    static const char* const suffixes[]={KEY_JOURNAL_SUFFIX, KEY_USED_SUFFIX};
+    size_t path_len=strlen(path);
+    char* side_path=(char*)malloc(path_len+strlen(KEY_JOURNAL_SUFFIX)+1);
+    for(size_t i=0;i<sizeof(suffixes)/sizeof(*suffixes);++i)
+    {
+        memcpy(side_path, path, path_len);
+        strcpy(side_path+path_len, suffixes[i]);
+        unlink(side_path);
+    }
+    free(side_path);
+    unlink(path);
+}
+static unsigned generate_benchmark(struct generate_args* a)
+{
+    unsigned max_threads=a->threads;
+    if(max_threads==0)
+    {
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+        max_threads=cpus>0?cpus:1;
+    }
+    printf("%8s %12s\n", "threads", "MiB/s");
+    for(unsigned threads=1;;threads*=2)
+    {
+        threads=threads>max_threads?max_threads:threads;
+        struct keygen_options options={threads, NULL, NULL};
+        struct key new_key;
+        double begin=generate_time();
+        if(key_create(&new_key, a->key_path, a->key_size, &options))
+        {
+            fprintf(stderr, "Unable to create \"%s\"\n", a->key_path);
+            generate_remove(a->key_path);
+            return 1;
+        }
+        double seconds=generate_time()-begin;
+        key_close(&new_key);
+        generate_remove(a->key_path);
+        printf("%8u %12.1f\n", threads, a->key_size/seconds/(1<<20));
+        if(threads==max_threads)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+unsigned generate(struct generate_args* a)
 {
+    if(a->benchmark)
+    {
+        return generate_benchmark(a);
+    }
+    struct keygen_options options={a->threads, generate_progress, NULL};
     struct key new_key;
-    key_create(&new_key, a->key_path, a->key_size);
+    if(key_create(&new_key, a->key_path, a->key_size, &options))
+    {
+        fprintf(stderr, "\nUnable to create \"%s\"\n", a->key_path);
+        return 1;
+    }
+    fprintf(stderr, "\n");
     key_close(&new_key);
+    return 0;
+}
+//Appends every non-empty line of the file to messages. The messages point
+//into the returned buffer.
+static char* train_read_history(
+    const char* path,
+    struct block** messages,
+    size_t* count
+){
+    FILE* f=fopen(path, "rb");
+    if(f==NULL)
+    {
+        return NULL;
+    }
+    char* data=NULL;
+    size_t size=0;
+    for(;;)
+    {
+        data=(char*)realloc(data, size+(1<<16));
+        size_t read=fread(data+size, 1, 1<<16, f);
+        size+=read;
+        if(read==0)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    for(char* line=data;line<data+size;)
+    {
+        char* end=(char*)memchr(line, '\n', data+size-line);
+        end=end==NULL?data+size:end;
+        if(end!=line)
+        {
+            *messages=(struct block*)realloc(
+                *messages,
+                sizeof(struct block)*(*count+1)
+            );
+            (*messages)[*count].data=(uint8_t*)line;
+            (*messages)[*count].size=end-line;
+            (*count)++;
+        }
+        line=end+1;
+    }
+    return data;
+}
+unsigned train(struct train_args* a)
+{
+    struct block* messages=NULL;
+    size_t count=0;
+    char** data=(char**)calloc(a->history_count, sizeof(char*));
+    unsigned ret=0;
+    for(size_t i=0;i<a->history_count&&ret==0;++i)
+    {
+        data[i]=train_read_history(a->history_paths[i], &messages, &count);
+        if(data[i]==NULL)
+        {
+            fprintf(stderr, "Unable to read \"%s\"\n", a->history_paths[i]);
+            ret=1;
+        }
+    }
+    struct codebook cb;
+    if(ret==0&&codebook_train(&cb, messages, count))
+    {
+        fprintf(stderr, "Not enough history to train on\n");
+        ret=1;
+    }
+    if(ret==0&&codebook_save(&cb, a->dict_path))
+    {
+        fprintf(stderr, "Unable to write \"%s\"\n", a->dict_path);
+        ret=1;
+    }
+    if(ret==0)
+    {
+        size_t plain=0, compressed=0;
+        uint8_t* buf=NULL;
+        for(size_t i=0;i<count;++i)
+        {
+            buf=(uint8_t*)realloc(buf, messages[i].size);
+            size_t size=codebook_compress(
+                &cb,
+                buf,
+                messages[i].size-1,
+                messages[i].data,
+                messages[i].size,
+                NULL
+            );
+            plain+=messages[i].size;
+            compressed+=size!=0?size:messages[i].size;
+        }
+        free(buf);
+        printf(
+            "%u entries from %zu messages, %.1f%% of the pad needed "
+            "without compression\n",
+            cb.count,
+            count,
+            plain==0?100.0:compressed*100.0/plain
+        );
+    }
+    for(size_t i=0;i<a->history_count;++i)
+    {
+        free(data[i]);
+    }
+    free(data);
+    free(messages);
+    return ret;
 }
 int main(int argc, char** argv)
 {
@@ -49,17 +257,21 @@ int main(int argc, char** argv)
         print_usage(argv[0]);
         return 1;
     }
+    int ret=0;
     switch(args.mode)
     {
     case MODE_CHAT:
         chat(&args.mode_args.chat);
         break;
     case MODE_GENERATE:
-        generate(&args.mode_args.generate);
+        ret=generate(&args.mode_args.generate);
+        break;
+    case MODE_TRAIN:
+        ret=train(&args.mode_args.train);
         break;
     default:
         break;
     }
     free_args(&args);
-    return 0;
+    return ret;
 }
@@ -32,8 +32,11 @@ SOFTWARE.
 #include <endian.h>
 #include <fcntl.h>
 #include <sys/types.h>
-#include <sys/time.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -43,6 +46,9 @@ void node_close(struct node* n)
 {
     if(n->socket!=-1)
     {
+        //Reads and writes still queued in an io_uring hold on to the
+        //socket, this ends them.
+        shutdown(n->socket, SHUT_RDWR);
         close(n->socket);
         n->socket=-1;
     }
@@ -97,50 +103,202 @@ void node_get_address(struct node* n, struct address* addr)
         addr->port=ntohs(sa->sin6_port);
     }
 }
-unsigned node_connect(
-    struct node* remote,
-    const struct address* addr
-){
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family=AF_UNSPEC;
-    hints.ai_socktype=SOCK_STREAM;
-    
-    char port_str[6]={0};
-    snprintf(port_str, sizeof(port_str), "%d", addr->port);
-
-    remote->info=NULL;
-    remote->socket=-1;
-    
-    if(getaddrinfo(addr->node, port_str, &hints, &remote->info))
+//Returns a copy of the one address, in a single block like getaddrinfo()
+//makes them so that freeaddrinfo() can free it.
+static struct addrinfo* node_copy_address(const struct addrinfo* address)
+{
+    struct addrinfo* copy=(struct addrinfo*)malloc(
+        sizeof(struct addrinfo)+address->ai_addrlen
+    );
+    memcpy(copy, address, sizeof(struct addrinfo));
+    copy->ai_addr=(struct sockaddr*)(copy+1);
+    memcpy(copy->ai_addr, address->ai_addr, address->ai_addrlen);
+    copy->ai_canonname=NULL;
+    copy->ai_next=NULL;
+    return copy;
+}
+//Starts connecting to the next address that gets that far. Returns
+//non-zero if there are none left.
+static unsigned node_race_next(struct node_race* race)
+{
+    while(race->next<race->addresses_size)
     {
-        return 1;
+        size_t i=race->next++;
+        const struct addrinfo* address=race->addresses[i];
+        int s=socket(
+            address->ai_family,
+            address->ai_socktype|SOCK_NONBLOCK,
+            address->ai_protocol
+        );
+        if(s==-1)
+        {
+            continue;
+        }
+        struct epoll_event event;
+        event.events=EPOLLOUT;
+        event.data.u64=i;
+        if( (connect(s, address->ai_addr, address->ai_addrlen)!=0&&
+             errno!=EINPROGRESS)||
+            epoll_ctl(race->fd, EPOLL_CTL_ADD, s, &event)==-1
+        ){//Unreachable right away, e.g. no route for the family.
+            close(s);
+            continue;
+        }
+        race->sockets[i]=s;
+        race->running++;
+        //The next address gets its turn if this one is slow to answer.
+        struct itimerspec delay;
+        memset(&delay, 0, sizeof(delay));
+        if(race->next<race->addresses_size)
+        {
+            delay.it_value.tv_sec=NODE_RACE_DELAY_MS/1000;
+            delay.it_value.tv_nsec=NODE_RACE_DELAY_MS%1000*1000000L;
+        }
+        timerfd_settime(race->timer_fd, 0, &delay, NULL);
+        return 0;
     }
-    remote->socket=socket(
-        remote->info->ai_family,
-        remote->info->ai_socktype,
-        remote->info->ai_protocol
-    );
-    if(remote->socket==-1)
+    return 1;
+}
+void node_race_init(struct node_race* race)
+{
+    race->fd=-1;
+    race->timer_fd=-1;
+    race->addresses_size=0;
+    race->next=0;
+    race->running=0;
+}
+unsigned node_race_begin(
+    struct node_race* race,
+    const struct addrinfo* addresses
+){
+    node_race_end(race);
+    //RFC 8305 section 4: the family of the preferred address goes first,
+    //then the families take turns.
+    int family=addresses!=NULL?addresses->ai_family:AF_UNSPEC;
+    const struct addrinfo* same=addresses;
+    const struct addrinfo* other=addresses;
+    for(unsigned turn=0;race->addresses_size<NODE_RACE_MAX_ATTEMPTS;turn^=1)
     {
-        freeaddrinfo(remote->info);
-        return 1;
+        const struct addrinfo** at=turn==0?&same:&other;
+        while(*at!=NULL&&((*at)->ai_family==family)!=(turn==0))
+        {
+            *at=(*at)->ai_next;
+        }
+        if(*at==NULL)
+        {
+            if(same==NULL&&other==NULL)
+            {
+                break;
+            }
+            continue;
+        }
+        race->sockets[race->addresses_size]=-1;
+        race->addresses[race->addresses_size++]=node_copy_address(*at);
+        *at=(*at)->ai_next;
     }
-    //Set socket non-blocking
-    fcntl(remote->socket, F_SETFL, O_NONBLOCK);
-    if(
-        connect(
-            remote->socket,
-            remote->info->ai_addr,
-            remote->info->ai_addrlen
-        )!=0&&errno!=EINPROGRESS
+    race->fd=epoll_create1(EPOLL_CLOEXEC);
+    race->timer_fd=timerfd_create(
+        CLOCK_MONOTONIC,
+        TFD_NONBLOCK|TFD_CLOEXEC
+    );
+    struct epoll_event event;
+    event.events=EPOLLIN;
+    event.data.u64=NODE_RACE_MAX_ATTEMPTS;
+    if( race->fd==-1||race->timer_fd==-1||
+        epoll_ctl(race->fd, EPOLL_CTL_ADD, race->timer_fd, &event)==-1||
+        node_race_next(race)
     ){
-        close(remote->socket);
-        freeaddrinfo(remote->info);
+        node_race_end(race);
         return 1;
     }
     return 0;
 }
+unsigned node_race_step(struct node_race* race, struct node* remote)
+{
+    const int max_events=NODE_RACE_MAX_ATTEMPTS+1;
+    struct epoll_event events[NODE_RACE_MAX_ATTEMPTS+1];
+    int count;
+    //Level triggered, so it's only empty once everything is handled.
+    while((count=epoll_wait(race->fd, events, max_events, 0))>0)
+    {
+        for(int e=0;e<count;++e)
+        {
+            size_t i=events[e].data.u64;
+            if(i==NODE_RACE_MAX_ATTEMPTS)
+            {//Time for the next address.
+                uint64_t expirations;
+                if(read(race->timer_fd, &expirations, sizeof(expirations))>0)
+                {
+                    node_race_next(race);
+                }
+                continue;
+            }
+            if(race->sockets[i]==-1)
+            {
+                continue;
+            }
+            int err=0;
+            socklen_t sz=sizeof(err);
+            if( getsockopt(
+                    race->sockets[i],
+                    SOL_SOCKET,
+                    SO_ERROR,
+                    &err,
+                    &sz
+                )==-1
+            ){
+                err=errno;
+            }
+            if(err==0)
+            {//The winner, the rest are closed.
+                remote->socket=race->sockets[i];
+                remote->info=race->addresses[i];
+                race->sockets[i]=-1;
+                race->addresses[i]=NULL;
+                node_race_end(race);
+                return 0;
+            }
+            //Failed attempts don't hold the next one up.
+            close(race->sockets[i]);
+            race->sockets[i]=-1;
+            race->running--;
+            node_race_next(race);
+        }
+    }
+    if(race->running==0)
+    {
+        node_race_end(race);
+        return 1;
+    }
+    return NODE_WOULD_BLOCK;
+}
+void node_race_end(struct node_race* race)
+{
+    for(size_t i=0;i<race->addresses_size;++i)
+    {
+        if(race->sockets[i]!=-1)
+        {
+            close(race->sockets[i]);
+        }
+        if(race->addresses[i]!=NULL)
+        {
+            freeaddrinfo(race->addresses[i]);
+        }
+    }
+    race->addresses_size=0;
+    race->next=0;
+    race->running=0;
+    if(race->timer_fd!=-1)
+    {
+        close(race->timer_fd);
+        race->timer_fd=-1;
+    }
+    if(race->fd!=-1)
+    {
+        close(race->fd);
+        race->fd=-1;
+    }
+}
 unsigned node_listen(struct node* local, uint16_t port)
 {
     struct addrinfo hints;
@@ -182,6 +340,8 @@ unsigned node_listen(struct node* local, uint16_t port)
         local->socket=-1;
         return 1;
     }
+    //Accepting is retried until there's nobody left waiting.
+    fcntl(local->socket, F_SETFL, O_NONBLOCK);
     return 0;
 }
 unsigned node_accept(
@@ -201,7 +361,7 @@ unsigned node_accept(
     {
         freeaddrinfo(remote->info);
         remote->info=NULL;
-        return 1;
+        return errno==EAGAIN||errno==EWOULDBLOCK?NODE_WOULD_BLOCK:1;
     }
     //Set socket non-blocking
     fcntl(remote->socket, F_SETFL, O_NONBLOCK);
@@ -218,6 +378,10 @@ size_t node_send(
     {
         switch(errno)
         {
+        case EAGAIN:
+        case EINTR:
+            //Nothing was sent, the socket is still fine.
+            break;
         default:
         case ECONNRESET:
         case ENOTCONN:
@@ -232,12 +396,43 @@ size_t node_send(
     }
     return (size_t)sent;
 }
+size_t node_sendv(
+    struct node* remote,
+    const struct iovec* iov,
+    size_t iov_count
+){
+    ssize_t sent=writev(remote->socket, iov, iov_count);
+    if(sent==-1)
+    {
+        switch(errno)
+        {
+        case EAGAIN:
+        case EINTR:
+            //Nothing was sent, the socket is still fine.
+            break;
+        case EBADF:
+        case ENOTSOCK:
+            remote->socket=-1;
+            break;
+        default:
+            close(remote->socket);
+            remote->socket=-1;
+            break;
+        }
+        return 0;
+    }
+    return (size_t)sent;
+}
 size_t node_recv(
     struct node* remote,
     void* data,
     size_t size
 ){
     ssize_t received=recv(remote->socket, data, size, 0);
+    if(received==-1&&(errno==EAGAIN||errno==EINTR))
+    {//Nothing to read after all, the socket is still fine.
+        return 0;
+    }
     if(received<=0)
     {
         close(remote->socket);
@@ -246,85 +441,21 @@ size_t node_recv(
     }
     return (size_t)received;
 }
-unsigned node_exchange(
+size_t node_recvv(
     struct node* remote,
-    const void* send_data,
-    size_t send_size,
-    void* recv_data,
-    size_t recv_size,
-    unsigned* timeout_ms
+    const struct iovec* iov,
+    size_t iov_count
 ){
-    struct timeval timeout_tv={0};
-    if(timeout_ms!=NULL)
-    {
-        timeout_tv.tv_sec=*timeout_ms/1000;
-        timeout_tv.tv_usec=(*timeout_ms%1000)*1000;
-    }
-    fd_set remote_fds;
-    FD_ZERO(&remote_fds);
-    FD_SET(remote->socket, &remote_fds);
-    while((send_size>0||recv_size>0)&&remote->socket!=-1)
-    {
-        fd_set readfds, writefds;
-        if(recv_size>0)
-        {
-            readfds=remote_fds;
-        }
-        else
-        {
-            FD_ZERO(&readfds);
-        }
-        if(send_size>0)
-        {
-            writefds=remote_fds;
-        }
-        else
-        {
-            FD_ZERO(&writefds);
-        }
-        struct timeval timeout_temp={timeout_tv.tv_sec, timeout_tv.tv_usec};
-        struct timeval begin_tv={0};
-        struct timeval end_tv={0};
-        gettimeofday(&begin_tv, NULL);
-        if( select(
-                remote->socket+1,
-                &readfds,
-                &writefds,
-                NULL,
-                timeout_ms!=NULL?&timeout_temp:NULL
-            )==-1
-        )
-        {
-            if(errno==EINTR)
-            {
-                continue;
-            }
-            return 1;
-        }
-        gettimeofday(&end_tv, NULL);
-        struct timeval diff_tv;
-        timersub(&end_tv, &begin_tv, &diff_tv);
-        timersub(&timeout_tv, &diff_tv, &timeout_tv);
-        if(FD_ISSET(remote->socket, &readfds))
-        {
-            size_t read=node_recv(remote, recv_data, recv_size);
-            recv_data=((char*)recv_data)+read;
-            recv_size-=read;
-        }
-        if(FD_ISSET(remote->socket, &writefds))
-        {
-            size_t write=node_send(remote, send_data, send_size);
-            send_data=((char*)send_data)+write;
-            send_size-=write;
-        }
-    }
-    if(send_size>0||recv_size>0)
-    {
-        return 1;
+    ssize_t received=readv(remote->socket, iov, iov_count);
+    if(received==-1&&(errno==EAGAIN||errno==EINTR))
+    {//Nothing to read after all, the socket is still fine.
+        return 0;
     }
-    if(timeout_ms!=NULL)
+    if(received<=0)
     {
-        *timeout_ms=timeout_tv.tv_sec*1000+timeout_tv.tv_usec/1000;
+        close(remote->socket);
+        remote->socket=-1;
+        return 0;
     }
-    return 0;
+    return (size_t)received;
 }
@@ -26,6 +26,7 @@ SOFTWARE.
     #include <stdint.h>
     #include <sys/types.h>
     #include <sys/socket.h>
+    #include <sys/uio.h>
     #include <netdb.h>
 
     struct node
@@ -39,19 +40,53 @@ SOFTWARE.
 
     struct address;
     void node_get_address(struct node* n, struct address* addr);
+
+    //Addresses of a name that are tried at most.
+    #define NODE_RACE_MAX_ATTEMPTS 8
+    //How long an attempt gets before the next address is tried alongside
+    //it, the Connection Attempt Delay of RFC 8305.
+    #define NODE_RACE_DELAY_MS 250
+    //Connects to whichever address of a name answers first ("Happy
+    //Eyeballs"). A new attempt starts every NODE_RACE_DELAY_MS, or as soon
+    //as one fails, without giving up on the ones still in progress.
+    struct node_race
+    {
+        //epoll set of the attempts and the timer. It becomes readable when
+        //node_race_step() has something to do, -1 if there's no race.
+        int fd;
+        int timer_fd;
+        //Copies of the addresses in the order they're tried, alternating
+        //between IPv6 and IPv4.
+        struct addrinfo* addresses[NODE_RACE_MAX_ATTEMPTS];
+        int sockets[NODE_RACE_MAX_ATTEMPTS];
+        size_t addresses_size;
+        //Index of the next address to try.
+        size_t next;
+        //Attempts in progress.
+        size_t running;
+    };
+    void node_race_init(struct node_race* race);
     //Returns non-zero on failure.
-    //On success, the connection is being formed asynchronously.
-    //Use select() or poll() on node->socket to wait for the connecting to
-    //finish.
-    unsigned node_connect(
-        struct node* remote,
-        const struct address* addr
+    //On success, connections to the addresses are being formed
+    //asynchronously. Call node_race_step() whenever race->fd becomes
+    //readable. addresses comes from a resolver, see resolver.h.
+    unsigned node_race_begin(
+        struct node_race* race,
+        const struct addrinfo* addresses
     );
+    //Returns 0 once an attempt has connected, its socket is then handed to
+    //remote and the race ends. Returns NODE_WOULD_BLOCK while attempts are
+    //still in progress, or non-zero once they have all failed.
+    unsigned node_race_step(struct node_race* race, struct node* remote);
+    //Gives up on the attempts left. Does nothing if there's no race.
+    void node_race_end(struct node_race* race);
     //Returns non-zero on failure.
     //Creates a local node, binds its socket and starts listening on it.
     unsigned node_listen(struct node* local, uint16_t port);
 
-    //Returns non-zero on failure.
+    #define NODE_WOULD_BLOCK 2
+    //Returns non-zero on failure, NODE_WOULD_BLOCK if nobody is waiting to
+    //be accepted.
     unsigned node_accept(
         struct node* local,
         struct node* remote
@@ -64,6 +99,12 @@ SOFTWARE.
         const void* data,
         size_t size
     );
+    //Like node_send(), but gathers the data from iov_count buffers.
+    size_t node_sendv(
+        struct node* remote,
+        const struct iovec* iov,
+        size_t iov_count
+    );
     //Returns the number of bytes received.
     //Does not block. Use select() on remote->socket before calling.
     size_t node_recv(
@@ -71,15 +112,10 @@ SOFTWARE.
         void* data,
         size_t size
     );
-    //Returns non-zero on failure.
-    //Sends send_data and receives into recv_data simultaneously.
-    //Blocks until timeout. timeout_ms will be set to the time left on success.
-    unsigned node_exchange(
+    //Like node_recv(), but scatters the data into iov_count buffers.
+    size_t node_recvv(
         struct node* remote,
-        const void* send_data,
-        size_t send_size,
-        void* recv_data,
-        size_t recv_size,
-        unsigned* timeout_ms
+        const struct iovec* iov,
+        size_t iov_count
     );
 #endif
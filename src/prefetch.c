@@ -0,0 +1,218 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "prefetch.h"
+#include "key.h"
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+//Pad behind the head that stays resident, so that a peer resending its
+//last frame doesn't fault.
+#define PREFETCH_BEHIND 4096
+
+static void prefetch_unlock_slot(struct prefetch_slot* s)
+{
+    if(s->locked_size!=0)
+    {
+        munlock(s->locked_begin, s->locked_size);
+        s->locked_begin=NULL;
+        s->locked_size=0;
+    }
+}
+static void prefetch_fill(
+    struct prefetch* p,
+    struct prefetch_slot* s,
+    uint8_t* data,
+    size_t size,
+    uint64_t head
+){
+    size_t page_size=sysconf(_SC_PAGESIZE);
+    uint64_t begin=head>PREFETCH_BEHIND?head-PREFETCH_BEHIND:0;
+    uint64_t end=head+p->window;
+    if(end>size)
+    {
+        end=size;
+    }
+    if(begin>=end)
+    {
+        return;
+    }
+    uintptr_t first=(uintptr_t)(data+begin)&~(uintptr_t)(page_size-1);
+    uintptr_t last=(uintptr_t)(data+end);
+    uint8_t* range=(uint8_t*)first;
+    size_t range_size=last-first;
+
+    //Lock the new window first so that the overlap with the old one never
+    //leaves memory.
+    if(!p->lock_failed&&mlock(range, range_size)==0)
+    {
+        //The window can also shrink in place near the end of the pad, its
+        //old tail has to go then too.
+        if( s->locked_size!=0&&
+            (s->locked_begin!=range||s->locked_size!=range_size)
+        ){
+            uint8_t* old_end=s->locked_begin+s->locked_size;
+            if(s->locked_begin<range)
+            {
+                uint8_t* unlock_end=old_end<range?old_end:range;
+                munlock(s->locked_begin, unlock_end-s->locked_begin);
+            }
+            if(old_end>range+range_size)
+            {
+                uint8_t* unlock_begin=s->locked_begin>range+range_size?
+                    s->locked_begin:range+range_size;
+                munlock(unlock_begin, old_end-unlock_begin);
+            }
+        }
+        s->locked_begin=range;
+        s->locked_size=range_size;
+        return;
+    }
+    //Not allowed to lock memory (RLIMIT_MEMLOCK), fault the pages in instead.
+    p->lock_failed=1;
+    madvise(range, range_size, MADV_WILLNEED);
+    volatile uint8_t sink=0;
+    for(size_t i=0;i<range_size;i+=page_size)
+    {
+        sink^=range[i];
+    }
+    (void)sink;
+}
+static void* prefetch_thread(void* arg)
+{
+    struct prefetch* p=(struct prefetch*)arg;
+    pthread_mutex_lock(&p->lock);
+    while(p->running)
+    {
+        unsigned found=0;
+        for(unsigned i=0;i<PREFETCH_SLOTS;++i)
+        {
+            struct prefetch_slot* s=&p->slots[i];
+            if(s->key==NULL||!s->dirty)
+            {
+                continue;
+            }
+            found=1;
+            uint8_t* data=s->data;
+            size_t size=s->size;
+            uint64_t head=s->head;
+            s->dirty=0;
+            s->busy=1;
+            pthread_mutex_unlock(&p->lock);
+            prefetch_fill(p, s, data, size, head);
+            pthread_mutex_lock(&p->lock);
+            if(p->lock_failed)
+            {//Windows locked before that would only stay pinned for nothing.
+                for(unsigned j=0;j<PREFETCH_SLOTS;++j)
+                {
+                    prefetch_unlock_slot(&p->slots[j]);
+                }
+            }
+            s->busy=0;
+            pthread_cond_broadcast(&p->idle);
+        }
+        if(!found&&p->running)
+        {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+unsigned prefetch_init(struct prefetch* p, size_t window)
+{
+    memset(p->slots, 0, sizeof(p->slots));
+    p->window=window;
+    p->lock_failed=0;
+    p->running=1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->idle, NULL);
+    if(pthread_create(&p->thread, NULL, prefetch_thread, p)!=0)
+    {
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->wake);
+        pthread_cond_destroy(&p->idle);
+        p->running=0;
+        return 1;
+    }
+    return 0;
+}
+void prefetch_track(struct prefetch* p, unsigned slot, struct key* k)
+{
+    if(!p->running)
+    {
+        return;
+    }
+    struct prefetch_slot* s=&p->slots[slot];
+    pthread_mutex_lock(&p->lock);
+    if(s->key!=k)
+    {
+        //The old key may be closed right after this, so wait for the helper
+        //to let go of it.
+        while(s->busy)
+        {
+            pthread_cond_wait(&p->idle, &p->lock);
+        }
+        prefetch_unlock_slot(s);
+        s->key=k;
+        if(k!=NULL)
+        {
+            s->data=key_pad(k);
+            s->size=k->size;
+            s->head=k->head;
+            s->dirty=1;
+        }
+    }
+    else if(k!=NULL&&s->head!=k->head)
+    {
+        s->head=k->head;
+        s->dirty=1;
+    }
+    if(s->dirty)
+    {
+        pthread_cond_signal(&p->wake);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+void prefetch_end(struct prefetch* p)
+{
+    if(!p->running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->running=0;
+    pthread_cond_signal(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    for(unsigned i=0;i<PREFETCH_SLOTS;++i)
+    {
+        prefetch_unlock_slot(&p->slots[i]);
+        p->slots[i].key=NULL;
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->idle);
+}
@@ -0,0 +1,76 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_PREFETCH_H_
+#define OTPCHAT_PREFETCH_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <pthread.h>
+    #define PREFETCH_LOCAL 0
+    //Remote keys take the slots after the local one.
+    #define PREFETCH_REMOTE 1
+    #define PREFETCH_MAX_REMOTES 32
+    //Then the local keys kept for single remotes, in the same order.
+    #define PREFETCH_PAIRED (PREFETCH_REMOTE+PREFETCH_MAX_REMOTES)
+    #define PREFETCH_SLOTS (PREFETCH_PAIRED+PREFETCH_MAX_REMOTES)
+    #define PREFETCH_DEFAULT_WINDOW (4<<20)
+
+    struct key;
+    //A pad region the helper thread keeps resident.
+    struct prefetch_slot
+    {
+        struct key* key;
+        //Copied from the key so the helper thread never touches it.
+        uint8_t* data;
+        size_t size;
+        uint64_t head;
+        //Page-aligned range currently locked in memory.
+        uint8_t* locked_begin;
+        size_t locked_size;
+        //Set when the head has moved since the helper last looked at it.
+        unsigned dirty;
+        unsigned busy;
+    };
+    //Keeps the pad around the heads of the tracked keys locked in memory
+    //from a helper thread, so that encrypting and decrypting never has to
+    //wait for storage.
+    struct prefetch
+    {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_cond_t idle;
+        struct prefetch_slot slots[PREFETCH_SLOTS];
+        size_t window;
+        unsigned lock_failed;
+        unsigned running;
+    };
+    //Returns non-zero on failure. window is the amount of pad kept resident
+    //ahead of each head.
+    unsigned prefetch_init(struct prefetch* p, size_t window);
+    //Starts tracking k in the given slot, or updates its head if it's
+    //already tracked. k may be NULL to stop tracking. Call this again after
+    //the head of the key has moved.
+    void prefetch_track(struct prefetch* p, unsigned slot, struct key* k);
+    void prefetch_end(struct prefetch* p);
+#endif
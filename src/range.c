@@ -0,0 +1,130 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "range.h"
+#include <stdlib.h>
+#include <string.h>
+
+void range_set_init(struct range_set* set)
+{
+    set->ranges=NULL;
+    set->size=0;
+    set->capacity=0;
+}
+void range_set_free(struct range_set* set)
+{
+    free(set->ranges);
+    range_set_init(set);
+}
+//Index of the first range that ends at or after at.
+static size_t range_set_lower_bound(const struct range_set* set, uint64_t at)
+{
+    size_t lo=0, hi=set->size;
+    while(lo<hi)
+    {
+        size_t mid=lo+(hi-lo)/2;
+        if(set->ranges[mid].end<at)
+        {
+            lo=mid+1;
+        }
+        else
+        {
+            hi=mid;
+        }
+    }
+    return lo;
+}
+unsigned range_set_overlaps(
+    const struct range_set* set,
+    uint64_t begin,
+    uint64_t end
+){
+    if(begin>=end)
+    {
+        return 0;
+    }
+    //Common case, the range is right after everything used so far.
+    if(set->size==0||set->ranges[set->size-1].end<=begin)
+    {
+        return 0;
+    }
+    size_t i=range_set_lower_bound(set, begin+1);
+    return i<set->size&&set->ranges[i].begin<end;
+}
+void range_set_add(struct range_set* set, uint64_t begin, uint64_t end)
+{
+    if(begin>=end)
+    {
+        return;
+    }
+    //Common case, extend the last range.
+    if(set->size!=0&&set->ranges[set->size-1].end==begin)
+    {
+        set->ranges[set->size-1].end=end;
+        return;
+    }
+    //Ranges [first, last) touch or overlap the new one and get merged.
+    size_t first=range_set_lower_bound(set, begin);
+    size_t last=first;
+    while(last<set->size&&set->ranges[last].begin<=end)
+    {
+        if(set->ranges[last].begin<begin)
+        {
+            begin=set->ranges[last].begin;
+        }
+        if(set->ranges[last].end>end)
+        {
+            end=set->ranges[last].end;
+        }
+        last++;
+    }
+    if(first==last)
+    {
+        if(set->size==set->capacity)
+        {
+            set->capacity=set->capacity==0?4:set->capacity*2;
+            set->ranges=(struct range*)realloc(
+                set->ranges,
+                sizeof(struct range)*set->capacity
+            );
+        }
+        memmove(
+            set->ranges+first+1,
+            set->ranges+first,
+            sizeof(struct range)*(set->size-first)
+        );
+        set->size++;
+        last=first+1;
+    }
+    else if(last-first>1)
+    {
+        memmove(
+            set->ranges+first+1,
+            set->ranges+last,
+            sizeof(struct range)*(set->size-last)
+        );
+        set->size-=last-first-1;
+    }
+    set->ranges[first].begin=begin;
+    set->ranges[first].end=end;
+}
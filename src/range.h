@@ -0,0 +1,51 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_RANGE_H_
+#define OTPCHAT_RANGE_H_
+    #include <stdint.h>
+    #include <stddef.h>
+
+    struct range
+    {
+        uint64_t begin, end;
+    };
+    //Set of half-open ranges, kept sorted, disjoint and with touching ranges
+    //merged. A pad used front to back stays a single range.
+    struct range_set
+    {
+        struct range* ranges;
+        size_t size;
+        size_t capacity;
+    };
+    void range_set_init(struct range_set* set);
+    void range_set_free(struct range_set* set);
+    //Returns non-zero if any byte of [begin, end) is in the set. O(log n).
+    unsigned range_set_overlaps(
+        const struct range_set* set,
+        uint64_t begin,
+        uint64_t end
+    );
+    //Adds [begin, end) to the set.
+    void range_set_add(struct range_set* set, uint64_t begin, uint64_t end);
+#endif
@@ -0,0 +1,238 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _GNU_SOURCE
+#include "reclaim.h"
+#include "key.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+//Pad right behind the head is left alone in case the remote resends.
+#define RECLAIM_MARGIN (1<<20)
+#define RECLAIM_WRITE_SIZE (1<<20)
+
+//Returns the first file offset that may hold pad left to reclaim.
+static uint64_t reclaim_start(int fd)
+{
+    //The first page holds the header. Holes punched by earlier sessions are
+    //skipped over.
+    size_t page_size=sysconf(_SC_PAGESIZE);
+    off_t data=lseek(fd, page_size, SEEK_DATA);
+    if(data==-1)
+    {
+        if(errno==ENXIO)
+        {//Only holes left
+            data=lseek(fd, 0, SEEK_END);
+        }
+        else
+        {
+            data=page_size;
+        }
+    }
+    return ((uint64_t)data+page_size-1)&~(uint64_t)(page_size-1);
+}
+//Overwrites [begin, end) with zeros, flushes that and deallocates it from
+//punch, a page boundary, on.
+static unsigned reclaim_range(
+    int fd,
+    uint64_t begin,
+    uint64_t punch,
+    uint64_t end
+){
+    static const uint8_t zeros[RECLAIM_WRITE_SIZE];
+    for(uint64_t at=begin;at<end;)
+    {
+        size_t size=end-at<RECLAIM_WRITE_SIZE?end-at:RECLAIM_WRITE_SIZE;
+        ssize_t written=pwrite(fd, zeros, size, at);
+        if(written<=0)
+        {
+            return 1;
+        }
+        at+=written;
+    }
+    //The blocks must hold zeros on disk before they're handed back, or the
+    //old pad could linger in free space.
+    if(fdatasync(fd)==-1)
+    {
+        return 1;
+    }
+    //Not every file system can punch holes, the wipe is still worth it.
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, punch, end-punch);
+    return 0;
+}
+static void* reclaim_thread(void* arg)
+{
+    struct reclaim* r=(struct reclaim*)arg;
+    size_t page_size=sysconf(_SC_PAGESIZE);
+    pthread_mutex_lock(&r->lock);
+    while(r->running)
+    {
+        unsigned found=0;
+        for(unsigned i=0;i<RECLAIM_SLOTS&&r->running;++i)
+        {
+            struct reclaim_slot* s=&r->slots[i];
+            if(s->key==NULL)
+            {
+                continue;
+            }
+            //Pad that a FRAME_HEAD_SKIP jumped over is behind the head too.
+            //Heads only move forward, so it's never used and goes as well.
+            uint64_t head=s->head+KEY_HEADER_SIZE;
+            uint64_t target=head>RECLAIM_MARGIN?head-RECLAIM_MARGIN:0;
+            target&=~(uint64_t)(page_size-1);
+            if(s->done!=0&&(target<=s->done||target-s->done<r->batch))
+            {
+                continue;
+            }
+            found=1;
+            int fd=s->fd;
+            uint64_t done=s->done;
+            s->busy=1;
+            pthread_mutex_unlock(&r->lock);
+
+            if(done==0)
+            {
+                done=reclaim_start(fd);
+            }
+            //The pad sharing the first page with the header can only be
+            //overwritten. It goes along with the first batch, nothing has
+            //been punched yet if that's where the data starts.
+            uint64_t wipe=done==page_size?KEY_HEADER_SIZE:done;
+            uint64_t reclaimed=0;
+            if(target>done&&target-done>=r->batch&&
+               reclaim_range(fd, wipe, done, target)==0)
+            {
+                reclaimed=target-done;
+                done=target;
+            }
+
+            pthread_mutex_lock(&r->lock);
+            s->done=done;
+            r->reclaimed+=reclaimed;
+            s->busy=0;
+            pthread_cond_broadcast(&r->idle);
+            if(reclaimed==0)
+            {//Nothing more to do until the head moves on.
+                found=0;
+            }
+        }
+        if(!found&&r->running)
+        {
+            pthread_cond_wait(&r->wake, &r->lock);
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+unsigned reclaim_init(struct reclaim* r, size_t batch)
+{
+    memset(r->slots, 0, sizeof(r->slots));
+    r->batch=batch;
+    r->reclaimed=0;
+    r->running=1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    pthread_cond_init(&r->idle, NULL);
+    if(pthread_create(&r->thread, NULL, reclaim_thread, r)!=0)
+    {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->wake);
+        pthread_cond_destroy(&r->idle);
+        r->running=0;
+        return 1;
+    }
+    return 0;
+}
+void reclaim_track(
+    struct reclaim* r,
+    unsigned slot,
+    struct key* k,
+    uint64_t pinned
+){
+    if(!r->running)
+    {
+        return;
+    }
+    struct reclaim_slot* s=&r->slots[slot];
+    pthread_mutex_lock(&r->lock);
+    unsigned changed=0;
+    if(s->key!=k)
+    {
+        //The old key may be closed right after this.
+        while(s->busy)
+        {
+            pthread_cond_wait(&r->idle, &r->lock);
+        }
+        s->key=k;
+        s->done=0;
+        changed=1;
+        if(k!=NULL)
+        {
+            s->fd=k->fd;
+        }
+    }
+    uint64_t head=0;
+    if(k!=NULL)
+    {
+        head=k->synced_head<pinned?k->synced_head:pinned;
+    }
+    if(k!=NULL&&s->head!=head)
+    {
+        s->head=head;
+        changed=1;
+    }
+    if(changed&&k!=NULL)
+    {
+        pthread_cond_signal(&r->wake);
+    }
+    pthread_mutex_unlock(&r->lock);
+}
+uint64_t reclaim_total(struct reclaim* r)
+{
+    if(!r->running)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&r->lock);
+    uint64_t reclaimed=r->reclaimed;
+    pthread_mutex_unlock(&r->lock);
+    return reclaimed;
+}
+void reclaim_end(struct reclaim* r)
+{
+    if(!r->running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&r->lock);
+    r->running=0;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    pthread_cond_destroy(&r->idle);
+}
@@ -0,0 +1,83 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_RECLAIM_H_
+#define OTPCHAT_RECLAIM_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <pthread.h>
+    #define RECLAIM_LOCAL 0
+    //Remote keys take the slots after the local one.
+    #define RECLAIM_REMOTE 1
+    #define RECLAIM_MAX_REMOTES 32
+    //Then the local keys kept for single remotes, in the same order.
+    #define RECLAIM_PAIRED (RECLAIM_REMOTE+RECLAIM_MAX_REMOTES)
+    #define RECLAIM_SLOTS (RECLAIM_PAIRED+RECLAIM_MAX_REMOTES)
+    #define RECLAIM_DEFAULT_BATCH (16<<20)
+
+    struct key;
+    struct reclaim_slot
+    {
+        struct key* key;
+        //Copied from the key so the helper thread never touches it.
+        int fd;
+        //The synced head of the key, see struct key, or the pinned offset
+        //if that is lower.
+        uint64_t head;
+        //File offset up to which the pad has been wiped, or 0 if it still
+        //has to be found out.
+        uint64_t done;
+        unsigned busy;
+    };
+    //Wipes pad that is behind the heads of the tracked keys and punches
+    //holes in its place, from a helper thread and in large batches. Only
+    //pad whose use is already in a synced journal is wiped, otherwise a
+    //crash could bring back a head that points into zeros.
+    struct reclaim
+    {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        pthread_cond_t idle;
+        struct reclaim_slot slots[RECLAIM_SLOTS];
+        size_t batch;
+        uint64_t reclaimed;
+        unsigned running;
+    };
+    //Returns non-zero on failure. Nothing is done until at least batch
+    //bytes can be reclaimed from a key.
+    unsigned reclaim_init(struct reclaim* r, size_t batch);
+    //Same semantics as prefetch_track(). Pad from pinned on, a head
+    //offset, is left alone even if its use has been synced, for claims that
+    //are still being read. RECLAIM_UNPINNED if there are none.
+    #define RECLAIM_UNPINNED UINT64_MAX
+    void reclaim_track(
+        struct reclaim* r,
+        unsigned slot,
+        struct key* k,
+        uint64_t pinned
+    );
+    //Bytes reclaimed so far.
+    uint64_t reclaim_total(struct reclaim* r);
+    void reclaim_end(struct reclaim* r);
+#endif
@@ -0,0 +1,423 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "resolver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+static char* resolver_copy(const char* str)
+{
+    char* copy=(char*)malloc(strlen(str)+1);
+    strcpy(copy, str);
+    return copy;
+}
+static time_t resolver_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+static void resolver_signal(int fd)
+{
+    uint64_t one=1;
+    while(write(fd, &one, sizeof(one))==-1&&errno==EINTR);
+}
+static int resolver_getaddrinfo(
+    const char* node,
+    uint16_t port,
+    int flags,
+    struct addrinfo** info
+){
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    hints.ai_flags=flags|AI_NUMERICSERV;
+    char port_str[6]={0};
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    *info=NULL;
+    return getaddrinfo(node, port_str, &hints, info);
+}
+void resolver_request_free(struct resolver_request* req)
+{
+    if(req->info!=NULL)
+    {
+        freeaddrinfo(req->info);
+    }
+    free(req->node);
+    free(req);
+}
+static void resolver_free_list(struct resolver_request* req)
+{
+    while(req!=NULL)
+    {
+        struct resolver_request* next=req->next;
+        resolver_request_free(req);
+        req=next;
+    }
+}
+static void resolver_release(struct resolver_queue* q)
+{
+    if(__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL)!=0)
+    {
+        return;
+    }
+    resolver_free_list(q->requests);
+    resolver_free_list(q->done);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->wake);
+    close(q->done_fd);
+    free(q);
+}
+static void* resolver_thread(void* arg)
+{
+    struct resolver_queue* q=(struct resolver_queue*)arg;
+    pthread_mutex_lock(&q->lock);
+    while(q->running)
+    {
+        struct resolver_request* req=q->requests;
+        if(req==NULL)
+        {
+            pthread_cond_wait(&q->wake, &q->lock);
+            continue;
+        }
+        q->requests=req->next;
+        if(q->requests==NULL)
+        {
+            q->requests_tail=&q->requests;
+        }
+        pthread_mutex_unlock(&q->lock);
+        int error=resolver_getaddrinfo(req->node, req->port, 0, &req->info);
+        pthread_mutex_lock(&q->lock);
+        req->error=error;
+        req->next=q->done;
+        q->done=req;
+        resolver_signal(q->done_fd);
+    }
+    pthread_mutex_unlock(&q->lock);
+    resolver_release(q);
+    return NULL;
+}
+unsigned resolver_init(struct resolver* r, unsigned ttl)
+{
+    r->in_flight=0;
+    r->ttl=ttl;
+    r->cache_size=0;
+    r->hosts=NULL;
+    r->hosts_size=0;
+    r->parsed=NULL;
+    struct resolver_queue* q=(struct resolver_queue*)calloc(
+        1,
+        sizeof(struct resolver_queue)
+    );
+    r->queue=q;
+    q->requests_tail=&q->requests;
+    q->done_fd=eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if(q->done_fd==-1)
+    {
+        free(q);
+        r->queue=NULL;
+        return 1;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    q->running=1;
+    //One reference for the main thread and one for each helper. They're
+    //never joined, see resolver_end().
+    q->refs=1;
+    for(size_t i=0;i<RESOLVER_THREADS;++i)
+    {
+        pthread_t thread;
+        q->refs++;
+        if(pthread_create(&thread, NULL, resolver_thread, q)!=0)
+        {
+            q->refs--;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    if(q->refs==1)
+    {
+        resolver_release(q);
+        r->queue=NULL;
+        return 1;
+    }
+    return 0;
+}
+unsigned resolver_load_hosts(struct resolver* r, const char* path)
+{
+    FILE* f=fopen(path, "r");
+    if(f==NULL)
+    {
+        return 1;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), f)!=NULL)
+    {
+        char* comment=strchr(line, '#');
+        if(comment!=NULL)
+        {
+            *comment=0;
+        }
+        char* save=NULL;
+        const char* address=strtok_r(line, " \t\r\n", &save);
+        if(address==NULL)
+        {
+            continue;
+        }
+        const char* name;
+        while((name=strtok_r(NULL, " \t\r\n", &save))!=NULL)
+        {
+            r->hosts=(struct resolver_host*)realloc(
+                r->hosts,
+                (r->hosts_size+1)*sizeof(struct resolver_host)
+            );
+            r->hosts[r->hosts_size].name=resolver_copy(name);
+            r->hosts[r->hosts_size].address=resolver_copy(address);
+            r->hosts_size++;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+static void resolver_evict(struct resolver* r, size_t i)
+{
+    freeaddrinfo(r->cache[i].info);
+    free(r->cache[i].node);
+    r->cache[i]=r->cache[--r->cache_size];
+}
+static void resolver_cache(
+    struct resolver* r,
+    const char* node,
+    uint16_t port,
+    struct addrinfo* info
+){
+    for(size_t i=0;i<r->cache_size;++i)
+    {//Two lookups of the same name may have been in flight.
+        if(r->cache[i].port==port&&strcasecmp(r->cache[i].node, node)==0)
+        {
+            resolver_evict(r, i);
+            break;
+        }
+    }
+    if(r->cache_size==RESOLVER_CACHE_SIZE)
+    {//Make room by dropping the one that expires first.
+        size_t oldest=0;
+        for(size_t i=1;i<r->cache_size;++i)
+        {
+            if(r->cache[i].expires<r->cache[oldest].expires)
+            {
+                oldest=i;
+            }
+        }
+        resolver_evict(r, oldest);
+    }
+    struct resolver_entry* e=&r->cache[r->cache_size++];
+    e->node=resolver_copy(node);
+    e->port=port;
+    e->info=info;
+    e->expires=resolver_now()+r->ttl;
+}
+const struct addrinfo* resolver_lookup(
+    struct resolver* r,
+    const char* node,
+    uint16_t port
+){
+    time_t now=resolver_now();
+    for(size_t i=0;i<r->cache_size;)
+    {
+        struct resolver_entry* e=&r->cache[i];
+        if(e->expires<=now)
+        {
+            resolver_evict(r, i);
+            continue;
+        }
+        if(e->port==port&&strcasecmp(e->node, node)==0)
+        {
+            return e->info;
+        }
+        ++i;
+    }
+    //Addresses from the hosts file, or given as numbers, are parsed right
+    //here.
+    const char* address=node;
+    for(size_t i=0;i<r->hosts_size;++i)
+    {
+        if(strcasecmp(r->hosts[i].name, node)==0)
+        {
+            address=r->hosts[i].address;
+            break;
+        }
+    }
+    if(r->parsed!=NULL)
+    {
+        freeaddrinfo(r->parsed);
+    }
+    resolver_getaddrinfo(address, port, AI_NUMERICHOST, &r->parsed);
+    return r->parsed;
+}
+struct resolver_request* resolver_submit(
+    struct resolver* r,
+    const char* node,
+    uint16_t port,
+    void* owner
+){
+    if(r->queue==NULL||r->in_flight==RESOLVER_QUEUE_SIZE)
+    {
+        return NULL;
+    }
+    struct resolver_request* req=(struct resolver_request*)malloc(
+        sizeof(struct resolver_request)
+    );
+    req->node=resolver_copy(node);
+    req->port=port;
+    req->info=NULL;
+    req->error=0;
+    req->addresses=NULL;
+    req->owner=owner;
+    req->next=NULL;
+    req->cancelled=0;
+    struct resolver_queue* q=r->queue;
+    pthread_mutex_lock(&q->lock);
+    *q->requests_tail=req;
+    q->requests_tail=&req->next;
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+    r->in_flight++;
+    return req;
+}
+void resolver_cancel(struct resolver* r, struct resolver_request* req)
+{
+    struct resolver_queue* q=r->queue;
+    r->in_flight--;
+    pthread_mutex_lock(&q->lock);
+    //Unless a thread has it already, it can go right away.
+    struct resolver_request** link=&q->requests;
+    while(*link!=NULL&&*link!=req)
+    {
+        link=&(*link)->next;
+    }
+    if(*link==req)
+    {
+        *link=req->next;
+        if(q->requests_tail==&req->next)
+        {
+            q->requests_tail=link;
+        }
+        resolver_request_free(req);
+    }
+    else
+    {
+        req->cancelled=1;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+struct resolver_request* resolver_next(struct resolver* r)
+{
+    if(r->queue==NULL)
+    {
+        return NULL;
+    }
+    struct resolver_queue* q=r->queue;
+    for(;;)
+    {
+        pthread_mutex_lock(&q->lock);
+        struct resolver_request* req=q->done;
+        if(req!=NULL)
+        {
+            q->done=req->next;
+        }
+        else
+        {//Reset the counter under the lock so that no wakeup is lost.
+            uint64_t count;
+            while(read(q->done_fd, &count, sizeof(count))==-1&&
+                  errno==EINTR);
+        }
+        pthread_mutex_unlock(&q->lock);
+        if(req==NULL)
+        {
+            return NULL;
+        }
+        if(req->cancelled)
+        {
+            resolver_request_free(req);
+            continue;
+        }
+        r->in_flight--;
+        req->addresses=req->info;
+        if(req->info!=NULL&&r->ttl!=0)
+        {//The cache takes the result over.
+            resolver_cache(r, req->node, req->port, req->info);
+            req->info=NULL;
+        }
+        else if(req->info==NULL&&req->error==0)
+        {
+            req->error=EAI_NONAME;
+        }
+        return req;
+    }
+}
+int resolver_fd(const struct resolver* r)
+{
+    return r->queue!=NULL?r->queue->done_fd:-1;
+}
+void resolver_end(struct resolver* r)
+{
+    for(size_t i=0;i<r->hosts_size;++i)
+    {
+        free(r->hosts[i].name);
+        free(r->hosts[i].address);
+    }
+    free(r->hosts);
+    r->hosts=NULL;
+    r->hosts_size=0;
+    while(r->cache_size!=0)
+    {
+        resolver_evict(r, r->cache_size-1);
+    }
+    if(r->parsed!=NULL)
+    {
+        freeaddrinfo(r->parsed);
+        r->parsed=NULL;
+    }
+    if(r->queue==NULL)
+    {
+        return;
+    }
+    struct resolver_queue* q=r->queue;
+    pthread_mutex_lock(&q->lock);
+    q->running=0;
+    pthread_cond_broadcast(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+    //A lookup may take a while to time out, the threads clean up after
+    //themselves.
+    resolver_release(q);
+    r->queue=NULL;
+}
@@ -0,0 +1,133 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_RESOLVER_H_
+#define OTPCHAT_RESOLVER_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <time.h>
+    #include <pthread.h>
+    #include <netdb.h>
+    #define RESOLVER_DEFAULT_TTL 300
+    #define RESOLVER_CACHE_SIZE 32
+    //Lookups waiting or in flight at once, not counting cancelled ones.
+    #define RESOLVER_QUEUE_SIZE 16
+    //Lookups that run at the same time.
+    #define RESOLVER_THREADS 4
+
+    //A name being resolved by the helper thread.
+    struct resolver_request
+    {
+        char* node;
+        uint16_t port;
+        //Set by the thread. info is NULL if the lookup failed.
+        struct addrinfo* info;
+        int error;
+        //Set by resolver_next(), the result wherever it's kept now.
+        const struct addrinfo* addresses;
+        //Whoever is waiting for the request. Never touched by the threads.
+        void* owner;
+        //The rest is guarded by resolver_queue.lock. cancelled is set for
+        //a request that was already running when resolver_cancel() was
+        //called, it's freed once it's done.
+        struct resolver_request* next;
+        unsigned cancelled;
+    };
+    //What the main thread and the helper threads share. Whoever lets go
+    //last frees it, so that quitting never has to wait for a slow lookup.
+    struct resolver_queue
+    {
+        pthread_mutex_t lock;
+        pthread_cond_t wake;
+        //Requests waiting for a thread, oldest first, and finished ones.
+        struct resolver_request* requests;
+        struct resolver_request** requests_tail;
+        struct resolver_request* done;
+        int done_fd;
+        unsigned running;
+        unsigned refs;
+    };
+    struct resolver_entry
+    {
+        char* node;
+        uint16_t port;
+        struct addrinfo* info;
+        //CLOCK_MONOTONIC seconds after which the entry is looked up again.
+        time_t expires;
+    };
+    struct resolver_host
+    {
+        char* name;
+        char* address;
+    };
+    //Resolves names with getaddrinfo() on RESOLVER_THREADS helper threads,
+    //so that a slow DNS server can't hold up the main loop, nor a slow name
+    //the other lookups. Results are kept for ttl seconds. Names from a hosts
+    //file, and numeric addresses, never leave the process.
+    struct resolver
+    {
+        struct resolver_queue* queue;
+        //Requests submitted and neither returned nor cancelled yet.
+        size_t in_flight;
+        unsigned ttl;
+        struct resolver_entry cache[RESOLVER_CACHE_SIZE];
+        size_t cache_size;
+        struct resolver_host* hosts;
+        size_t hosts_size;
+        //Last name found in hosts or given as a number, these are cheap
+        //enough to parse every time.
+        struct addrinfo* parsed;
+    };
+    //Returns non-zero on failure.
+    unsigned resolver_init(struct resolver* r, unsigned ttl);
+    //Reads names from a file in /etc/hosts format, "address name...", that
+    //take precedence over DNS. Returns non-zero on failure.
+    unsigned resolver_load_hosts(struct resolver* r, const char* path);
+    //Returns the addresses of node if they are known without asking DNS,
+    //or NULL. They stay valid until the next call into the resolver.
+    const struct addrinfo* resolver_lookup(
+        struct resolver* r,
+        const char* node,
+        uint16_t port
+    );
+    //Starts resolving node on a helper thread. Returns NULL if there are
+    //RESOLVER_QUEUE_SIZE lookups in flight already.
+    struct resolver_request* resolver_submit(
+        struct resolver* r,
+        const char* node,
+        uint16_t port,
+        void* owner
+    );
+    //Drops a request that nobody waits for anymore. It no longer counts
+    //towards RESOLVER_QUEUE_SIZE, is never returned by resolver_next(), and
+    //mustn't be touched again.
+    void resolver_cancel(struct resolver* r, struct resolver_request* req);
+    //Returns a finished request, or NULL if there are none. Its addresses
+    //stay valid until the next call into the resolver, or until it's freed
+    //with resolver_request_free().
+    struct resolver_request* resolver_next(struct resolver* r);
+    //Descriptor that becomes readable when there are finished requests.
+    int resolver_fd(const struct resolver* r);
+    void resolver_request_free(struct resolver_request* req);
+    void resolver_end(struct resolver* r);
+#endif
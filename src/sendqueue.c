@@ -0,0 +1,170 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "sendqueue.h"
+#include "node.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+void send_queue_init(struct send_queue* q, size_t limit)
+{
+    q->frames=NULL;
+    q->capacity=0;
+    q->first=0;
+    q->size=0;
+    q->sent=0;
+    q->bytes=0;
+    q->limit=limit;
+}
+void send_queue_free(struct send_queue* q)
+{
+    for(size_t i=0;i<q->capacity;++i)
+    {
+        free(q->frames[i].data);
+    }
+    free(q->frames);
+    send_queue_init(q, q->limit);
+}
+unsigned send_queue_reserve(
+    const struct send_queue* q,
+    size_t header_size,
+    size_t body_size
+){
+    if(header_size>SEND_QUEUE_MAX_HEADER)
+    {
+        return 1;
+    }
+    return q->size!=0&&q->bytes+header_size+body_size>q->limit;
+}
+static void send_queue_grow(struct send_queue* q)
+{
+    size_t new_capacity=q->capacity==0?8:q->capacity*2;
+    struct send_frame* frames=(struct send_frame*)calloc(
+        new_capacity,
+        sizeof(struct send_frame)
+    );
+    //Unwrap the ring so that it starts from 0 again.
+    for(size_t i=0;i<q->capacity;++i)
+    {
+        frames[i]=q->frames[(q->first+i)%q->capacity];
+    }
+    free(q->frames);
+    q->frames=frames;
+    q->capacity=new_capacity;
+    q->first=0;
+}
+uint8_t* send_queue_push(
+    struct send_queue* q,
+    const uint8_t* header,
+    size_t header_size,
+    size_t body_size
+){
+    if(q->size==q->capacity)
+    {
+        send_queue_grow(q);
+    }
+    struct send_frame* f=&q->frames[(q->first+q->size)%q->capacity];
+    if(f->data==NULL||body_size>f->body_capacity)
+    {
+        free(f->data);
+        f->data=(uint8_t*)malloc(SEND_QUEUE_MAX_HEADER+body_size);
+        f->body_capacity=body_size;
+    }
+    memcpy(f->data+SEND_QUEUE_MAX_HEADER-header_size, header, header_size);
+    f->header_size=header_size;
+    f->body_size=body_size;
+    q->size++;
+    q->bytes+=header_size+body_size;
+    return f->data+SEND_QUEUE_MAX_HEADER;
+}
+void send_queue_cancel(struct send_queue* q)
+{
+    struct send_frame* f=&q->frames[(q->first+q->size-1)%q->capacity];
+    q->bytes-=f->header_size+f->body_size;
+    q->size--;
+}
+size_t send_queue_iov(
+    const struct send_queue* q,
+    struct iovec* iov,
+    size_t iov_max
+){
+    size_t iov_count=0;
+    for(size_t i=0;i<q->size&&iov_count<iov_max;++i)
+    {
+        const struct send_frame* f=&q->frames[(q->first+i)%q->capacity];
+        //Leave out what went out in an earlier partial write.
+        size_t skip=i==0?q->sent:0;
+        size_t size=f->header_size+f->body_size;
+        iov[iov_count].iov_base=
+            f->data+SEND_QUEUE_MAX_HEADER-f->header_size+skip;
+        iov[iov_count].iov_len=size-skip;
+        iov_count++;
+    }
+    return iov_count;
+}
+void send_queue_advance(struct send_queue* q, size_t sent)
+{
+    //Pop every frame that is now complete.
+    while(q->size!=0)
+    {
+        struct send_frame* f=&q->frames[q->first];
+        size_t remaining=f->header_size+f->body_size-q->sent;
+        if(sent<remaining)
+        {
+            q->sent+=sent;
+            break;
+        }
+        sent-=remaining;
+        q->bytes-=f->header_size+f->body_size;
+        q->sent=0;
+        q->first=(q->first+1)%q->capacity;
+        q->size--;
+    }
+}
+unsigned send_queue_flush(struct send_queue* q, struct node* remote)
+{
+    while(q->size!=0)
+    {
+        struct iovec iov[SEND_QUEUE_MAX_IOV];
+        size_t iov_count=send_queue_iov(q, iov, SEND_QUEUE_MAX_IOV);
+        size_t sent=node_sendv(remote, iov, iov_count);
+        send_queue_advance(q, sent);
+        if(sent==0)
+        {//Socket buffer is full, or the socket is gone.
+            return 1;
+        }
+    }
+    return 0;
+}
+void send_queue_clear(struct send_queue* q)
+{
+    q->first=0;
+    q->size=0;
+    q->sent=0;
+    q->bytes=0;
+}
+unsigned send_queue_empty(const struct send_queue* q)
+{
+    return q->size==0;
+}
@@ -0,0 +1,97 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_SENDQUEUE_H_
+#define OTPCHAT_SENDQUEUE_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <sys/uio.h>
+    #define SEND_QUEUE_MAX_HEADER 32
+    //Segments handed to one writev(), one per frame.
+    #define SEND_QUEUE_MAX_IOV 64
+    #define SEND_QUEUE_DEFAULT_LIMIT (1<<20)
+
+    struct node;
+    //An encrypted frame waiting to be sent. The header is stored right
+    //before the body, so the frame is one segment that stays put while the
+    //queue grows. The buffer stays with the slot once the frame is gone and
+    //is reused by later frames.
+    struct send_frame
+    {
+        //SEND_QUEUE_MAX_HEADER bytes of room for the header, then the body.
+        uint8_t* data;
+        size_t header_size;
+        size_t body_size;
+        size_t body_capacity;
+    };
+    //Ring of outgoing frames. Frames are only ever dropped by
+    //send_queue_clear(), never because another one was queued.
+    struct send_queue
+    {
+        struct send_frame* frames;
+        size_t capacity;
+        size_t first;
+        size_t size;
+        //Bytes of the first frame that have already been sent.
+        size_t sent;
+        //Unsent bytes in the whole queue, kept below limit.
+        size_t bytes;
+        size_t limit;
+    };
+    void send_queue_init(struct send_queue* q, size_t limit);
+    void send_queue_free(struct send_queue* q);
+    //Returns non-zero if the frame can't be queued without going over the
+    //limit. A frame is always accepted by an empty queue.
+    unsigned send_queue_reserve(
+        const struct send_queue* q,
+        size_t header_size,
+        size_t body_size
+    );
+    //Appends a frame and returns its body buffer for the caller to fill in.
+    //Check send_queue_reserve() first.
+    uint8_t* send_queue_push(
+        struct send_queue* q,
+        const uint8_t* header,
+        size_t header_size,
+        size_t body_size
+    );
+    //Removes the frame pushed last, before any of it has been sent.
+    void send_queue_cancel(struct send_queue* q);
+    //Sends as much of the queue as the socket takes, gathering many frames
+    //into a single writev(). Does not block. Returns non-zero if the socket
+    //stopped taking data before the queue was empty.
+    unsigned send_queue_flush(struct send_queue* q, struct node* remote);
+    //Points iov at the unsent part of the queue, one segment per frame and
+    //at most iov_max of them. Returns the number of segments. The frames
+    //don't move until they're sent or the queue is cleared.
+    size_t send_queue_iov(
+        const struct send_queue* q,
+        struct iovec* iov,
+        size_t iov_max
+    );
+    //Pops sent bytes off the front of the queue.
+    void send_queue_advance(struct send_queue* q, size_t sent);
+    //Drops all unsent frames.
+    void send_queue_clear(struct send_queue* q);
+    unsigned send_queue_empty(const struct send_queue* q);
+#endif
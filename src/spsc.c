@@ -0,0 +1,68 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "spsc.h"
+#include <stdlib.h>
+
+unsigned spsc_init(struct spsc* q, size_t capacity)
+{
+    size_t size=1;
+    while(size<capacity)
+    {
+        size<<=1;
+    }
+    q->slots=(void**)calloc(size, sizeof(void*));
+    q->mask=size-1;
+    q->head=0;
+    q->tail=0;
+    return q->slots==NULL;
+}
+void spsc_free(struct spsc* q)
+{
+    free(q->slots);
+    q->slots=NULL;
+}
+unsigned spsc_push(struct spsc* q, void* item)
+{
+    size_t tail=q->tail;
+    if(tail-__atomic_load_n(&q->head, __ATOMIC_ACQUIRE)>q->mask)
+    {
+        return 1;
+    }
+    q->slots[tail&q->mask]=item;
+    //The item has to be in place before the consumer can see it.
+    __atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+    return 0;
+}
+void* spsc_pop(struct spsc* q)
+{
+    size_t head=q->head;
+    if(head==__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    void* item=q->slots[head&q->mask];
+    //Only now may the producer reuse the slot.
+    __atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+    return item;
+}
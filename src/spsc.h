@@ -0,0 +1,50 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_SPSC_H_
+#define OTPCHAT_SPSC_H_
+    #include <stddef.h>
+    #define SPSC_CACHE_LINE 64
+
+    //A bounded lock-free queue of pointers between exactly one producer
+    //thread and one consumer thread. Each end writes only its own index, and
+    //they sit on separate cache lines so the threads don't fight over them.
+    struct spsc
+    {
+        void** slots;
+        size_t mask;
+        //Next slot to pop, written by the consumer.
+        size_t head;
+        char head_pad[SPSC_CACHE_LINE-sizeof(size_t)];
+        //Next slot to push, written by the producer.
+        size_t tail;
+        char tail_pad[SPSC_CACHE_LINE-sizeof(size_t)];
+    };
+    //capacity is rounded up to a power of two. Returns non-zero on failure.
+    unsigned spsc_init(struct spsc* q, size_t capacity);
+    void spsc_free(struct spsc* q);
+    //Producer side. Returns non-zero if the queue is full.
+    unsigned spsc_push(struct spsc* q, void* item);
+    //Consumer side. Returns NULL if the queue is empty.
+    void* spsc_pop(struct spsc* q);
+#endif
@@ -0,0 +1,189 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "transfer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+//Attempts at finding a free name for a received file.
+#define TRANSFER_MAX_RENAMES 100
+
+static double transfer_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+void transfer_init(struct transfer* t)
+{
+    t->fd=-1;
+    t->name=NULL;
+    t->size=0;
+    t->done=0;
+    t->start_s=0;
+    t->incoming=0;
+}
+unsigned transfer_active(const struct transfer* t)
+{
+    return t->fd!=-1;
+}
+static char* transfer_basename(const char* path, size_t size)
+{
+    size_t begin=size;
+    while(begin>0&&path[begin-1]!='/')
+    {
+        begin--;
+    }
+    char* name=(char*)malloc(size-begin+1);
+    memcpy(name, path+begin, size-begin);
+    name[size-begin]=0;
+    return name;
+}
+unsigned transfer_open_send(struct transfer* t, const char* path)
+{
+    transfer_init(t);
+    t->fd=open(path, O_RDONLY);
+    if(t->fd==-1)
+    {
+        return 1;
+    }
+    struct stat st;
+    if(fstat(t->fd, &st)==-1||!S_ISREG(st.st_mode))
+    {
+        close(t->fd);
+        t->fd=-1;
+        return 1;
+    }
+    posix_fadvise(t->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    t->name=transfer_basename(path, strlen(path));
+    t->size=st.st_size;
+    t->start_s=transfer_time();
+    return 0;
+}
+unsigned transfer_open_receive(
+    struct transfer* t,
+    const char* name,
+    size_t name_size,
+    uint64_t size
+){
+    transfer_init(t);
+    //Never let the sender pick the directory.
+    if(memchr(name, 0, name_size)!=NULL)
+    {
+        return 1;
+    }
+    char* base=transfer_basename(name, name_size);
+    if(base[0]==0||strcmp(base, ".")==0||strcmp(base, "..")==0)
+    {
+        free(base);
+        return 1;
+    }
+    size_t path_size=strlen(base)+8;
+    t->name=(char*)malloc(path_size);
+    strcpy(t->name, base);
+    for(unsigned i=1;i<=TRANSFER_MAX_RENAMES;++i)
+    {
+        t->fd=open(t->name, O_WRONLY|O_CREAT|O_EXCL, 0600);
+        if(t->fd!=-1||errno!=EEXIST)
+        {
+            break;
+        }
+        snprintf(t->name, path_size, "%s.%u", base, i);
+    }
+    free(base);
+    if(t->fd==-1)
+    {
+        free(t->name);
+        t->name=NULL;
+        return 1;
+    }
+    t->size=size;
+    t->start_s=transfer_time();
+    t->incoming=1;
+    return 0;
+}
+ssize_t transfer_read(struct transfer* t, uint8_t* data, size_t size)
+{
+    ssize_t r=0;
+    do
+    {
+        r=read(t->fd, data, size);
+    }
+    while(r==-1&&errno==EINTR);
+    if(r>0)
+    {
+        t->done+=r;
+    }
+    return r;
+}
+unsigned transfer_write(
+    struct transfer* t,
+    const uint8_t* data,
+    size_t size
+){
+    while(size>0)
+    {
+        ssize_t w=write(t->fd, data, size);
+        if(w==-1)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        data+=w;
+        size-=w;
+        t->done+=w;
+    }
+    return 0;
+}
+int transfer_percent(const struct transfer* t)
+{
+    return t->size?(int)(t->done*100/t->size):100;
+}
+double transfer_rate(const struct transfer* t)
+{
+    double seconds=transfer_time()-t->start_s;
+    return seconds>0?t->done/seconds:0;
+}
+void transfer_close(struct transfer* t, unsigned aborted)
+{
+    if(t->fd!=-1)
+    {
+        close(t->fd);
+        if(aborted&&t->incoming)
+        {
+            unlink(t->name);
+        }
+    }
+    free(t->name);
+    transfer_init(t);
+}
@@ -0,0 +1,76 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_TRANSFER_H_
+#define OTPCHAT_TRANSFER_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <sys/types.h>
+    //Size of each encrypted file frame.
+    #define TRANSFER_CHUNK_SIZE (16<<10)
+    //File frames queued for sending at once.
+    #define TRANSFER_CHUNKS_IN_FLIGHT 8
+
+    //A file being sent or received. Only one chunk of it is ever in
+    //memory per frame in flight.
+    struct transfer
+    {
+        int fd;
+        //Name without any directories.
+        char* name;
+        uint64_t size;
+        uint64_t done;
+        double start_s;
+        //Set for files being received.
+        unsigned incoming;
+    };
+    void transfer_init(struct transfer* t);
+    unsigned transfer_active(const struct transfer* t);
+    //Opens path for sending. Returns non-zero on failure.
+    unsigned transfer_open_send(struct transfer* t, const char* path);
+    //Creates a file for receiving in the working directory. The name is
+    //stripped of directories and numbered if it's already taken. Returns
+    //non-zero on failure.
+    unsigned transfer_open_receive(
+        struct transfer* t,
+        const char* name,
+        size_t name_size,
+        uint64_t size
+    );
+    //Reads the next chunk of a file being sent. Returns the number of bytes
+    //read, 0 at the end of the file, or -1 on failure.
+    ssize_t transfer_read(struct transfer* t, uint8_t* data, size_t size);
+    //Returns non-zero on failure.
+    unsigned transfer_write(
+        struct transfer* t,
+        const uint8_t* data,
+        size_t size
+    );
+    //Bytes per second since the transfer began.
+    double transfer_rate(const struct transfer* t);
+    //Progress from 0 to 100.
+    int transfer_percent(const struct transfer* t);
+    //Finishes the transfer. If it was aborted, a file being received is
+    //removed.
+    void transfer_close(struct transfer* t, unsigned aborted);
+#endif
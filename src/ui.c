@@ -29,6 +29,8 @@ SOFTWARE.
 #include <string.h>
 #include <locale.h>
 #include <ncurses.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #define COLOR_KEY_USED  1
 #define COLOR_KEY_LEFT  2
 #define COLOR_ID_OFFSET 3
@@ -111,17 +113,17 @@ unsigned ui_message_lines(struct message* msg, unsigned width)
 }
 unsigned ui_history_lines(struct chat_state* state)
 {
+    const struct chat_peer* peer=state->current;
     unsigned lines=0;
     size_t i=0;
-    for(i=0;i<state->history_size;++i)
+    for(i=0;i<peer->history_size;++i)
     {
-        lines+=ui_message_lines(state->history+i, state->history_width);
+        lines+=ui_message_lines(peer->history+i, state->history_width);
     }
     return lines;
 }
-unsigned ui_handle_input(struct chat_state* state)
+static unsigned ui_handle_key(struct chat_state* state, int c)
 {
-    int c=getch();
     unsigned fail=0;
     if(c=='\n')
     {//Newline sends the message.
@@ -140,7 +142,7 @@ unsigned ui_handle_input(struct chat_state* state)
             }
             free(command_str);
         }
-        else if(state->remote.state==CONNECTED)
+        else if(state->current->remote.state==CONNECTED)
         {
             struct message msg;
             msg.text.data=state->input.data;
@@ -148,7 +150,7 @@ unsigned ui_handle_input(struct chat_state* state)
             msg.id=ID_LOCAL;
             msg.timestamp=time(NULL);
 
-            chat_push_message(state, &msg);
+            chat_push_message(state, state->current, &msg);
             chat_begin_send(state, &msg.text);
         }
         else
@@ -213,16 +215,18 @@ unsigned ui_handle_input(struct chat_state* state)
     else if(c==KEY_UP)
     {
         unsigned lines=ui_history_lines(state);
-        if(state->history_line+state->history_height<lines)
+        size_t* line=&state->current->history_line;
+        if(*line+state->history_height<lines)
         {
-            state->history_line++;
+            (*line)++;
         }
     }
     else if(c==KEY_DOWN)
     {
-        if(state->history_line>0)
+        size_t* line=&state->current->history_line;
+        if(*line>0)
         {
-            state->history_line--;
+            (*line)--;
         }
     }
     else if(c==KEY_HOME)
@@ -233,9 +237,30 @@ unsigned ui_handle_input(struct chat_state* state)
     {
         state->cursor_index=state->input.size;
     }
+    return fail;
+}
+unsigned ui_handle_input(struct chat_state* state)
+{
+    //stdin is edge triggered, so everything there is has to be read now. A
+    //paste is drawn once, not per key.
+    unsigned fail=0;
+    int c;
+    while((c=getch())!=ERR)
+    {
+        fail|=ui_handle_key(state, c);
+    }
     ui_update(state);
     return fail;
 }
+void ui_resize(struct chat_state* state)
+{
+    struct winsize ws;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws)==0)
+    {
+        resizeterm(ws.ws_row, ws.ws_col);
+    }
+    ui_update(state);
+}
 static void draw_rect(int x, int y, unsigned w, unsigned h)
 {
     for(unsigned i=0;i<h;++i)
@@ -300,11 +325,12 @@ static void draw_history(
     struct chat_state* state,
     int x, int y
 ){
-    int line=y+state->history_height+state->history_line;
-    for(int i=state->history_size-1;i>=0&&line>=0;--i)
+    struct chat_peer* peer=state->current;
+    int line=y+state->history_height+peer->history_line;
+    for(int i=peer->history_size-1;i>=0&&line>=0;--i)
     {
         unsigned msg_lines=ui_message_lines(
-            state->history+i,
+            peer->history+i,
             state->history_width
         );
         line-=msg_lines;
@@ -314,15 +340,15 @@ static void draw_history(
         }
         draw_message_header(
             state,
-            &state->history[i],
+            &peer->history[i],
             x,
             line,
             state->history_width
         );
         draw_text_rect(
-            (char*)state->history[i].text.data,
-            state->history[i].text.size,
-            state->history[i].id+COLOR_ID_OFFSET,
+            (char*)peer->history[i].text.data,
+            peer->history[i].text.size,
+            peer->history[i].id+COLOR_ID_OFFSET,
             x, line+1, state->history_width
         );
     }
@@ -341,6 +367,28 @@ static void draw_scrollbar(
     draw_rect(x, y+bar_top, 1, bar_height);
     attroff(COLOR_PAIR(COLOR_SCROLLBAR));
 }
+//Returns the column after the drawn text.
+static unsigned draw_transfer(
+    const char* label,
+    const struct transfer* t,
+    unsigned x,
+    unsigned y
+){
+    if(!transfer_active(t))
+    {
+        return x;
+    }
+    mvprintw(
+        y,
+        x,
+        "%s %s: %d%%, %.1f MiB/s",
+        label,
+        t->name,
+        transfer_percent(t),
+        transfer_rate(t)/(1<<20)
+    );
+    return getcurx(stdscr)+1;
+}
 static unsigned draw_key_usage(
     const char* info_text,
     struct key* k,
@@ -385,9 +433,45 @@ static unsigned draw_key_usage(
     free(usage_str);
     return strlen(info_text)+width;
 }
+//Returns the column after the drawn text.
+static unsigned draw_peers(struct chat_state* state, unsigned x, unsigned y)
+{
+    if(state->peers_size<2)
+    {
+        return x;
+    }
+    size_t unread=0;
+    for(size_t i=0;i<state->peers_size;++i)
+    {
+        unread+=state->peers[i]->unread;
+    }
+    mvprintw(
+        y,
+        x,
+        "Peer %zu/%zu",
+        state->current->index+1,
+        state->peers_size
+    );
+    if(unread!=0)
+    {
+        printw(", %zu unread", unread);
+    }
+    return getcurx(stdscr)+1;
+}
 void ui_update(struct chat_state* state)
 {
-    clear();
+    state->redraw=1;
+}
+void ui_draw(struct chat_state* state)
+{
+    if(!state->redraw)
+    {
+        return;
+    }
+    state->redraw=0;
+    struct chat_peer* peer=state->current;
+    //Unlike clear(), only the cells that changed are sent to the terminal.
+    erase();
     int width, height;
     getmaxyx(stdscr, height, width);
 
@@ -411,7 +495,7 @@ void ui_update(struct chat_state* state)
         draw_scrollbar(
             width-1, 0,
             history_lines,
-            history_lines-state->history_line,
+            history_lines-peer->history_line,
             state->history_height
         );
     }
@@ -421,21 +505,47 @@ void ui_update(struct chat_state* state)
     draw_rect(0, input_line+2, width, 1);
     unsigned local_key_usage_len=draw_key_usage(
         "Local:  ",
-        state->local.key,
+        peer->remote.local_key!=NULL?peer->remote.local_key:state->local.key,
         0,
         height-1,
         20
     );
-    if(state->remote.key!=NULL)
+    unsigned status_x=local_key_usage_len+1;
+    if(peer->remote.key!=NULL)
     {
-        draw_key_usage(
+        status_x+=draw_key_usage(
             "Remote: ",
-            state->remote.key,
-            local_key_usage_len+1,
+            peer->remote.key,
+            status_x,
             height-1,
             20
+        )+1;
+    }
+    status_x=draw_peers(state, status_x, height-1);
+    uint64_t reclaimed=reclaim_total(&state->reclaim);
+    if(reclaimed!=0)
+    {
+        mvprintw(
+            height-1,
+            status_x,
+            "Reclaimed: %.1f MiB",
+            reclaimed/(double)(1<<20)
+        );
+        status_x=getcurx(stdscr)+1;
+    }
+    if(peer->plain_bytes!=0&&peer->remote.features&USER_FEATURE_COMPRESS)
+    {
+        mvprintw(
+            height-1,
+            status_x,
+            "Compressed: %.0f%%, saved %.1f KiB",
+            peer->pad_bytes*100.0/peer->plain_bytes,
+            (peer->plain_bytes-peer->pad_bytes)/1024.0
         );
+        status_x=getcurx(stdscr)+1;
     }
+    status_x=draw_transfer("Sending", &peer->file_out, status_x, height-1);
+    draw_transfer("Receiving", &peer->file_in, status_x, height-1);
     //Print input box
     draw_text_rect(
         (char*)state->input.data,
@@ -459,6 +569,7 @@ void ui_init(struct chat_state* state)
     noecho();
     use_default_colors();
     keypad(stdscr, TRUE);
+    nodelay(stdscr, TRUE);
     start_color();
     init_pair(COLOR_KEY_USED, COLOR_WHITE, COLOR_RED);
     init_pair(COLOR_KEY_LEFT, COLOR_WHITE, COLOR_GREEN);
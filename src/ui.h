@@ -29,9 +29,16 @@ SOFTWARE.
     struct chat_state;
     unsigned ui_message_lines(struct message* msg, unsigned width);
     unsigned ui_history_lines(struct chat_state* state);
+    //Handles every key waiting on stdin.
     unsigned ui_handle_input(struct chat_state* state);
+    //Fits the UI to the new terminal size after SIGWINCH.
+    void ui_resize(struct chat_state* state);
 
+    //Marks the UI as changed, it's drawn on the next ui_draw(). A burst of
+    //messages is drawn once instead of once per message.
     void ui_update(struct chat_state* state);
+    //Draws the UI if it has changed.
+    void ui_draw(struct chat_state* state);
     void ui_init(struct chat_state* state);
     void ui_end(struct chat_state* state);
 #endif
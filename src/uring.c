@@ -0,0 +1,283 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _DEFAULT_SOURCE
+#include "uring.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int uring_setup_call(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+static int uring_enter_call(
+    int fd,
+    unsigned to_submit,
+    unsigned min_complete,
+    unsigned flags
+){
+    return (int)syscall(
+        __NR_io_uring_enter,
+        fd,
+        to_submit,
+        min_complete,
+        flags,
+        NULL,
+        0
+    );
+}
+static void* uring_map(int fd, size_t size, off_t offset)
+{
+    void* map=mmap(
+        NULL,
+        size,
+        PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,
+        fd,
+        offset
+    );
+    return map==MAP_FAILED?NULL:map;
+}
+static void uring_unmap(struct uring* u)
+{
+    if(u->sqes!=NULL)
+    {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if(u->cq_ring!=NULL&&u->cq_ring!=u->sq_ring)
+    {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if(u->sq_ring!=NULL)
+    {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+}
+unsigned uring_init(struct uring* u, unsigned entries)
+{
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd=uring_setup_call(entries, &p);
+    if(u->fd==-1)
+    {
+        return 1;
+    }
+    u->sq_ring_size=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    u->cq_ring_size=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features&IORING_FEAT_SINGLE_MMAP)
+    {//Both rings live in one mapping.
+        if(u->cq_ring_size>u->sq_ring_size)
+        {
+            u->sq_ring_size=u->cq_ring_size;
+        }
+        u->cq_ring_size=u->sq_ring_size;
+    }
+    u->sq_ring=uring_map(u->fd, u->sq_ring_size, IORING_OFF_SQ_RING);
+    u->cq_ring=p.features&IORING_FEAT_SINGLE_MMAP?
+        u->sq_ring:uring_map(u->fd, u->cq_ring_size, IORING_OFF_CQ_RING);
+    u->sqes_size=p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes=(struct io_uring_sqe*)uring_map(
+        u->fd,
+        u->sqes_size,
+        IORING_OFF_SQES
+    );
+    if(u->sq_ring==NULL||u->cq_ring==NULL||u->sqes==NULL)
+    {
+        uring_unmap(u);
+        close(u->fd);
+        u->fd=-1;
+        return 1;
+    }
+    uint8_t* sq=(uint8_t*)u->sq_ring;
+    u->sq_head=(unsigned*)(sq+p.sq_off.head);
+    u->sq_tail=(unsigned*)(sq+p.sq_off.tail);
+    u->sq_array=(unsigned*)(sq+p.sq_off.array);
+    u->sq_mask=*(unsigned*)(sq+p.sq_off.ring_mask);
+    u->sq_entries=p.sq_entries;
+    u->tail=*u->sq_tail;
+    uint8_t* cq=(uint8_t*)u->cq_ring;
+    u->cq_head=(unsigned*)(cq+p.cq_off.head);
+    u->cq_tail=(unsigned*)(cq+p.cq_off.tail);
+    u->cqes=(struct io_uring_cqe*)(cq+p.cq_off.cqes);
+    u->cq_mask=*(unsigned*)(cq+p.cq_off.ring_mask);
+    u->cq_entries=p.cq_entries;
+    return 0;
+}
+void uring_free(struct uring* u)
+{
+    if(u->fd==-1)
+    {
+        return;
+    }
+    //The kernel may still be writing into buffers the owners are about to
+    //free.
+    while(u->in_flight!=0)
+    {
+        if(uring_submit(u, 1))
+        {
+            break;
+        }
+        uring_reap(u);
+    }
+    uring_unmap(u);
+    close(u->fd);
+    u->fd=-1;
+}
+static unsigned uring_queue(
+    struct uring* u,
+    struct uring_request* req,
+    uint8_t opcode,
+    int fd,
+    uint64_t addr,
+    uint32_t len,
+    uint64_t offset
+){
+    if(req->busy||u->in_flight+u->queued>=u->cq_entries)
+    {
+        return 1;
+    }
+    unsigned head=__atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if(u->tail-head>=u->sq_entries)
+    {
+        return 1;
+    }
+    unsigned index=u->tail&u->sq_mask;
+    struct io_uring_sqe* sqe=&u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode=opcode;
+    sqe->fd=fd;
+    sqe->addr=addr;
+    sqe->len=len;
+    sqe->off=offset;
+    sqe->user_data=(uint64_t)(uintptr_t)req;
+    u->sq_array[index]=index;
+    u->tail++;
+    u->queued++;
+    req->busy=1;
+    return 0;
+}
+unsigned uring_readv(
+    struct uring* u,
+    struct uring_request* req,
+    int fd,
+    const struct iovec* iov,
+    size_t iov_count
+){
+    return uring_queue(
+        u,
+        req,
+        IORING_OP_READV,
+        fd,
+        (uintptr_t)iov,
+        iov_count,
+        0
+    );
+}
+unsigned uring_writev(
+    struct uring* u,
+    struct uring_request* req,
+    int fd,
+    const struct iovec* iov,
+    size_t iov_count
+){
+    return uring_queue(
+        u,
+        req,
+        IORING_OP_WRITEV,
+        fd,
+        (uintptr_t)iov,
+        iov_count,
+        0
+    );
+}
+unsigned uring_fadvise(
+    struct uring* u,
+    struct uring_request* req,
+    int fd,
+    uint64_t offset,
+    uint32_t size,
+    int advice
+){
+    if(uring_queue(u, req, IORING_OP_FADVISE, fd, 0, size, offset))
+    {
+        return 1;
+    }
+    u->sqes[(u->tail-1)&u->sq_mask].fadvise_advice=advice;
+    return 0;
+}
+unsigned uring_submit(struct uring* u, unsigned wait)
+{
+    if(u->queued==0&&wait==0)
+    {
+        return 0;
+    }
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    for(;;)
+    {
+        int submitted=uring_enter_call(
+            u->fd,
+            u->queued,
+            wait,
+            wait!=0?IORING_ENTER_GETEVENTS:0
+        );
+        u->syscalls++;
+        if(submitted==-1)
+        {
+            if(errno==EINTR)
+            {
+                continue;
+            }
+            return 1;
+        }
+        u->queued-=submitted;
+        u->in_flight+=submitted;
+        return u->queued!=0;
+    }
+}
+size_t uring_reap(struct uring* u)
+{
+    size_t reaped=0;
+    unsigned head=*u->cq_head;
+    while(head!=__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe* cqe=&u->cqes[head&u->cq_mask];
+        struct uring_request* req=(struct uring_request*)(uintptr_t)
+            cqe->user_data;
+        req->result=cqe->res;
+        //Released before the callback, which may queue the next request.
+        __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+        req->busy=0;
+        u->in_flight--;
+        reaped++;
+        if(req->callback!=NULL)
+        {
+            req->callback(req);
+        }
+    }
+    return reaped;
+}
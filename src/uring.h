@@ -0,0 +1,111 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_URING_H_
+#define OTPCHAT_URING_H_
+    #include <stdint.h>
+    #include <stddef.h>
+    #include <sys/uio.h>
+
+    struct uring_request;
+    typedef void (*uring_callback)(struct uring_request* req);
+    //One operation on a ring. The owner keeps it, and everything it points
+    //to, alive until the callback has run.
+    struct uring_request
+    {
+        uring_callback callback;
+        void* userdata;
+        //Free for the owner, for example to tell stale completions apart.
+        uint64_t tag;
+        //What the system call would have returned, or -errno.
+        int result;
+        //Set from queueing until the completion has been reaped.
+        unsigned busy;
+    };
+    //A bare io_uring driven with the raw system calls. Requests are queued
+    //into the shared submission ring for free and handed to the kernel in
+    //batches by uring_submit().
+    struct uring
+    {
+        int fd;
+        void* sq_ring;
+        size_t sq_ring_size;
+        void* cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe* sqes;
+        size_t sqes_size;
+        unsigned* sq_head;
+        unsigned* sq_tail;
+        unsigned* sq_array;
+        unsigned sq_mask;
+        unsigned sq_entries;
+        unsigned* cq_head;
+        unsigned* cq_tail;
+        struct io_uring_cqe* cqes;
+        unsigned cq_mask;
+        unsigned cq_entries;
+        //Where the next request goes in the submission ring.
+        unsigned tail;
+        //Queued but not yet submitted, and submitted but not yet reaped.
+        unsigned queued;
+        unsigned in_flight;
+        //io_uring_enter() calls so far.
+        uint64_t syscalls;
+    };
+    //Returns non-zero on failure, for example if the kernel has no
+    //io_uring or it has been disabled.
+    unsigned uring_init(struct uring* u, unsigned entries);
+    //Waits for the requests still in flight.
+    void uring_free(struct uring* u);
+    //Queue a request. They return non-zero if req is already busy or the
+    //ring is full.
+    unsigned uring_readv(
+        struct uring* u,
+        struct uring_request* req,
+        int fd,
+        const struct iovec* iov,
+        size_t iov_count
+    );
+    unsigned uring_writev(
+        struct uring* u,
+        struct uring_request* req,
+        int fd,
+        const struct iovec* iov,
+        size_t iov_count
+    );
+    //posix_fadvise() of a file range.
+    unsigned uring_fadvise(
+        struct uring* u,
+        struct uring_request* req,
+        int fd,
+        uint64_t offset,
+        uint32_t size,
+        int advice
+    );
+    //Hands everything queued to the kernel with one system call, and waits
+    //until at least wait requests have completed. Returns non-zero on
+    //failure.
+    unsigned uring_submit(struct uring* u, unsigned wait);
+    //Runs the callbacks of completed requests. Returns how many there were.
+    size_t uring_reap(struct uring* u);
+#endif
@@ -21,20 +21,33 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
+#define _DEFAULT_SOURCE
 #include "user.h"
+#include "loop.h"
 #include <stdlib.h>
 #include <string.h>
-#define TIMEOUT_MS 2000
-#define PROTOCOL_ID "OTPCHAT0"
+#include <endian.h>
+//Bumped whenever the hello or the frame layout changes, so that builds
+//that can't talk to each other fail the handshake right away.
+#define PROTOCOL_ID "OTPCHAT2"
 
 void user_init(struct user* u, uint32_t id)
 {
     u->key=NULL;
+    u->local_key=NULL;
+    u->key_store=NULL;
+    u->incoming=0;
     u->node.socket=-1;
     u->node.info=NULL;
+    node_race_init(&u->race);
     u->name=NULL;
     u->state=NOT_CONNECTED;
     u->id=id;
+    u->offered_features=USER_DEFAULT_FEATURES;
+    u->features=0;
+    u->dict_id=0;
+    u->handshake.phase=USER_HANDSHAKE_CONNECT;
+    u->handshake.size=0;
 }
 void user_set_name(struct user* u, const char* name)
 {
@@ -46,96 +59,265 @@ void user_set_name(struct user* u, const char* name)
     u->name=(char*)malloc(strlen(name)+1);
     strcpy(u->name, name);
 }
-unsigned user_begin_connect(struct user* u, struct address* addr)
+void user_begin_resolve(struct user* u)
 {
     user_disconnect(u);
-    if(node_connect(&u->node, addr))
+    u->state=CONNECTING;
+    u->incoming=0;
+    u->handshake.phase=USER_HANDSHAKE_RESOLVE;
+}
+unsigned user_begin_connect(
+    struct user* u,
+    const struct addrinfo* address
+){
+    user_disconnect(u);
+    if(node_race_begin(&u->race, address))
     {
         return 1;
     }
     u->state=CONNECTING;
+    u->incoming=0;
+    u->handshake.phase=USER_HANDSHAKE_CONNECT;
     return 0;
 }
-static unsigned user_handshake(
-    struct user* u,
-    struct key_store* keys,
-    unsigned timeout_ms
-){
-    uint8_t send_message[8+sizeof(keys->local.id)]={0};
-    uint8_t recv_message[8+sizeof(keys->local.id)]={0};
-    memcpy(send_message, PROTOCOL_ID, 8);
-    memcpy(send_message+8, keys->local.id, sizeof(keys->local.id));
-
-    if( node_exchange(
-            &u->node,
-            send_message,
-            sizeof(send_message),
-            recv_message,
-            sizeof(recv_message),
-            &timeout_ms
-        )
-    ){
-        return 4;
-    }
-    if(memcmp(recv_message, PROTOCOL_ID, 8)!=0)
+//Starts swapping size bytes of send with the remote.
+static void user_exchange(struct user* u, const uint8_t* send, size_t size)
+{
+    struct user_handshake* h=&u->handshake;
+    memcpy(h->send, send, size);
+    h->size=size;
+    h->sent=0;
+    h->received=0;
+}
+//Sends and receives what the socket takes. Returns 0 once the exchange is
+//complete, USER_WOULD_BLOCK if both ways that are left would block, or 1
+//if the connection is gone.
+static unsigned user_exchange_step(struct user* u)
+{
+    struct user_handshake* h=&u->handshake;
+    for(;;)
     {
-        return 1;
+        size_t sent=0, received=0;
+        if(h->sent<h->size)
+        {
+            sent=node_send(&u->node, h->send+h->sent, h->size-h->sent);
+            h->sent+=sent;
+        }
+        if(u->node.socket!=-1&&h->received<h->size)
+        {
+            received=node_recv(
+                &u->node,
+                h->recv+h->received,
+                h->size-h->received
+            );
+            h->received+=received;
+        }
+        if(u->node.socket==-1)
+        {
+            return 1;
+        }
+        if(h->sent==h->size&&h->received==h->size)
+        {
+            return 0;
+        }
+        if(sent==0&&received==0)
+        {
+            return USER_WOULD_BLOCK;
+        }
     }
-    u->key=key_store_find(keys, recv_message+8);
+}
+static void user_begin_hello(struct user* u, struct key_store* keys)
+{
+    uint8_t hello[USER_HELLO_SIZE]={0};
+    uint32_t features=htobe32(u->offered_features);
+    uint32_t dict_id=htobe32(u->dict_id);
+    //Without a local key the remote's is unknown, and the verdict fails.
+    const struct key* local=u->local_key!=NULL?u->local_key:&keys->local;
+    memcpy(hello, PROTOCOL_ID, 8);
+    memcpy(hello+8, local->id, sizeof(local->id));
+    memcpy(hello+8+sizeof(keys->local.id), &features, 4);
+    memcpy(hello+12+sizeof(keys->local.id), &dict_id, 4);
+    u->handshake.phase=USER_HANDSHAKE_HELLO;
+    user_exchange(u, hello, sizeof(hello));
+}
+static void user_begin_verdict(struct user* u)
+{
     uint8_t local_accept=u->key!=NULL;
-    uint8_t remote_accept=0;
-    if( node_exchange(
-            &u->node,
-            &local_accept,
-            1,
-            &remote_accept,
-            1,
-            &timeout_ms
-        )
-    ){
-        return 4;
-    }
-    if(!remote_accept)
+    u->handshake.phase=USER_HANDSHAKE_VERDICT;
+    user_exchange(u, &local_accept, 1);
+}
+//Looks at the remote's hello. Returns non-zero if it isn't otpchat, or
+//USER_KEY_IN_USE.
+static unsigned user_handle_hello(struct user* u, struct key_store* keys)
+{
+    uint8_t* hello=u->handshake.recv;
+    uint32_t features, dict_id;
+    if(memcmp(hello, PROTOCOL_ID, 8)!=0)
     {
-        return 2;
+        return 1;
     }
-    if(!local_accept)
-    {
-        return 3;
+    memcpy(&features, hello+8+sizeof(keys->local.id), 4);
+    memcpy(&dict_id, hello+12+sizeof(keys->local.id), 4);
+    u->features=u->offered_features&be32toh(features);
+    if(be32toh(dict_id)!=u->dict_id)
+    {//Different dictionaries, fall back to the built-in one.
+        u->features&=~USER_FEATURE_DICT;
+    }
+    u->key=key_store_find(keys, hello+8);
+    if(u->incoming)
+    {//Answered with the local key kept for this remote.
+        if(u->key!=NULL)
+        {
+            u->local_key=key_store_acquire_local(keys, u->key);
+            if(u->local_key==NULL)
+            {
+                return USER_KEY_IN_USE;
+            }
+        }
+        user_begin_hello(u, keys);
+        u->handshake.phase=USER_HANDSHAKE_REPLY;
+        u->handshake.received=u->handshake.size;
+        return 0;
     }
+    user_begin_verdict(u);
     return 0;
 }
 unsigned user_finish_connect(
     struct user* u,
     struct key_store* keys
 ){
-    if(node_error(&u->node))
+    struct user_handshake* h=&u->handshake;
+    if(h->phase==USER_HANDSHAKE_CONNECT)
     {
-        return 1;
+        if(u->race.fd!=-1)
+        {
+            unsigned err=node_race_step(&u->race, &u->node);
+            if(err==NODE_WOULD_BLOCK)
+            {
+                return USER_WOULD_BLOCK;
+            }
+            if(err)
+            {
+                user_disconnect(u);
+                return 1;
+            }
+        }
+        else if(node_error(&u->node))
+        {
+            user_disconnect(u);
+            return 1;
+        }
+        u->key_store=keys;
+        if(u->incoming)
+        {//Who the remote is decides the local key, so it goes first.
+            h->phase=USER_HANDSHAKE_HELLO;
+            h->size=USER_HELLO_SIZE;
+            h->sent=h->size;
+            h->received=0;
+        }
+        else
+        {
+            u->local_key=key_store_acquire_local(keys, NULL);
+            if(u->local_key==NULL)
+            {
+                user_disconnect(u);
+                return USER_KEY_IN_USE;
+            }
+            user_begin_hello(u, keys);
+        }
     }
-    if(user_handshake(u, keys, TIMEOUT_MS))
+    unsigned fail=1;
+    for(;;)
     {
-        user_disconnect(u);
-        return 1;
+        unsigned err=user_exchange_step(u);
+        if(err==USER_WOULD_BLOCK)
+        {
+            return err;
+        }
+        if(err)
+        {
+            break;
+        }
+        if(h->phase==USER_HANDSHAKE_HELLO)
+        {
+            unsigned hello_err=user_handle_hello(u, keys);
+            if(hello_err)
+            {
+                fail=hello_err;
+                break;
+            }
+            continue;
+        }
+        if(h->phase==USER_HANDSHAKE_REPLY)
+        {
+            user_begin_verdict(u);
+            continue;
+        }
+        //Both ends have to know each other's key.
+        if(!h->recv[0]||!h->send[0])
+        {
+            break;
+        }
+        u->state=CONNECTED;
+        h->phase=USER_HANDSHAKE_CONNECT;
+        return 0;
     }
-    u->state=CONNECTED;
-    return 0;
+    user_disconnect(u);
+    return fail;
 }
 unsigned user_accept(
     struct user* u,
-    struct node* listen_node,
-    struct key_store* keys
+    struct node* listen_node
 ){
-    if(node_accept(listen_node, &u->node))
+    user_disconnect(u);
+    unsigned err=node_accept(listen_node, &u->node);
+    if(err)
     {
-        return 1;
+        return err;
+    }
+    u->state=CONNECTING;
+    u->incoming=1;
+    u->handshake.phase=USER_HANDSHAKE_CONNECT;
+    return 0;
+}
+unsigned user_wants(const struct user* u)
+{
+    const struct user_handshake* h=&u->handshake;
+    if(h->phase==USER_HANDSHAKE_RESOLVE)
+    {
+        return 0;
     }
-    return user_finish_connect(u, keys);
+    if(h->phase==USER_HANDSHAKE_CONNECT)
+    {//The race is read like any other epoll set.
+        return u->race.fd!=-1?LOOP_READ:LOOP_WRITE;
+    }
+    return (h->sent<h->size?LOOP_WRITE:0)|
+        (h->received<h->size?LOOP_READ:0);
+}
+int user_fd(const struct user* u)
+{
+    return u->race.fd!=-1?u->race.fd:u->node.socket;
 }
 void user_disconnect(struct user* u)
 {
+    node_race_end(&u->race);
     node_close(&u->node);
     u->state=NOT_CONNECTED;
+    u->features=0;
+    if(u->key_store!=NULL)
+    {
+        if(u->key!=NULL)
+        {
+            key_store_release(u->key_store, u->key);
+        }
+        if(u->local_key!=NULL)
+        {
+            key_store_release_local(u->key_store, u->local_key);
+        }
+        u->key=NULL;
+        u->local_key=NULL;
+        u->key_store=NULL;
+    }
 }
 void user_close(struct user* u)
 {
@@ -28,33 +28,110 @@ SOFTWARE.
     #define ID_STATUS  0
     #define ID_LOCAL  1
     #define ID_REMOTE 2
+    //Optional protocol features, used when both ends offer them.
+    #define USER_FEATURE_COMPRESS 0x1
+    //Compress with the trained codebook both ends were given.
+    #define USER_FEATURE_DICT 0x2
+    //Variable length frame headers, see frame.h.
+    #define USER_FEATURE_COMPACT_HEADER 0x4
+    //File frames, see /sendfile.
+    #define USER_FEATURE_FILES 0x8
+    #define USER_DEFAULT_FEATURES \
+        (USER_FEATURE_COMPRESS|USER_FEATURE_COMPACT_HEADER|USER_FEATURE_FILES)
+
+    //Handshakes that haven't finished by then fail.
+    #define USER_HANDSHAKE_TIMEOUT_MS 2000
+    //Returned while the handshake waits for the socket.
+    #define USER_WOULD_BLOCK NODE_WOULD_BLOCK
+    //Returned when the local key for the remote is taken by another
+    //connection, see key_store_acquire_local().
+    #define USER_KEY_IN_USE 3
+    //Protocol id, key id, features and dictionary id.
+    #define USER_HELLO_SIZE (8+16+8)
 
     enum connection_state
     {
         NOT_CONNECTED=0,
+        //The socket is connecting, or the handshake is in progress.
         CONNECTING,
         CONNECTED
     };
+    enum user_handshake_phase
+    {
+        //Waiting for the name to be resolved.
+        USER_HANDSHAKE_RESOLVE=0,
+        //Waiting for the socket to connect.
+        USER_HANDSHAKE_CONNECT,
+        //Swapping hello messages. Incoming connections only receive here.
+        USER_HANDSHAKE_HELLO,
+        //Sending the hello of an incoming connection, once the remote's
+        //has picked the local key.
+        USER_HANDSHAKE_REPLY,
+        //Swapping whether either end knows the other's key.
+        USER_HANDSHAKE_VERDICT
+    };
+    //The messages of the current phase, sent and received a piece at a time
+    //as the socket allows.
+    struct user_handshake
+    {
+        enum user_handshake_phase phase;
+        uint8_t send[USER_HELLO_SIZE];
+        uint8_t recv[USER_HELLO_SIZE];
+        size_t size;
+        size_t sent, received;
+    };
     struct user
     {
         struct key* key;
+        //The local key sent with to this remote, from
+        //key_store_acquire_local().
+        struct key* local_key;
+        //Where key and local_key came from, they're released back on
+        //disconnect. NULL if the keys aren't owned through a store.
+        struct key_store* key_store;
+        //Set for accepted connections.
+        unsigned incoming;
         struct node node;
+        //Attempts to connect to the remote, until one of them does.
+        struct node_race race;
         char* name;
         enum connection_state state;
         uint32_t id;
+        //Features sent in the handshake, and the ones both ends agreed on.
+        uint32_t offered_features;
+        uint32_t features;
+        //Id of the trained codebook offered with USER_FEATURE_DICT.
+        uint32_t dict_id;
+        struct user_handshake handshake;
     };
     void user_init(struct user* u, uint32_t id);
     void user_set_name(struct user* u, const char* name);
-    unsigned user_begin_connect(struct user* u, struct address* addr);
+    //Marks u CONNECTING while the address is being resolved.
+    void user_begin_resolve(struct user* u);
+    //Starts connecting to the resolved addresses, all of them if need be.
+    unsigned user_begin_connect(
+        struct user* u,
+        const struct addrinfo* address
+    );
+    //Carries the handshake of a CONNECTING user on as far as the socket
+    //allows, without blocking. Returns 0 once it's CONNECTED,
+    //USER_WOULD_BLOCK when it has to wait for what user_wants() says, or
+    //non-zero on failure, in which case the user is disconnected.
     unsigned user_finish_connect(
         struct user* u,
         struct key_store* keys
     );
+    //Accepts a connection and starts the handshake with it, continue with
+    //user_finish_connect(). Returns NODE_WOULD_BLOCK if there was no
+    //connection to accept.
     unsigned user_accept(
         struct user* u,
-        struct node* listen_node,
-        struct key_store* keys
+        struct node* listen_node
     );
+    //LOOP_READ and LOOP_WRITE for what a CONNECTING user is waiting for.
+    unsigned user_wants(const struct user* u);
+    //Descriptor to wait on, the socket unless it's still being connected.
+    int user_fd(const struct user* u);
     void user_disconnect(struct user* u);
     void user_close(struct user* u);
 #endif
@@ -0,0 +1,241 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "xor.h"
+#include <string.h>
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#define XOR_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*xor_function)(
+    uint8_t* dst,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t size
+);
+struct xor_kernel
+{
+    const char* name;
+    xor_function fn;
+    unsigned (*supported)(void);
+};
+
+static void xor_scalar(
+    uint8_t* dst,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t size
+){
+    size_t i=0;
+    //memcpy() keeps this free of alignment and aliasing issues, compilers
+    //turn it into plain loads and stores.
+    for(;i+sizeof(uint64_t)<=size;i+=sizeof(uint64_t))
+    {
+        uint64_t wa, wb;
+        memcpy(&wa, a+i, sizeof(wa));
+        memcpy(&wb, b+i, sizeof(wb));
+        wa^=wb;
+        memcpy(dst+i, &wa, sizeof(wa));
+    }
+    for(;i<size;++i)
+    {
+        dst[i]=a[i]^b[i];
+    }
+}
+static unsigned xor_scalar_supported(void)
+{
+    return 1;
+}
+#ifdef XOR_X86
+__attribute__((target("sse2")))
+static void xor_sse2(
+    uint8_t* dst,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t size
+){
+    size_t i=0;
+    for(;i+64<=size;i+=64)
+    {
+        __m128i a0=_mm_loadu_si128((const __m128i*)(a+i));
+        __m128i a1=_mm_loadu_si128((const __m128i*)(a+i+16));
+        __m128i a2=_mm_loadu_si128((const __m128i*)(a+i+32));
+        __m128i a3=_mm_loadu_si128((const __m128i*)(a+i+48));
+        __m128i b0=_mm_loadu_si128((const __m128i*)(b+i));
+        __m128i b1=_mm_loadu_si128((const __m128i*)(b+i+16));
+        __m128i b2=_mm_loadu_si128((const __m128i*)(b+i+32));
+        __m128i b3=_mm_loadu_si128((const __m128i*)(b+i+48));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(a0, b0));
+        _mm_storeu_si128((__m128i*)(dst+i+16), _mm_xor_si128(a1, b1));
+        _mm_storeu_si128((__m128i*)(dst+i+32), _mm_xor_si128(a2, b2));
+        _mm_storeu_si128((__m128i*)(dst+i+48), _mm_xor_si128(a3, b3));
+    }
+    for(;i+16<=size;i+=16)
+    {
+        __m128i va=_mm_loadu_si128((const __m128i*)(a+i));
+        __m128i vb=_mm_loadu_si128((const __m128i*)(b+i));
+        _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(va, vb));
+    }
+    xor_scalar(dst+i, a+i, b+i, size-i);
+}
+static unsigned xor_sse2_supported(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+__attribute__((target("avx2")))
+static void xor_avx2(
+    uint8_t* dst,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t size
+){
+    size_t i=0;
+    for(;i+128<=size;i+=128)
+    {
+        __m256i a0=_mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i a1=_mm256_loadu_si256((const __m256i*)(a+i+32));
+        __m256i a2=_mm256_loadu_si256((const __m256i*)(a+i+64));
+        __m256i a3=_mm256_loadu_si256((const __m256i*)(a+i+96));
+        __m256i b0=_mm256_loadu_si256((const __m256i*)(b+i));
+        __m256i b1=_mm256_loadu_si256((const __m256i*)(b+i+32));
+        __m256i b2=_mm256_loadu_si256((const __m256i*)(b+i+64));
+        __m256i b3=_mm256_loadu_si256((const __m256i*)(b+i+96));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(a0, b0));
+        _mm256_storeu_si256((__m256i*)(dst+i+32), _mm256_xor_si256(a1, b1));
+        _mm256_storeu_si256((__m256i*)(dst+i+64), _mm256_xor_si256(a2, b2));
+        _mm256_storeu_si256((__m256i*)(dst+i+96), _mm256_xor_si256(a3, b3));
+    }
+    for(;i+32<=size;i+=32)
+    {
+        __m256i va=_mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i vb=_mm256_loadu_si256((const __m256i*)(b+i));
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(va, vb));
+    }
+    xor_sse2(dst+i, a+i, b+i, size-i);
+}
+static unsigned xor_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+__attribute__((target("avx512f")))
+static void xor_avx512(
+    uint8_t* dst,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t size
+){
+    size_t i=0;
+    for(;i+256<=size;i+=256)
+    {
+        __m512i a0=_mm512_loadu_si512((const void*)(a+i));
+        __m512i a1=_mm512_loadu_si512((const void*)(a+i+64));
+        __m512i a2=_mm512_loadu_si512((const void*)(a+i+128));
+        __m512i a3=_mm512_loadu_si512((const void*)(a+i+192));
+        __m512i b0=_mm512_loadu_si512((const void*)(b+i));
+        __m512i b1=_mm512_loadu_si512((const void*)(b+i+64));
+        __m512i b2=_mm512_loadu_si512((const void*)(b+i+128));
+        __m512i b3=_mm512_loadu_si512((const void*)(b+i+192));
+        _mm512_storeu_si512((void*)(dst+i), _mm512_xor_si512(a0, b0));
+        _mm512_storeu_si512((void*)(dst+i+64), _mm512_xor_si512(a1, b1));
+        _mm512_storeu_si512((void*)(dst+i+128), _mm512_xor_si512(a2, b2));
+        _mm512_storeu_si512((void*)(dst+i+192), _mm512_xor_si512(a3, b3));
+    }
+    for(;i+64<=size;i+=64)
+    {
+        __m512i va=_mm512_loadu_si512((const void*)(a+i));
+        __m512i vb=_mm512_loadu_si512((const void*)(b+i));
+        _mm512_storeu_si512((void*)(dst+i), _mm512_xor_si512(va, vb));
+    }
+    xor_sse2(dst+i, a+i, b+i, size-i);
+}
+static unsigned xor_avx512_supported(void)
+{
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+
+//Ordered from the most to the least preferred.
+static const struct xor_kernel xor_kernels[]={
+#ifdef XOR_X86
+    {"avx512", xor_avx512, xor_avx512_supported},
+    {"avx2", xor_avx2, xor_avx2_supported},
+    {"sse2", xor_sse2, xor_sse2_supported},
+#endif
+    {"scalar", xor_scalar, xor_scalar_supported}
+};
+//Read and written atomically, the crypto thread XORs too. Threads that
+//pick the kernel at the same time pick the same one.
+static const struct xor_kernel* xor_current=NULL;
+
+static const struct xor_kernel* xor_pick(void)
+{
+    const struct xor_kernel* k=__atomic_load_n(&xor_current, __ATOMIC_ACQUIRE);
+    if(k==NULL)
+    {
+#ifdef XOR_X86
+        __builtin_cpu_init();
+#endif
+        for(size_t i=0;i<sizeof(xor_kernels)/sizeof(xor_kernels[0]);++i)
+        {
+            if(xor_kernels[i].supported())
+            {
+                k=&xor_kernels[i];
+                break;
+            }
+        }
+        __atomic_store_n(&xor_current, k, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+void xor_blocks(
+    uint8_t* dst,
+    const uint8_t* a,
+    const uint8_t* b,
+    size_t size
+){
+    xor_pick()->fn(dst, a, b, size);
+}
+const char* xor_kernel_name(void)
+{
+    return xor_pick()->name;
+}
+unsigned xor_use_kernel(const char* name)
+{
+#ifdef XOR_X86
+    __builtin_cpu_init();
+#endif
+    for(size_t i=0;i<sizeof(xor_kernels)/sizeof(xor_kernels[0]);++i)
+    {
+        if(strcmp(xor_kernels[i].name, name)==0)
+        {
+            if(!xor_kernels[i].supported())
+            {
+                return 1;
+            }
+            __atomic_store_n(&xor_current, &xor_kernels[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return 1;
+}
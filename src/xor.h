@@ -0,0 +1,42 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2016 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef OTPCHAT_XOR_H_
+#define OTPCHAT_XOR_H_
+    #include <stdint.h>
+    #include <stddef.h>
+
+    //Computes dst[i]=a[i]^b[i] for size bytes. dst may be the same buffer as
+    //a or b. The fastest kernel supported by the CPU is picked on first use.
+    void xor_blocks(
+        uint8_t* dst,
+        const uint8_t* a,
+        const uint8_t* b,
+        size_t size
+    );
+    //Name of the kernel currently in use.
+    const char* xor_kernel_name(void);
+    //Forces the given kernel ("scalar", "sse2", "avx2" or "avx512").
+    //Returns non-zero if it's unknown or not supported by this CPU.
+    unsigned xor_use_kernel(const char* name);
+#endif